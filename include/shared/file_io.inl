@@ -15,6 +15,11 @@ EEND()
 EBEGIN()
 // If set, try to create folder
 EPNV(CreateFolder, 1)
+
+// If set, write to a temp file alongside, then rename it over the
+// original, so readers see either the old file or the new one and never a
+// partial one.
+EPNV(AtomicReplace, 2)
 EEND()
 #undef ENAME
 
@@ -0,0 +1,299 @@
+#ifndef HEADER_33E74C3CF237476CB1A5555329057145 // -*- mode:c++ -*-
+#define HEADER_33E74C3CF237476CB1A5555329057145
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The lock-free bits of the library, as templates written with the
+// relacy.h wrappers. The library instantiates them with its own structs,
+// and tests/test_relacy.cpp with cut-down structs that have the same
+// member names but Relacy atomics, so the models check the real code.
+//
+// For the Relacy version, define USE_RELACY 1 first, as per relacy.h. Not
+// really part of the public interface.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include "relacy.h"
+#include <stdint.h>
+#include <stddef.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Requests made by setting an atomic<bool> flag, and picked up by whichever
+// thread next gets round to it - see MutexMetadataImplBase::RequestReset.
+
+template <class FlagType>
+static inline void PostLockFreeRequest(FlagType *flag) {
+    flag->store(true, RMO_RELEASE);
+}
+
+// True if there was a request, which the caller now has to act on. Only one
+// caller gets each request. Checks before exchanging, so the flag's cache
+// line isn't written every time.
+template <class FlagType>
+static inline bool TakeLockFreeRequest(FlagType *flag) {
+    if (!flag->load(RMO_RELAXED)) {
+        return false;
+    }
+
+    return flag->exchange(false, RMO_ACQ_REL);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Single writer ring buffer - see TraceThreadBuffer. BufferType has atomic
+// in_use, write_index and clear_index members, and a power of 2-sized slots
+// array of structs of atomics.
+
+// fill(slot) stores the event's fields, relaxed.
+template <class BufferType, class FunType>
+static inline void WriteRingBufferSlot(BufferType *buffer, FunType &&fill) {
+    static constexpr uint64_t NUM_SLOTS = sizeof BufferType::slots / sizeof BufferType::slots[0];
+    static_assert((NUM_SLOTS & (NUM_SLOTS - 1)) == 0);
+
+    uint64_t index = buffer->write_index.load(RMO_RELAXED);
+
+    // Pairs with the acquire fence in ReadRingBufferSlots: a reader that
+    // sees any of the new values will also see the write_index stores made
+    // so far.
+    RFENCE(RMO_RELEASE);
+
+    fill(&buffer->slots[index & (NUM_SLOTS - 1)]);
+
+    buffer->write_index.store(index + 1, RMO_RELEASE);
+}
+
+// Calls read(slot) for each slot that might hold an event since the last
+// clear, oldest first, loading the fields relaxed. Returns how many of
+// those to discard from the start, as they might have been overwritten in
+// the meantime.
+template <class BufferType, class FunType>
+static inline uint64_t ReadRingBufferSlots(const BufferType *buffer, FunType &&read) {
+    static constexpr uint64_t NUM_SLOTS = sizeof BufferType::slots / sizeof BufferType::slots[0];
+
+    uint64_t end_index = buffer->write_index.load(RMO_ACQUIRE);
+
+    uint64_t begin_index = buffer->clear_index.load(RMO_ACQUIRE);
+    if (end_index - begin_index > NUM_SLOTS) {
+        begin_index = end_index - NUM_SLOTS;
+    }
+
+    for (uint64_t index = begin_index; index < end_index; ++index) {
+        read(&buffer->slots[index & (NUM_SLOTS - 1)]);
+    }
+
+    // If the buffer has an owner, it could also be partway through writing
+    // index new_end_index.
+    RFENCE(RMO_ACQUIRE);
+    uint64_t num_being_written = buffer->in_use.load(RMO_RELAXED) ? 1 : 0;
+    uint64_t new_end_index = buffer->write_index.load(RMO_RELAXED) + num_being_written;
+    if (new_end_index <= begin_index + NUM_SLOTS) {
+        return 0;
+    }
+
+    uint64_t num_overwritten = new_end_index - (begin_index + NUM_SLOTS);
+    if (num_overwritten > end_index - begin_index) {
+        num_overwritten = end_index - begin_index;
+    }
+
+    return num_overwritten;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Seqlock-protected stripe of TimerDef totals - see TimerDefStripe.
+// StripeType has an atomic uint32_t seq, odd while the stripe is being
+// updated, and atomic uint64_t total_num_ticks, num_samples,
+// self_num_ticks and perf_counters[]. TotalsType has the same, as plain
+// uint64_ts. The writers lock the seqlock, so it also stops them
+// interfering with one another.
+
+// Makes the sequence number odd, waiting for any other writer to finish
+// first. Returns the old (even) value, for UnlockTimerDefStripe.
+template <class StripeType>
+static inline uint32_t LockTimerDefStripe(StripeType *stripe) {
+    uint32_t seq = stripe->seq.load(RMO_RELAXED);
+    for (;;) {
+        if (seq & 1) {
+            RYIELD();
+            seq = stripe->seq.load(RMO_RELAXED);
+        } else if (stripe->seq.compare_exchange_weak(seq, seq + 1, RMO_ACQUIRE, RMO_RELAXED)) {
+            break;
+        }
+    }
+
+    // Readers that see any of the following stores must also see the odd
+    // sequence number.
+    RFENCE(RMO_RELEASE);
+
+    return seq;
+}
+
+template <class StripeType>
+static inline void UnlockTimerDefStripe(StripeType *stripe, uint32_t seq) {
+    stripe->seq.store(seq + 2, RMO_RELEASE);
+}
+
+// perf_counter_deltas may be null.
+template <class StripeType>
+static inline void AddToTimerDefStripe(StripeType *stripe, uint64_t num_ticks, uint64_t self_num_ticks, const uint64_t *perf_counter_deltas) {
+    static constexpr size_t NUM_PERF_COUNTERS = sizeof StripeType::perf_counters / sizeof StripeType::perf_counters[0];
+
+    uint32_t seq = LockTimerDefStripe(stripe);
+
+    // Only this thread can be writing, so there's no need for RMWs.
+    stripe->total_num_ticks.store(stripe->total_num_ticks.load(RMO_RELAXED) + num_ticks, RMO_RELAXED);
+    stripe->num_samples.store(stripe->num_samples.load(RMO_RELAXED) + 1, RMO_RELAXED);
+    stripe->self_num_ticks.store(stripe->self_num_ticks.load(RMO_RELAXED) + self_num_ticks, RMO_RELAXED);
+
+    if (perf_counter_deltas) {
+        for (size_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+            stripe->perf_counters[i].store(stripe->perf_counters[i].load(RMO_RELAXED) + perf_counter_deltas[i], RMO_RELAXED);
+        }
+    }
+
+    UnlockTimerDefStripe(stripe, seq);
+}
+
+template <class StripeType>
+static inline void ResetTimerDefStripe(StripeType *stripe) {
+    static constexpr size_t NUM_PERF_COUNTERS = sizeof StripeType::perf_counters / sizeof StripeType::perf_counters[0];
+
+    uint32_t seq = LockTimerDefStripe(stripe);
+
+    stripe->total_num_ticks.store(0, RMO_RELAXED);
+    stripe->num_samples.store(0, RMO_RELAXED);
+    stripe->self_num_ticks.store(0, RMO_RELAXED);
+
+    for (size_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        stripe->perf_counters[i].store(0, RMO_RELAXED);
+    }
+
+    UnlockTimerDefStripe(stripe, seq);
+}
+
+// Adds the stripe's values to *totals and zeroes them, all in one go, so
+// nothing added in between goes missing.
+template <class StripeType, class TotalsType>
+static inline void TakeTimerDefStripe(StripeType *stripe, TotalsType *totals) {
+    static constexpr size_t NUM_PERF_COUNTERS = sizeof StripeType::perf_counters / sizeof StripeType::perf_counters[0];
+
+    uint32_t seq = LockTimerDefStripe(stripe);
+
+    totals->total_num_ticks += stripe->total_num_ticks.exchange(0, RMO_RELAXED);
+    totals->num_samples += stripe->num_samples.exchange(0, RMO_RELAXED);
+    totals->self_num_ticks += stripe->self_num_ticks.exchange(0, RMO_RELAXED);
+
+    for (size_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+        totals->perf_counters[i] += stripe->perf_counters[i].exchange(0, RMO_RELAXED);
+    }
+
+    UnlockTimerDefStripe(stripe, seq);
+}
+
+// Adds a consistent read of the stripe's values to *totals. If
+// max_num_tries isn't 0, gives up and returns false if the stripe's still
+// being updated after that many tries.
+template <class StripeType, class TotalsType>
+static inline bool AddTimerDefStripeTotals(const StripeType *stripe, size_t max_num_tries, TotalsType *totals) {
+    static constexpr size_t NUM_PERF_COUNTERS = sizeof StripeType::perf_counters / sizeof StripeType::perf_counters[0];
+
+    for (size_t num_tries = 0;; ++num_tries) {
+        if (max_num_tries > 0 && num_tries >= max_num_tries) {
+            return false;
+        }
+
+        uint32_t seq = stripe->seq.load(RMO_ACQUIRE);
+        if (seq & 1) {
+            RYIELD();
+            continue;
+        }
+
+        uint64_t total_num_ticks = stripe->total_num_ticks.load(RMO_RELAXED);
+        uint64_t num_samples = stripe->num_samples.load(RMO_RELAXED);
+        uint64_t self_num_ticks = stripe->self_num_ticks.load(RMO_RELAXED);
+
+        uint64_t perf_counters[NUM_PERF_COUNTERS];
+        for (size_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+            perf_counters[i] = stripe->perf_counters[i].load(RMO_RELAXED);
+        }
+
+        RFENCE(RMO_ACQUIRE);
+
+        if (stripe->seq.load(RMO_RELAXED) == seq) {
+            totals->total_num_ticks += total_num_ticks;
+            totals->num_samples += num_samples;
+            totals->self_num_ticks += self_num_ticks;
+
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+                totals->perf_counters[i] += perf_counters[i];
+            }
+
+            return true;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Lock-free list of pending registry changes, applied in batches by
+// whoever holds the apply lock - see MutexRegistry. RegistryType has atomic
+// pending_changes_head and num_pending_changes members, and ChangeType a
+// next pointer.
+
+// Returns the number of pending changes including this one, so the caller
+// can decide whether to apply them.
+template <class RegistryType, class ChangeType>
+static inline uint64_t PushRegistryChangeLockFree(RegistryType *registry, ChangeType *change) {
+    ChangeType *head = registry->pending_changes_head.load(RMO_RELAXED);
+    do {
+        RVAL(change->next) = head;
+    } while (!registry->pending_changes_head.compare_exchange_weak(head, change, RMO_RELEASE, RMO_RELAXED));
+
+    return registry->num_pending_changes.fetch_add(1, RMO_ACQ_REL) + 1;
+}
+
+// Call with the apply lock held. If there are no pending changes, sets
+// *oldest to null. Otherwise, calls invalidate_snapshot(), then takes all
+// the changes and sets *oldest to the oldest, linked oldest first.
+//
+// The snapshot is invalidated before the list is taken. Otherwise, a reader
+// could see the empty list and hand out the stale snapshot while the
+// changes were still being applied - missing a change whose push had
+// already returned.
+template <class RegistryType, class ChangeType, class FunType>
+static inline void TakeRegistryChangesLockFree(RegistryType *registry, ChangeType **oldest, FunType &&invalidate_snapshot) {
+    *oldest = nullptr;
+
+    // Only whoever holds the apply lock empties the list.
+    if (!registry->pending_changes_head.load(RMO_ACQUIRE)) {
+        return;
+    }
+
+    invalidate_snapshot();
+
+    ChangeType *change = registry->pending_changes_head.exchange(nullptr, RMO_ACQ_REL);
+
+    // The list is newest first.
+    uint64_t num_changes = 0;
+    while (change) {
+        ChangeType *next = RVAL(change->next);
+        RVAL(change->next) = *oldest;
+        *oldest = change;
+        change = next;
+        ++num_changes;
+    }
+
+    registry->num_pending_changes.fetch_sub(num_changes, RMO_ACQ_REL);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
@@ -9,21 +9,134 @@
 #include <vector>
 #include <memory>
 #include "mutex.h"
+#include "perf_counters.h"
 #include <functional>
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
 class MetricSet;
+struct MetricsGlobals;
+class MetricsSharedMemory;
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// Plain copy of a Histogram's contents.
+struct HistogramSnapshot {
+    // one entry per Histogram bucket, or empty if nothing was ever recorded.
+    std::vector<uint64_t> counts;
+    uint64_t num_samples = 0;
+    uint64_t max = 0;
+
+    // percentile is 0-100. The result is the upper bound of the bucket the
+    // percentile falls in, clamped to max, so it's within
+    // 1/HISTOGRAM_NUM_SUB_BUCKETS of the true value. 0 if there are no
+    // samples.
+    uint64_t GetPercentile(double percentile) const;
+
+    void Merge(const HistogramSnapshot &other);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Log-linear histogram: each power of 2 range is split into
+// HISTOGRAM_NUM_SUB_BUCKETS linear buckets. Recording is a couple of relaxed
+// atomic ops.
+static constexpr size_t HISTOGRAM_SUB_BUCKET_BITS = 4;
+static constexpr size_t HISTOGRAM_NUM_SUB_BUCKETS = (size_t)1 << HISTOGRAM_SUB_BUCKET_BITS;
+static constexpr size_t HISTOGRAM_NUM_BUCKETS = (64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_NUM_SUB_BUCKETS;
+
+class Histogram {
+  public:
+    Histogram() = default;
+
+    Histogram(const Histogram &) = delete;
+    Histogram &operator=(const Histogram &) = delete;
+    Histogram(Histogram &&) = delete;
+    Histogram &operator=(Histogram &&) = delete;
+
+    void Record(uint64_t value);
+
+    void Reset();
+
+    void GetSnapshot(HistogramSnapshot *snapshot) const;
+
+    // Moves the counts out, so every sample ends up in exactly one snapshot
+    // even when Record is running at the same time. (max may be a little
+    // off in that case.)
+    void GetSnapshotAndReset(HistogramSnapshot *snapshot);
+
+    void Merge(const HistogramSnapshot &snapshot);
+
+    static size_t GetBucketIndex(uint64_t value);
+
+    // Range of values, inclusive, that land in the given bucket.
+    static uint64_t GetBucketMinValue(size_t index);
+    static uint64_t GetBucketMaxValue(size_t index);
+
+  protected:
+  private:
+    std::atomic<uint64_t> m_counts[HISTOGRAM_NUM_BUCKETS] = {};
+    std::atomic<uint64_t> m_max{0};
+
+    void UpdateMax(uint64_t value);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Number of stripes in the metrics that are split up to avoid contention
+// between threads. Each thread always uses the same stripe.
+static constexpr size_t METRICS_NUM_STRIPES = 16;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct TimerDefTotals {
+    uint64_t total_num_ticks = 0;
+    uint64_t num_samples = 0;
+
+    // Exclusive time: total_num_ticks, less the time spent in nested Timers.
+    uint64_t self_num_ticks = 0;
+
+    // Total of the PerfCounters deltas, in whatever mode they were in at the
+    // time. All 0 if PerfCounters were never enabled.
+    uint64_t perf_counters[PERF_COUNTERS_NUM_COUNTERS] = {};
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// One stripe of a TimerDef's totals. This is also the layout in a
+// MetricsSharedMemory segment.
+struct alignas(64) TimerDefStripe {
+    // Odd while the stripe is being updated.
+    std::atomic<uint32_t> seq{0};
+
+    std::atomic<uint64_t> total_num_ticks{0};
+    std::atomic<uint64_t> num_samples{0};
+    std::atomic<uint64_t> self_num_ticks{0};
+
+    // (This fills the rest of the cache line.)
+    std::atomic<uint64_t> perf_counters[PERF_COUNTERS_NUM_COUNTERS] = {};
+};
+
+static_assert(sizeof(TimerDefStripe) == 64);
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The totals are striped, each stripe a seqlock-protected set, so AddTicks
+// is one uncontended update (unless more than METRICS_NUM_STRIPES threads
+// are active) and GetTotals always sees every AddTicks in all the totals or
+// in none.
 class TimerDef {
   public:
     const std::string name;
 
-    ~TimerDef() = default;
+    ~TimerDef();
 
     TimerDef(const TimerDef &) = delete;
     TimerDef &operator=(const TimerDef &) = delete;
@@ -33,46 +146,153 @@ class TimerDef {
 
     void Reset();
 
+    TimerDefTotals GetTotals() const;
+
+    // As GetTotals, zeroing each stripe as it's read, so nothing added in
+    // between goes missing. The histogram, if enabled, is reset the same
+    // way, and moved into *histogram if that isn't null (which is left with
+    // no counts if there's no histogram).
+    TimerDefTotals GetTotalsAndReset(HistogramSnapshot *histogram = nullptr);
+
+    // Adds up METRICS_NUM_STRIPES stripes, as GetTotals. If max_num_tries
+    // isn't 0, gives up and returns false if a stripe's still being updated
+    // after that many tries, for use on stripes written by another process
+    // that might have died part way through.
+    static bool GetStripesTotals(const TimerDefStripe *stripes, size_t max_num_tries, TimerDefTotals *totals);
+
+    // Each of these is a separate GetTotals.
     uint64_t GetTotalNumTicks() const;
     uint64_t GetNumSamples() const;
+    uint64_t GetSelfNumTicks() const;
 
+    // The first form counts all the ticks as self time. perf_counter_deltas
+    // may be null, or point to PERF_COUNTERS_NUM_COUNTERS values.
     void AddTicks(uint64_t num_ticks);
+    void AddTicks(uint64_t num_ticks, uint64_t self_num_ticks, const uint64_t *perf_counter_deltas = nullptr);
 
+    // For a TimerDef created with CreateAutoTimerDef, the parent is null
+    // until it's first used.
     const TimerDef *GetParent() const;
     std::vector<const TimerDef *> GetChildren() const;
 
+    // Start recording a histogram of the tick counts, in addition to the
+    // totals. Safe to call at any time. Once enabled, it stays enabled.
+    void EnableHistogram();
+
+    // Null if EnableHistogram was never called. Valid for as long as the
+    // TimerDef is.
+    Histogram *GetHistogram() const;
+
+    // Timer tracing. See Timer::SetTracingEnabled.
+    void AddTraceBeginEvent(uint64_t ticks);
+    void AddTraceEndEvent(uint64_t ticks);
+
   protected:
   private:
     MetricSet *const m_set = nullptr;
+
+    // lock m_set->m_mutex before accessing.
     TimerDef *m_parent = nullptr;
     std::vector<TimerDef *> m_children;
 
-    std::atomic<uint64_t> m_total_num_ticks{0};
-    std::atomic<uint64_t> m_num_samples{0};
+    // Set by CreateAutoTimerDef. Cleared, with the lock held, once the
+    // parent has been decided.
+    std::atomic<bool> m_auto_parent{false};
+
+    // METRICS_NUM_STRIPES stripes, either m_local_stripes or storage owned
+    // by the set - its MetricsSharedMemory, or one of its slabs.
+    std::unique_ptr<TimerDefStripe[]> m_local_stripes;
+    TimerDefStripe *m_stripes = nullptr;
+
+    // Owned by this.
+    std::atomic<Histogram *> m_histogram{nullptr};
+
+    // 0 until the first trace event.
+    std::atomic<uint32_t> m_trace_name_id{0};
+
+    uint32_t GetTraceNameID();
+    void SetAutoParent(const TimerDef *outer_def);
 
-    explicit TimerDef(std::string name, MetricSet *set);
+    // If set_stripes is null, the stripes are allocated locally.
+    explicit TimerDef(std::string name, MetricSet *set, TimerDefStripe *set_stripes = nullptr);
 
     friend class MetricSet;
+    friend class Timer;
+    friend class SamplingProfiler;
 };
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// Each thread has a stack of its active Timers, so that each Timer can
+// subtract the time spent in the Timers nested inside it, to get its self
+// time. (Timers with a null TimerDef aren't on the stack, so their time
+// counts as the enclosing Timer's self time.)
+//
+// Timers must be destroyed on the thread that created them, in reverse
+// order, as is natural for scoped objects.
 class Timer {
   public:
     explicit inline Timer(TimerDef *def)
-        : m_def(def)
-        , m_begin_ticks(GetCurrentTickCount()) {
+        : m_def(def) {
+        if (m_def) {
+            m_outer = ms_current;
+
+            // The SamplingProfiler signal handler could walk the stack at
+            // any point.
+            std::atomic_signal_fence(std::memory_order_release);
+            ms_current = this;
+
+            if (m_def->m_auto_parent.load(std::memory_order_relaxed)) {
+                m_def->SetAutoParent(m_outer ? m_outer->m_def : nullptr);
+            }
+
+            // (Before getting the ticks, so the ticks don't include the
+            // syscall.)
+            if (PerfCounters::IsEnabled()) {
+                m_perf = PerfCounters::ReadThreadCounters(&m_perf_begin);
+            }
+        }
+
+        m_begin_ticks = GetCurrentTickCount();
+
+        if (ms_tracing_enabled.load(std::memory_order_relaxed) && m_def) {
+            m_traced = true;
+            m_def->AddTraceBeginEvent(m_begin_ticks);
+        }
     }
 
     inline ~Timer() {
         uint64_t end_ticks = GetCurrentTickCount();
 
         if (m_def) {
-            m_def->AddTicks(end_ticks - m_begin_ticks);
+            uint64_t num_ticks = end_ticks - m_begin_ticks;
+
+            ms_current = m_outer;
+            if (m_outer) {
+                m_outer->m_nested_num_ticks += num_ticks;
+            }
+
+            if (m_perf) {
+                this->AddTicksAndPerfCounters(num_ticks, num_ticks - m_nested_num_ticks);
+            } else {
+                m_def->AddTicks(num_ticks, num_ticks - m_nested_num_ticks);
+            }
+
+            if (m_traced) {
+                m_def->AddTraceEndEvent(end_ticks);
+            }
         }
     }
 
+    // When enabled, each Timer adds begin and end events to the trace
+    // buffers (see shared/trace.h), named after its TimerDef, for a
+    // per-thread view of when each scope ran. Get the results with
+    // GetChromeTraceJSON. When disabled, the cost is one relaxed load per
+    // Timer.
+    static void SetTracingEnabled(bool enabled);
+    static bool IsTracingEnabled();
+
     Timer(const Timer &) = delete;
     Timer &operator=(const Timer &) = delete;
 
@@ -84,6 +304,27 @@ class Timer {
   private:
     TimerDef *m_def = nullptr;
     uint64_t m_begin_ticks = 0;
+
+    // Next Timer out on this thread's stack.
+    Timer *m_outer = nullptr;
+
+    // Total time of the Timers directly nested in this one.
+    uint64_t m_nested_num_ticks = 0;
+
+    // Whether the begin event was added, so the end event matches even if
+    // tracing is switched off in between.
+    bool m_traced = false;
+
+    // Whether m_perf_begin is valid.
+    bool m_perf = false;
+    PerfCounterValues m_perf_begin;
+
+    static std::atomic<bool> ms_tracing_enabled;
+    static thread_local Timer *ms_current;
+
+    void AddTicksAndPerfCounters(uint64_t num_ticks, uint64_t self_num_ticks);
+
+    friend class SamplingProfiler;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -104,6 +345,14 @@ class Value {
     virtual void Reset() = 0;
     virtual uint64_t GetValue() const = 0;
 
+    // Resets the value, returning what it was. Updates made at the same time
+    // are either in the result, or the value after the reset. The default
+    // is GetValue then Reset, which doesn't guarantee that.
+    virtual uint64_t GetValueAndReset();
+
+    // If true, GetValue's result is really an int64_t.
+    virtual bool IsSigned() const;
+
   protected:
   private:
 };
@@ -118,7 +367,7 @@ class Counter : public Value {
     virtual ~Counter() = default;
 
     inline void Add(uint64_t n) {
-        m_value.fetch_add(n, std::memory_order_acq_rel);
+        m_value_ptr->fetch_add(n, std::memory_order_acq_rel);
     }
 
     inline void Increment() {
@@ -127,11 +376,15 @@ class Counter : public Value {
 
     void Reset() override;
     uint64_t GetValue() const override;
+    uint64_t GetValueAndReset() override;
 
   protected:
   private:
     std::atomic<uint64_t> m_value{0};
 
+    // Points to m_value, or into the set's MetricsSharedMemory.
+    std::atomic<uint64_t> *m_value_ptr = &m_value;
+
     explicit Counter(std::string name);
 
     friend class MetricSet;
@@ -140,9 +393,276 @@ class Counter : public Value {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// Counter for values that get bumped by lots of threads at once. Each
+// thread adds to one of several cache line-sized stripes, so they don't all
+// fight over the same line; GetValue adds them up.
+//
+// Reset doesn't touch the stripes. It just records the current total, and
+// GetValue subtracts it, so adds that race with a reset are either counted
+// or not, but never half counted.
+class StripedCounter : public Value {
+  public:
+    static constexpr size_t NUM_STRIPES = METRICS_NUM_STRIPES;
+
+    virtual ~StripedCounter() = default;
+
+    void Add(uint64_t n);
+
+    inline void Increment() {
+        this->Add(1);
+    }
+
+    void Reset() override;
+    uint64_t GetValue() const override;
+    uint64_t GetValueAndReset() override;
+
+  protected:
+  private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> value{0};
+    };
+
+    Stripe m_stripes[NUM_STRIPES];
+
+    // Total at the time of the last reset.
+    std::atomic<uint64_t> m_reset_value{0};
+
+    explicit StripedCounter(std::string name);
+
+    uint64_t GetTotal() const;
+
+    friend class MetricSet;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Value that goes up and down - queue depth, number of items in use, etc.
+// It's a level, so Reset does nothing, and GetValueAndReset is just
+// GetValue.
+class Gauge : public Value {
+  public:
+    virtual ~Gauge() = default;
+
+    inline void Set(int64_t value) {
+        m_value_ptr->store(value, std::memory_order_relaxed);
+    }
+
+    inline void Add(int64_t n) {
+        m_value_ptr->fetch_add(n, std::memory_order_relaxed);
+    }
+
+    inline void Sub(int64_t n) {
+        m_value_ptr->fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    inline int64_t GetSignedValue() const {
+        return m_value_ptr->load(std::memory_order_relaxed);
+    }
+
+    void Reset() override;
+    uint64_t GetValue() const override;
+    uint64_t GetValueAndReset() override;
+    bool IsSigned() const override;
+
+  protected:
+  private:
+    std::atomic<int64_t> m_value{0};
+
+    // As Counter::m_value_ptr.
+    std::atomic<int64_t> *m_value_ptr = &m_value;
+
+    explicit Gauge(std::string name);
+
+    friend class MetricSet;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// High-water mark. Update records the largest value seen since the last
+// reset. GetValueAndReset resets as it reads, for a per-interval peak.
+class MaxGauge : public Value {
+  public:
+    virtual ~MaxGauge() = default;
+
+    inline void Update(uint64_t value) {
+        uint64_t max = m_value.load(std::memory_order_relaxed);
+        while (value > max) {
+            if (m_value.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+
+    uint64_t GetValueAndReset() override;
+
+    void Reset() override;
+    uint64_t GetValue() const override;
+
+  protected:
+  private:
+    std::atomic<uint64_t> m_value{0};
+
+    explicit MaxGauge(std::string name);
+
+    friend class MetricSet;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Low-water mark, as MaxGauge. The value is 0 if nothing has been recorded
+// since the last reset.
+class MinGauge : public Value {
+  public:
+    virtual ~MinGauge() = default;
+
+    inline void Update(uint64_t value) {
+        uint64_t min = m_value.load(std::memory_order_relaxed);
+        while (value < min) {
+            if (m_value.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+
+    uint64_t GetValueAndReset() override;
+
+    void Reset() override;
+    uint64_t GetValue() const override;
+
+  protected:
+  private:
+    // UINT64_MAX if nothing recorded.
+    std::atomic<uint64_t> m_value{UINT64_MAX};
+
+    explicit MinGauge(std::string name);
+
+    friend class MetricSet;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Append-only list of pointers, that any number of threads can iterate
+// through with no lock while another appends. Appends must be serialized
+// by the caller.
+//
+// The pointers are kept in fixed-size chunks, so existing entries never
+// move.
+template <class T>
+class MetricsIndex {
+  public:
+    static constexpr size_t CHUNK_SIZE = 64;
+
+    MetricsIndex() = default;
+
+    ~MetricsIndex() {
+        Chunk *chunk = m_first.next.load(std::memory_order_relaxed);
+        while (chunk) {
+            Chunk *next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    MetricsIndex(const MetricsIndex &) = delete;
+    MetricsIndex &operator=(const MetricsIndex &) = delete;
+    MetricsIndex(MetricsIndex &&) = delete;
+    MetricsIndex &operator=(MetricsIndex &&) = delete;
+
+    size_t GetSize() const {
+        return m_size.load(std::memory_order_acquire);
+    }
+
+    void Append(T *item) {
+        size_t size = m_size.load(std::memory_order_relaxed);
+
+        if (size > 0 && size % CHUNK_SIZE == 0) {
+            Chunk *chunk = new Chunk;
+            m_last->next.store(chunk, std::memory_order_release);
+            m_last = chunk;
+        }
+
+        m_last->items[size % CHUNK_SIZE] = item;
+
+        m_size.store(size + 1, std::memory_order_release);
+    }
+
+    // Calls fun for each item appended before the call, in order.
+    template <class FunType>
+    void ForEach(FunType &&fun) const {
+        size_t size = m_size.load(std::memory_order_acquire);
+
+        const Chunk *chunk = &m_first;
+        for (size_t i = 0; i < size; ++i) {
+            if (i > 0 && i % CHUNK_SIZE == 0) {
+                chunk = chunk->next.load(std::memory_order_acquire);
+            }
+
+            fun(chunk->items[i % CHUNK_SIZE]);
+        }
+    }
+
+  protected:
+  private:
+    struct Chunk {
+        T *items[CHUNK_SIZE] = {};
+        std::atomic<Chunk *> next{nullptr};
+    };
+
+    Chunk m_first;
+    std::atomic<size_t> m_size{0};
+
+    // Only touched by Append.
+    Chunk *m_last = &m_first;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Reusing a MetricSetSnapshot allocates nothing once its vectors are big
+// enough.
+struct MetricSetSnapshotValue {
+    // For the name, and IsSigned. Valid for as long as the MetricSet is.
+    const Value *metric = nullptr;
+
+    uint64_t value = 0;
+};
+
+struct MetricSetSnapshotTimerDef {
+    // As MetricSetSnapshotValue::metric.
+    const TimerDef *def = nullptr;
+
+    TimerDefTotals totals;
+
+    // No counts if the TimerDef has no histogram. A Timer finishing during
+    // the snapshot may be in the totals but not the histogram, or vice
+    // versa, but it won't be lost.
+    HistogramSnapshot histogram;
+};
+
+struct MetricSetSnapshot {
+    // In creation order. Metrics are never removed, so an index refers to
+    // the same metric from one snapshot to the next, and values[i] is
+    // GetValues()[i].
+    std::vector<MetricSetSnapshotValue> values;
+    std::vector<MetricSetSnapshotTimerDef> timer_defs;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 class MetricSet : public std::enable_shared_from_this<MetricSet> {
   public:
     static std::shared_ptr<MetricSet> Create(std::string name);
+
+    // The set's Counters, Gauges and TimerDefs keep their values in the
+    // given segment, so other processes can read them. If the segment is
+    // full, they fall back to ordinary storage and just don't appear there.
+    static std::shared_ptr<MetricSet> Create(std::string name, std::shared_ptr<MetricsSharedMemory> shm);
+
     ~MetricSet();
 
     MetricSet(const MetricSet &) = delete;
@@ -163,9 +683,24 @@ class MetricSet : public std::enable_shared_from_this<MetricSet> {
     static TimerDef *CreateTimerDef(const std::shared_ptr<MetricSet> &set, std::string name);
     static TimerDef *CreateTimerDef(const std::shared_ptr<MetricSet> &set, std::string name, TimerDef *parent);
 
+    // Creates a TimerDef whose parent is taken from the Timer nesting: the
+    // first time it's used in a Timer, the enclosing Timer's TimerDef
+    // becomes its parent, if it's from the same set (and that wouldn't make
+    // a cycle). Otherwise, it's a root.
+    static TimerDef *CreateAutoTimerDef(const std::shared_ptr<MetricSet> &set, std::string name);
+
     // If the set is null, a valid, dummy Counter will be returned.
     static Counter *CreateCounter(const std::shared_ptr<MetricSet> &set, std::string name);
 
+    // As CreateCounter. The StripedCounter is listed in GetValues along with
+    // everything else.
+    static StripedCounter *CreateStripedCounter(const std::shared_ptr<MetricSet> &set, std::string name);
+
+    // As CreateCounter.
+    static Gauge *CreateGauge(const std::shared_ptr<MetricSet> &set, std::string name);
+    static MaxGauge *CreateMaxGauge(const std::shared_ptr<MetricSet> &set, std::string name);
+    static MinGauge *CreateMinGauge(const std::shared_ptr<MetricSet> &set, std::string name);
+
     // If the set is null, the derived counter will be discarded.
     //
     // The intention is that the function should capture only Counter * or
@@ -179,11 +714,44 @@ class MetricSet : public std::enable_shared_from_this<MetricSet> {
     void ResetCounters();
     std::vector<const Value *> GetValues() const;
 
+    // Call fun for each Value or TimerDef in the set, in creation order,
+    // without taking any lock or copying anything. Safe to use while
+    // other threads are adding metrics; anything added after the call
+    // starts may or may not be included.
+    template <class FunType>
+    void ForEachValue(FunType &&fun) const {
+        m_all_values.ForEach(std::forward<FunType>(fun));
+    }
+
+    template <class FunType>
+    void ForEachTimerDef(FunType &&fun) const {
+        m_all_timer_defs.ForEach(std::forward<FunType>(fun));
+    }
+
+    // Reads every Value and TimerDef into *snapshot, reusing its storage.
+    // If reset is set, each one is reset as it's read, with nothing lost in
+    // between (see Value::GetValueAndReset and TimerDef::GetTotalsAndReset),
+    // so the results are exact per-interval deltas. Gauges are levels, so
+    // they're read but never reset.
+    void Snapshot(bool reset, MetricSetSnapshot *snapshot);
+
     std::string GetName() const;
     void SetName(std::string name);
 
+    // As above, reusing *name's storage.
+    void GetName(std::string *name) const;
+
     static std::vector<std::shared_ptr<MetricSet>> GetAll();
 
+    // Calls fun for each MetricSet, with the list of sets locked, so
+    // nothing is copied and no set can be destroyed in the meantime. fun
+    // mustn't create or destroy a MetricSet.
+    static void ForEach(const std::function<void(const MetricSet *)> &fun);
+
+    // The MetricSet with the given name that the METRIC_*_DEFINE macros
+    // register into, creating it if necessary. It lives forever.
+    static std::shared_ptr<MetricSet> GetNamed(const char *name);
+
     // Safe to call at any time, including as part of global initialization.
     std::shared_ptr<MetricSet> GetGlobal();
 
@@ -191,23 +759,43 @@ class MetricSet : public std::enable_shared_from_this<MetricSet> {
   private:
     mutable Mutex m_mutex;
 
+    // May be null. Must outlive the TimerDefs and Values.
+    const std::shared_ptr<MetricsSharedMemory> m_shm;
+
+    // Every TimerDef and Value, all owned by the set. Lock m_mutex before
+    // appending.
+    MetricsIndex<TimerDef> m_all_timer_defs;
+    MetricsIndex<Value> m_all_values;
+
     // lock m_mutex before accessing.
-    std::vector<std::unique_ptr<TimerDef>> m_all_timer_defs;
     std::vector<const TimerDef *> m_root_timer_defs;
     std::string m_name;
-    std::vector<std::unique_ptr<Value>> m_all_values_unique;
-    std::vector<const Value *> m_all_values_raw;
+
+    // lock m_mutex before accessing. m_shm entries to retire when the set
+    // is destroyed.
+    std::vector<uint32_t> m_shm_entry_indexes;
+
+    // lock m_mutex before accessing. Storage for the metrics - see
+    // AllocateLocked.
+    std::vector<void *> m_slabs;
+    uint8_t *m_slab_next = nullptr;
+    uint8_t *m_slab_end = nullptr;
 
     // lock g_all_metric_sets_mutex before accessing.
     MetricSet *m_next = nullptr;
     MetricSet *m_prev = nullptr;
 
     static TimerDef *CreateTimerDef2(const std::shared_ptr<MetricSet> &set, std::string name, TimerDef *parent);
-    explicit MetricSet(std::string name);
+    explicit MetricSet(std::string name, std::shared_ptr<MetricsSharedMemory> shm);
     static void CheckLockedList();
     void LinkIntoLockedList();
-    static std::shared_ptr<MetricSet> Create2(std::string name);
-    void AddValue(Value *value);
+    static std::shared_ptr<MetricSet> Create2(std::string name, std::shared_ptr<MetricsSharedMemory> shm = nullptr);
+    void *AllocateLocked(size_t size, size_t alignment);
+    void AddLockedValue(Value *value);
+    std::string GetLockedShmEntryName(const TimerDef *parent, const std::string &name) const;
+
+    template <class ValueType>
+    static ValueType *CreateValue(const std::shared_ptr<MetricSet> &set, std::string name, std::unique_ptr<ValueType> MetricsGlobals::*dummy_mptr);
 
     friend class TimerDef;
 };
@@ -215,4 +803,146 @@ class MetricSet : public std::enable_shared_from_this<MetricSet> {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// Counter defined with METRIC_COUNTER_DEFINE. It's created, in the named
+// MetricSet, the first time it's used.
+//
+// The constructor is constexpr, so it's safe to use one from any other
+// global initializer.
+class StaticCounter {
+  public:
+    constexpr StaticCounter(const char *set_name, const char *name)
+        : m_set_name(set_name)
+        , m_name(name) {
+    }
+
+    StaticCounter(const StaticCounter &) = delete;
+    StaticCounter &operator=(const StaticCounter &) = delete;
+    StaticCounter(StaticCounter &&) = delete;
+    StaticCounter &operator=(StaticCounter &&) = delete;
+
+    inline Counter *Get() {
+        Counter *counter = m_counter.load(std::memory_order_acquire);
+        if (!counter) {
+            counter = this->Register();
+        }
+
+        return counter;
+    }
+
+  protected:
+  private:
+    const char *const m_set_name;
+    const char *const m_name;
+    std::atomic<Counter *> m_counter{nullptr};
+
+    Counter *Register();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// TimerDef defined with METRIC_TIMER_DEFINE or METRIC_TIMER_CHILD_DEFINE,
+// as StaticCounter. A child goes in its parent's MetricSet.
+class StaticTimerDef {
+  public:
+    constexpr StaticTimerDef(const char *set_name, const char *name)
+        : m_set_name(set_name)
+        , m_name(name) {
+    }
+
+    constexpr StaticTimerDef(StaticTimerDef *parent, const char *name)
+        : m_name(name)
+        , m_parent(parent) {
+    }
+
+    StaticTimerDef(const StaticTimerDef &) = delete;
+    StaticTimerDef &operator=(const StaticTimerDef &) = delete;
+    StaticTimerDef(StaticTimerDef &&) = delete;
+    StaticTimerDef &operator=(StaticTimerDef &&) = delete;
+
+    inline TimerDef *Get() {
+        TimerDef *def = m_def.load(std::memory_order_acquire);
+        if (!def) {
+            def = this->Register();
+        }
+
+        return def;
+    }
+
+  protected:
+  private:
+    const char *const m_set_name = nullptr;
+    const char *const m_name;
+    StaticTimerDef *const m_parent = nullptr;
+    std::atomic<TimerDef *> m_def{nullptr};
+
+    const char *GetSetName() const;
+    TimerDef *Register();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// These macros define metrics that can be used from any source file, even
+// when the definition isn't visible, without having to pass pointers
+// around, in the style of the LOG macros. Each metric is named after the
+// identifier, and goes in the MetricSet with the given name (see
+// MetricSet::GetNamed).
+//
+// METRIC_TIMER times the rest of the current scope.
+//
+// When METRICS_ENABLED is 0, as in Final builds (and, as with
+// ASSERT_ENABLED, when it isn't defined at all), they all expand to
+// nothing, and METRIC_COUNTER_ADD's N isn't evaluated.
+
+#ifndef METRICS_ENABLED
+#define METRICS_ENABLED 0
+#endif
+
+#if METRICS_ENABLED
+
+#define METRIC_COUNTER(X) CONCAT2(g_metric_counter_, X)
+#define METRIC_COUNTER_EXTERN(X) extern StaticCounter METRIC_COUNTER(X)
+#define METRIC_COUNTER_DEFINE(NAME, SET_NAME) StaticCounter METRIC_COUNTER(NAME)(SET_NAME, #NAME)
+
+// C4456 - see LOG__PRINT.
+#define METRIC_COUNTER_ADD(X, N)           \
+    BEGIN_MACRO {                          \
+        VC_WARN_PUSH_DISABLE(4456);        \
+        METRIC_COUNTER_EXTERN(X);          \
+        VC_WARN_POP();                     \
+                                           \
+        METRIC_COUNTER(X).Get()->Add((N)); \
+    }                                      \
+    END_MACRO
+
+#define METRIC_TIMER_DEF(X) CONCAT2(g_metric_timer_def_, X)
+#define METRIC_TIMER_EXTERN(X) extern StaticTimerDef METRIC_TIMER_DEF(X)
+#define METRIC_TIMER_DEFINE(NAME, SET_NAME) StaticTimerDef METRIC_TIMER_DEF(NAME)(SET_NAME, #NAME)
+#define METRIC_TIMER_CHILD_DEFINE(NAME, PARENT) StaticTimerDef METRIC_TIMER_DEF(NAME)(&METRIC_TIMER_DEF(PARENT), #NAME)
+
+#define METRIC_TIMER(X)          \
+    VC_WARN_PUSH_DISABLE(4456);  \
+    METRIC_TIMER_EXTERN(X);      \
+    VC_WARN_POP();               \
+    Timer CONCAT2(metric_timer, __COUNTER__)(METRIC_TIMER_DEF(X).Get())
+
+#else
+
+#define METRIC_COUNTER_EXTERN(X) static_assert(true, "")
+#define METRIC_COUNTER_DEFINE(NAME, SET_NAME) static_assert(true, "")
+#define METRIC_COUNTER_ADD(X, N) ((void)0)
+
+#define METRIC_TIMER_EXTERN(X) static_assert(true, "")
+#define METRIC_TIMER_DEFINE(NAME, SET_NAME) static_assert(true, "")
+#define METRIC_TIMER_CHILD_DEFINE(NAME, PARENT) static_assert(true, "")
+#define METRIC_TIMER(X) static_assert(true, "")
+
+#endif
+
+#define METRIC_COUNTER_INCREMENT(X) METRIC_COUNTER_ADD(X, 1)
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 #endif
@@ -0,0 +1,120 @@
+#ifndef HEADER_5A1D7E93C2B04F6E8D0B3C4A9F71E6D2 // -*- mode:c++ -*-
+#define HEADER_5A1D7E93C2B04F6E8D0B3C4A9F71E6D2
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include "mutex.h"
+
+class Value;
+class TimerDef;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Summary of the samples covering a window of time, newest first.
+struct MetricsSamplerWindow {
+    // Number of samples covered, and the time they cover. This may be less
+    // than the window asked for, if there haven't been enough samples yet.
+    size_t num_samples = 0;
+    double seconds = 0.;
+
+    // Sum of the changes in value across the window, and that per second.
+    // For Counters, StripedCounters and TimerDefs, a value that went down
+    // is assumed to have been reset, and counts as an increase by its new
+    // value. Anything else is a gauge of some kind, that can go down for
+    // real, so its changes can be negative.
+    int64_t total_delta = 0;
+    double delta_per_second = 0.;
+
+    // The value as seen at each sample. Signed values (see Value::IsSigned)
+    // are taken as such; unsigned values too large for an int64_t are
+    // clamped.
+    int64_t min_value = 0;
+    int64_t max_value = 0;
+    double mean_value = 0.;
+
+    // TimerDefs only: total change in number of samples. The value is the
+    // total number of ticks, so total_delta/total_num_samples_delta is the
+    // mean ticks per Timer.
+    uint64_t total_num_samples_delta = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Periodically reads every Value and TimerDef from every MetricSet, and
+// keeps the last N samples for each, so that things like "requests per
+// second over the last 5 minutes" can be answered in process.
+//
+// Metrics are identified by pointer. A metric's history goes away if it's
+// ever missing from a sample (e.g., because its MetricSet was destroyed).
+class MetricsSampler {
+  public:
+    // If interval_ms is 0, there's no thread, and samples are only taken by
+    // calling Sample.
+    MetricsSampler(uint32_t interval_ms, size_t num_samples_per_metric);
+    ~MetricsSampler();
+
+    MetricsSampler(const MetricsSampler &) = delete;
+    MetricsSampler &operator=(const MetricsSampler &) = delete;
+    MetricsSampler(MetricsSampler &&) = delete;
+    MetricsSampler &operator=(MetricsSampler &&) = delete;
+
+    void Sample();
+
+    // Returns false if there's no history for the metric.
+    bool GetWindow(const Value *value, double window_seconds, MetricsSamplerWindow *window) const;
+    bool GetWindow(const TimerDef *def, double window_seconds, MetricsSamplerWindow *window) const;
+
+  protected:
+  private:
+    struct SeriesEntry {
+        uint64_t interval_ticks = 0;
+        int64_t value = 0;
+        int64_t delta = 0;
+        uint64_t num_samples_delta = 0;
+    };
+
+    struct Series {
+        std::vector<SeriesEntry> entries;
+        size_t next_index = 0;
+        size_t num_entries = 0;
+
+        // Fixed for the life of the metric.
+        bool is_signed = false;
+        bool counter = false;
+
+        uint64_t last_ticks = 0;
+        uint64_t last_value = 0;
+        uint64_t last_num_samples = 0;
+
+        uint64_t pass = 0;
+    };
+
+    const uint32_t m_interval_ms = 0;
+    const size_t m_num_samples_per_metric = 0;
+
+    mutable Mutex m_mutex;
+
+    // controlled by m_mutex.
+    std::unordered_map<const void *, Series> m_series;
+    uint64_t m_pass = 0;
+    bool m_stop = false;
+
+    ConditionVariable m_stop_cv;
+    std::thread m_thread;
+
+    void ThreadMain();
+    void AddLockedSample(const void *metric, bool is_signed, bool counter, uint64_t ticks, uint64_t value, uint64_t num_samples);
+    bool GetWindow2(const void *metric, double window_seconds, MetricsSamplerWindow *window) const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
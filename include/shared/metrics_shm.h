@@ -0,0 +1,182 @@
+#ifndef HEADER_C480415374774D85A6AD5FD01679EAB3 // -*- mode:c++ -*-
+#define HEADER_C480415374774D85A6AD5FD01679EAB3
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "mutex.h"
+#include "metrics.h"
+
+#include "enum_decl.h"
+#include "metrics_shm.inl"
+#include "enum_end.h"
+
+struct LogSet;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Shared memory segment holding the values of the Counters, Gauges and
+// TimerDefs of any MetricSet created with it (see MetricSet::Create), so
+// that another process can read them live, with no locking or IPC in the
+// monitored process. The segment describes itself:
+//
+// - MetricsShmHeader, at offset 0
+//
+// - max_num_entries MetricsShmEntry, straight after. Only the first
+//   num_entries are valid, and of those, only the live ones are current
+//
+// - the data, each entry's at its offset, as per MetricsShmType
+//
+// Everything is native endian and layout, as the reader's on the same
+// machine. TimerDefs are seqlocked (see TimerDef::GetStripesTotals).
+//
+// Only available on POSIX platforms. Elsewhere, Create and Open always
+// fail.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static constexpr char METRICS_SHM_MAGIC[8] = {'S', 'H', 'M', 'E', 'T', 'R', 'I', 'C'};
+static constexpr uint32_t METRICS_SHM_VERSION = 3;
+static constexpr size_t METRICS_SHM_MAX_NAME_SIZE = 112;
+
+struct MetricsShmHeader {
+    // Written last, so a reader that sees it sees everything else.
+    char magic[8];
+
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t entry_size;
+    uint32_t max_num_entries;
+    uint64_t size;
+    uint64_t pid;
+
+    // Entries are only ever added (though they may later be retired - see
+    // MetricsShmEntry::live). This is stored with release ordering once an
+    // entry is complete.
+    std::atomic<uint32_t> num_entries;
+};
+
+struct MetricsShmEntry {
+    // MetricSet name, then /, then the metric name - for a child TimerDef,
+    // the path from the root. 0-terminated, and truncated if too long.
+    char name[METRICS_SHM_MAX_NAME_SIZE];
+
+    // MetricsShmType.
+    uint32_t type;
+
+    // 1 while the metric exists. Set to 0, with release ordering, once the
+    // MetricSet it belongs to is destroyed, after which the data is never
+    // updated again. The space isn't reused.
+    std::atomic<uint32_t> live;
+
+    // Offset of the data from the start of the segment.
+    uint64_t offset;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+class MetricsSharedMemory {
+  public:
+    // name is as per shm_open, e.g. "/myapp.1234". The segment must not
+    // already exist. It's removed again when this is destroyed. Returns
+    // null on failure, with the details printed to logs.
+    static std::shared_ptr<MetricsSharedMemory> Create(std::string name, size_t max_num_entries, const LogSet *logs);
+
+    ~MetricsSharedMemory();
+
+    MetricsSharedMemory(const MetricsSharedMemory &) = delete;
+    MetricsSharedMemory &operator=(const MetricsSharedMemory &) = delete;
+    MetricsSharedMemory(MetricsSharedMemory &&) = delete;
+    MetricsSharedMemory &operator=(MetricsSharedMemory &&) = delete;
+
+    const std::string &GetName() const;
+
+    // Adds an entry, and returns its data, which is zeroed, and its index,
+    // for RetireEntry. Returns null if the segment is full, logging the
+    // first time that happens.
+    void *AddEntry(MetricsShmType type, const std::string &name, uint32_t *index);
+
+    // Marks the entry as no longer live, so readers skip it.
+    void RetireEntry(uint32_t index);
+
+  protected:
+  private:
+    const std::string m_name;
+    uint8_t *m_base = nullptr;
+    size_t m_size = 0;
+
+    Mutex m_mutex;
+
+    // controlled by m_mutex.
+    uint64_t m_next_data_offset = 0;
+    bool m_logged_full = false;
+
+    explicit MetricsSharedMemory(std::string name);
+
+    MetricsShmHeader *GetHeader() const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct MetricsShmValue {
+    std::string name;
+    MetricsShmType type = MetricsShmType_Counter;
+
+    // Counter or Gauge. A Gauge's value is really an int64_t.
+    uint64_t value = 0;
+
+    // TimerDef.
+    TimerDefTotals totals;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Read side, for the monitoring process. Maps the segment read only, so
+// there's no way to disturb the monitored process.
+class MetricsSharedMemoryReader {
+  public:
+    // Returns null on failure, with the details printed to logs. That
+    // includes the segment not being fully set up yet.
+    static std::unique_ptr<MetricsSharedMemoryReader> Open(std::string name, const LogSet *logs);
+
+    ~MetricsSharedMemoryReader();
+
+    MetricsSharedMemoryReader(const MetricsSharedMemoryReader &) = delete;
+    MetricsSharedMemoryReader &operator=(const MetricsSharedMemoryReader &) = delete;
+    MetricsSharedMemoryReader(MetricsSharedMemoryReader &&) = delete;
+    MetricsSharedMemoryReader &operator=(MetricsSharedMemoryReader &&) = delete;
+
+    // PID of the process that created the segment.
+    uint64_t GetPID() const;
+
+    // Reads the current value of every live entry. TimerDefs that are still
+    // mid-update after a few tries (which shouldn't happen unless the
+    // monitored process died part way through one) are skipped, and the
+    // result is false.
+    bool Read(std::vector<MetricsShmValue> *values) const;
+
+  protected:
+  private:
+    const uint8_t *m_base = nullptr;
+    size_t m_size = 0;
+
+    MetricsSharedMemoryReader() = default;
+
+    const MetricsShmHeader *GetHeader() const;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
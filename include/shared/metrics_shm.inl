@@ -0,0 +1,18 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Type of a MetricsShmEntry, which says what its data is.
+//
+// - Counter: std::atomic<uint64_t>
+// - Gauge: std::atomic<int64_t>
+// - TimerDef: METRICS_NUM_STRIPES TimerDefStripes
+#define ENAME MetricsShmType
+EBEGIN_DERIVED(uint32_t)
+EPNV(Counter, 1)
+EPNV(Gauge, 2)
+EPNV(TimerDef, 3)
+EEND()
+#undef ENAME
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
@@ -16,6 +16,8 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <chrono>
+#include <atomic>
 
 #include "enum_decl.h"
 #include "mutex.inl"
@@ -25,6 +27,8 @@
 //////////////////////////////////////////////////////////////////////////
 
 class Mutex;
+class ConditionVariable;
+class Log;
 
 struct MutexStats {
     uint64_t num_locks = 0;
@@ -36,12 +40,56 @@ struct MutexStats {
     uint64_t start_ticks;
     uint64_t num_try_locks = 0;
 
+    // Timed locks that gave up. (Timed locks that succeed count as locks.)
+    uint64_t num_lock_timeouts = 0;
+
+    // A barge is when the thread that last had the lock takes it again
+    // while other threads are waiting for it. A large number of consecutive
+    // barges means some waiter is being starved. (TicketMutex never barges.)
+    uint64_t num_barges = 0;
+    uint64_t max_consecutive_barges = 0;
+
+    // Threads waiting for exclusive access right now. Not reset, and may
+    // well be out of date by the time anybody looks at it.
+    uint32_t num_waiters = 0;
+
+    // SharedMutex only. The fields above cover the exclusive (writer) side;
+    // these cover the shared (reader) side.
+    uint64_t num_shared_locks = 0;
+    uint64_t num_contended_shared_locks = 0;
+    uint64_t total_shared_lock_wait_ticks = 0;
+    uint64_t min_shared_lock_wait_ticks = UINT64_MAX;
+    uint64_t max_shared_lock_wait_ticks = 0;
+    uint64_t num_successful_try_lock_shareds = 0;
+    uint64_t num_try_lock_shareds = 0;
+
+    // ConditionVariable only. A wait's ticks run from the start of the wait
+    // until the mutex has been reacquired; its wakeup ticks, from the most
+    // recent notify (or the start of the wait, if later) until the mutex has
+    // been reacquired. Timeouts have no wakeup ticks.
+    uint64_t num_waits = 0;
+    uint64_t num_wait_timeouts = 0;
+    uint64_t num_notify_ones = 0;
+    uint64_t num_notify_alls = 0;
+    uint64_t total_wait_ticks = 0;
+    uint64_t max_wait_ticks = 0;
+    uint64_t num_wakeups = 0;
+    uint64_t total_wakeup_ticks = 0;
+    uint64_t max_wakeup_ticks = 0;
+
+    // If true, some uncontended locks weren't timed (see
+    // Mutex::SetLockTimingSampleRate), and the total wait ticks are estimates,
+    // scaled up from the ones that were. Min and max are from the timed locks
+    // only.
+    bool sampled = false;
+
     bool ever_locked = false;
 
     MutexStats();
 };
 
 struct MutexDetails {
+    MutexType type = MutexType_Mutex;
     std::string name;
     MutexStats stats;
 };
@@ -58,12 +106,20 @@ struct MutexMetadata {
 
     virtual void GetDetails(MutexDetails *details) const = 0;
     virtual void RequestReset() = 0;
+
+    // MutexInterestingEvent flags. Mutex adds an event to the trace (see
+    // shared/trace.h) for each of these: Lock and Unlock as the begin and
+    // end of the hold interval, and ContendedLock as the wait. Set Lock
+    // and Unlock together, or the trace viewer will get confused.
     virtual uint8_t GetInterestingEvents() const = 0;
     virtual void SetInterestingEvents(uint8_t events) = 0;
 };
 
 struct MutexFullMetadata;
 struct MutexMetadataImpl;
+struct SharedMutexMetadataImpl;
+struct ConditionVariableMetadataImpl;
+struct TicketMutexMetadataImpl;
 
 class Mutex {
   public:
@@ -86,20 +142,61 @@ class Mutex {
     // the returned change counter will never be 0.
     static uint64_t GetMetadataChangeCounter();
 
-    // there's a possible race condition, but it doesn't really matter. Metadata changes aren't intended to be a regular occurrence.
+    // Includes the metadata for any SharedMutex objects too.
+    //
+    // Mutex construction and destruction don't wait for this, and vice versa.
+    // The list is an immutable snapshot, regenerated only when there have been
+    // changes; GetAllMetadataSnapshot avoids copying it.
     static std::vector<std::shared_ptr<MutexMetadata>> GetAllMetadata();
+    static std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> GetAllMetadataSnapshot();
 
     static uint64_t GetNameOverheadTicks();
 
     // If true, assume that try_lock is effectively free when it succeeds.
     // Potentially save on some system calls for every lock.
+    //
+    // (Untimed locks don't contribute to any of the wait tick stats.)
     static bool GetAssumeFreeUncontendedLocks();
     static void SetAssumeFreeUncontendedLocks(bool assume_free_uncontended_locks);
 
+    // Time only 1 in N uncontended locks on each thread, and scale up the
+    // stats accordingly. Contended locks are always timed. 1 (the default)
+    // times every lock; 0 times no uncontended locks, same as assuming
+    // they're free.
+    //
+    // An untimed uncontended lock costs only a try_lock, rather than a
+    // try_lock plus two tick count reads.
+    static uint32_t GetLockTimingSampleRate();
+    static void SetLockTimingSampleRate(uint32_t sample_rate);
+
+    // Contention profiler. When the sample rate is N>0, every Nth contended
+    // lock on each thread captures a backtrace, and the wait ticks are
+    // accumulated per (mutex, call stack). 0 (the default) turns it off.
+    //
+    // The table has a fixed size. Samples for new call stacks are dropped
+    // once it's full; ResetContentionProfile zeroes the counts, but doesn't
+    // free up any space.
+    static uint32_t GetContentionProfilerSampleRate();
+    static void SetContentionProfilerSampleRate(uint32_t sample_rate);
+    static void ResetContentionProfile();
+
+    // Print the profile to the log, most total wait ticks first. Symbols are
+    // only looked up for the entries printed, so this can be slow.
+    static void LogContentionProfile(Log *log, size_t max_num_entries = 20);
+
     void lock();
     bool try_lock();
     void unlock();
 
+    // Wait for the lock, but only until the timeout. Returns false if it
+    // timed out.
+    bool try_lock_until(const std::chrono::steady_clock::time_point &timeout_time);
+
+    template <class RepType, class PeriodType>
+    bool try_lock_for(const std::chrono::duration<RepType, PeriodType> &timeout) {
+        return this->try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
   protected:
   private:
     std::shared_ptr<MutexFullMetadata> m_metadata;
@@ -108,13 +205,103 @@ class Mutex {
     // in an attempt to avoid atrocious debug build performance.
     MutexMetadataImpl *m_meta = nullptr;
 
+    bool Lock(const std::chrono::steady_clock::time_point *timeout_time);
+
     void OnInterestingEvents(uint8_t interesting_events, MutexMetadataImpl *meta);
+
+    friend class ConditionVariable;
+};
+
+// Reader/writer mutex, instrumented like Mutex, and with its metadata in the
+// same list.
+//
+// The exclusive side's stats go in the usual MutexStats fields, and the shared
+// side's in the *_shared_* ones.
+//
+// By default, the policy is whatever std::shared_mutex does, which (depending
+// on platform) may let a steady stream of readers starve a writer
+// indefinitely. With SetPreferWriters(true), once a writer is waiting, new
+// readers wait for it.
+class SharedMutex {
+  public:
+    SharedMutex();
+    ~SharedMutex();
+
+    SharedMutex(const SharedMutex &) = delete;
+    SharedMutex &operator=(const SharedMutex &) = delete;
+
+    SharedMutex(SharedMutex &&) = delete;
+    SharedMutex &operator=(SharedMutex &&) = delete;
+
+    void SetName(std::string name);
+
+    // see Mutex.
+    MutexMetadata *GetMutableMetadata();
+    const MutexMetadata *GetMetadata() const;
+
+    // Don't change this while there are any lockers.
+    bool GetPreferWriters() const;
+    void SetPreferWriters(bool prefer_writers);
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+
+  protected:
+  private:
+    std::shared_ptr<MutexFullMetadata> m_metadata;
+
+    // as Mutex::m_meta.
+    SharedMutexMetadataImpl *m_meta = nullptr;
+};
+
+// Fair version of Mutex: threads get the lock in the order they asked for
+// it, so none can be starved. The price is throughput, as the lock can't go
+// to a thread that's already running while a sleeping one is ahead of it in
+// the queue.
+//
+// Instrumented like Mutex, and with its metadata in the same list. Since
+// it's a separate type, there's no ConditionVariable support.
+class TicketMutex {
+  public:
+    TicketMutex();
+    ~TicketMutex();
+
+    TicketMutex(const TicketMutex &) = delete;
+    TicketMutex &operator=(const TicketMutex &) = delete;
+
+    TicketMutex(TicketMutex &&) = delete;
+    TicketMutex &operator=(TicketMutex &&) = delete;
+
+    void SetName(std::string name);
+
+    // see Mutex.
+    MutexMetadata *GetMutableMetadata();
+    const MutexMetadata *GetMetadata() const;
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+  protected:
+  private:
+    std::shared_ptr<MutexFullMetadata> m_metadata;
+
+    // as Mutex::m_meta.
+    TicketMutexMetadataImpl *m_meta = nullptr;
 };
 
 // for use as a global.
 class MutexNameSetter {
   public:
     MutexNameSetter(Mutex *mutex, const char *name);
+    MutexNameSetter(SharedMutex *mutex, const char *name);
+    MutexNameSetter(ConditionVariable *cv, const char *name);
+    MutexNameSetter(TicketMutex *mutex, const char *name);
 
   protected:
   private:
@@ -130,15 +317,118 @@ class MutexNameSetter {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-#include <mutex> //#if !MUTEX_DEBUGGING
+#include <mutex>        //#if !MUTEX_DEBUGGING
+#include <shared_mutex> //#if !MUTEX_DEBUGGING
+#include <atomic>       //#if !MUTEX_DEBUGGING
+#include <chrono>       //#if !MUTEX_DEBUGGING
+#include <condition_variable> //#if !MUTEX_DEBUGGING
+
+// Lock the mutex, waiting no later than the timeout. Returns false if it
+// timed out.
+bool TryLockStdMutexUntil(std::mutex *mutex, const std::chrono::steady_clock::time_point &timeout_time);
+
+// std::mutex, plus timed locking. (std::timed_mutex doesn't work with
+// std::condition_variable, so it's no good for ConditionVariable.)
+class Mutex : public std::mutex {
+  public:
+    bool try_lock_until(const std::chrono::steady_clock::time_point &timeout_time) {
+        return TryLockStdMutexUntil(this, timeout_time);
+    }
+
+    template <class RepType, class PeriodType>
+    bool try_lock_for(const std::chrono::duration<RepType, PeriodType> &timeout) {
+        return this->try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+};
+
+class ConditionVariable;
 
-typedef std::mutex Mutex;
+class TicketLock;
+typedef TicketLock TicketMutex;
+
+// The writer preference is functional rather than a debugging aid, so it's
+// still available.
+class SharedMutex {
+  public:
+    SharedMutex() = default;
+
+    SharedMutex(const SharedMutex &) = delete;
+    SharedMutex &operator=(const SharedMutex &) = delete;
+
+    SharedMutex(SharedMutex &&) = delete;
+    SharedMutex &operator=(SharedMutex &&) = delete;
+
+    bool GetPreferWriters() const {
+        return m_prefer_writers;
+    }
+
+    void SetPreferWriters(bool prefer_writers) {
+        m_prefer_writers = prefer_writers;
+    }
+
+    void lock() {
+        if (m_prefer_writers) {
+            m_num_waiting_writers.fetch_add(1, std::memory_order_acq_rel);
+            m_writer_gate.lock();
+            m_mutex.lock();
+            m_writer_gate.unlock();
+            m_num_waiting_writers.fetch_sub(1, std::memory_order_acq_rel);
+        } else {
+            m_mutex.lock();
+        }
+    }
+
+    bool try_lock() {
+        return m_mutex.try_lock();
+    }
+
+    void unlock() {
+        m_mutex.unlock();
+    }
+
+    void lock_shared() {
+        if (m_prefer_writers && m_num_waiting_writers.load(std::memory_order_acquire) != 0) {
+            m_writer_gate.lock();
+            m_writer_gate.unlock();
+        }
+
+        m_mutex.lock_shared();
+    }
+
+    bool try_lock_shared() {
+        if (m_prefer_writers && m_num_waiting_writers.load(std::memory_order_acquire) != 0) {
+            return false;
+        }
+
+        return m_mutex.try_lock_shared();
+    }
+
+    void unlock_shared() {
+        m_mutex.unlock_shared();
+    }
+
+  protected:
+  private:
+    std::shared_mutex m_mutex;
+    std::mutex m_writer_gate;
+    std::atomic<uint32_t> m_num_waiting_writers{0};
+    bool m_prefer_writers = false;
+};
 
 class MutexNameSetter {
   public:
     MutexNameSetter(Mutex *, const char *) {
     }
 
+    MutexNameSetter(SharedMutex *, const char *) {
+    }
+
+    MutexNameSetter(ConditionVariable *, const char *) {
+    }
+
+    MutexNameSetter(TicketMutex *, const char *) {
+    }
+
   protected:
   private:
 };
@@ -153,6 +443,69 @@ class MutexNameSetter {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// The lock underlying TicketMutex, for use directly when MUTEX_DEBUGGING is
+// off. Spins briefly, then sleeps.
+//
+// Each unlock wakes all the sleepers, and all but one go back to sleep, so
+// this is best kept to a handful of contending threads.
+class TicketLock {
+  public:
+    TicketLock() = default;
+
+    TicketLock(const TicketLock &) = delete;
+    TicketLock &operator=(const TicketLock &) = delete;
+
+    TicketLock(TicketLock &&) = delete;
+    TicketLock &operator=(TicketLock &&) = delete;
+
+    void lock() {
+        uint32_t ticket = m_next_ticket.fetch_add(1, std::memory_order_relaxed);
+
+        for (int i = 0; i < NUM_SPINS; ++i) {
+            if (m_now_serving.load(std::memory_order_acquire) == ticket) {
+                return;
+            }
+        }
+
+        for (;;) {
+            uint32_t now_serving = m_now_serving.load(std::memory_order_acquire);
+            if (now_serving == ticket) {
+                return;
+            }
+
+            m_now_serving.wait(now_serving, std::memory_order_acquire);
+        }
+    }
+
+    bool try_lock() {
+        uint32_t now_serving = m_now_serving.load(std::memory_order_acquire);
+        uint32_t ticket = now_serving;
+        return m_next_ticket.compare_exchange_strong(ticket, now_serving + 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        m_now_serving.fetch_add(1, std::memory_order_release);
+        m_now_serving.notify_all();
+    }
+
+    // Threads that have a ticket but not the lock. Only a snapshot.
+    uint32_t GetNumWaiters() const {
+        uint32_t now_serving = m_now_serving.load(std::memory_order_acquire);
+        uint32_t num_tickets = m_next_ticket.load(std::memory_order_acquire) - now_serving;
+        return num_tickets == 0 ? 0 : num_tickets - 1;
+    }
+
+  protected:
+  private:
+    static constexpr int NUM_SPINS = 100;
+
+    std::atomic<uint32_t> m_next_ticket{0};
+    std::atomic<uint32_t> m_now_serving{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 // Pound shop equivalent of std::lock_guard, that doesn't need a standard header.
 template <class MutexType>
 class LockGuard {
@@ -179,10 +532,47 @@ class LockGuard {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// LockGuard, but for the shared side of a SharedMutex (or anything else with
+// lock_shared/unlock_shared).
+template <class MutexType>
+class SharedLockGuard {
+  public:
+    explicit SharedLockGuard(MutexType &mutex)
+        : m_mutex(&mutex) {
+        m_mutex->lock_shared();
+    }
+
+    ~SharedLockGuard() {
+        m_mutex->unlock_shared();
+    }
+
+    SharedLockGuard(const SharedLockGuard<MutexType> &) = delete;
+    SharedLockGuard<MutexType> &operator=(const SharedLockGuard<MutexType> &) = delete;
+    SharedLockGuard(SharedLockGuard<MutexType> &&) = delete;
+    SharedLockGuard<MutexType> &operator=(SharedLockGuard<MutexType> &&) = delete;
+
+  protected:
+  private:
+    MutexType *m_mutex = nullptr;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Tag for UniqueLock's constructor, like std::defer_lock.
+struct DeferLockTag {
+};
+
+inline constexpr DeferLockTag DEFER_LOCK;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 // Janky std::unique_lock knockoff, ditto. Also forward declaration-friendly.
 //
-// (This does enough to work with condition_variable_any, but no more.
-// std::unique_lock may still prove necessary.)
+// (This does enough to work with ConditionVariable and
+// condition_variable_any, but no more. std::unique_lock may still prove
+// necessary.)
 template <class MutexType>
 class UniqueLock {
   public:
@@ -196,6 +586,11 @@ class UniqueLock {
         m_locked = true;
     }
 
+    // Don't lock yet.
+    UniqueLock(MutexType &mutex, DeferLockTag)
+        : m_mutex(&mutex) {
+    }
+
     ~UniqueLock() {
         this->unlock();
     }
@@ -238,6 +633,36 @@ class UniqueLock {
         }
     }
 
+    bool try_lock() {
+        if (m_mutex && !m_locked) {
+            m_locked = m_mutex->try_lock();
+        }
+
+        return m_locked;
+    }
+
+    // Timed acquire - MutexType needs try_lock_until.
+    bool try_lock_until(const std::chrono::steady_clock::time_point &timeout_time) {
+        if (m_mutex && !m_locked) {
+            m_locked = m_mutex->try_lock_until(timeout_time);
+        }
+
+        return m_locked;
+    }
+
+    template <class RepType, class PeriodType>
+    bool try_lock_for(const std::chrono::duration<RepType, PeriodType> &timeout) {
+        return this->try_lock_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    MutexType *mutex() const {
+        return m_mutex;
+    }
+
+    bool owns_lock() const {
+        return m_locked;
+    }
+
   protected:
   private:
     MutexType *m_mutex = nullptr;
@@ -247,4 +672,147 @@ class UniqueLock {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// Condition variable that works with UniqueLock<Mutex>, and avoids the
+// overhead of condition_variable_any.
+//
+// wait_until and wait_for return false if the wait timed out. (The predicate
+// versions return the predicate's final value, as per std.)
+//
+// When MUTEX_DEBUGGING, it's instrumented, and its metadata goes in the
+// Mutex list. The reacquisition of the mutex at the end of a wait doesn't
+// count towards the mutex's own lock stats.
+#if MUTEX_DEBUGGING
+
+class ConditionVariable {
+  public:
+    ConditionVariable();
+    ~ConditionVariable();
+
+    ConditionVariable(const ConditionVariable &) = delete;
+    ConditionVariable &operator=(const ConditionVariable &) = delete;
+
+    ConditionVariable(ConditionVariable &&) = delete;
+    ConditionVariable &operator=(ConditionVariable &&) = delete;
+
+    void SetName(std::string name);
+
+    // see Mutex.
+    MutexMetadata *GetMutableMetadata();
+    const MutexMetadata *GetMetadata() const;
+
+    void notify_one();
+    void notify_all();
+
+    void wait(UniqueLock<Mutex> &lock);
+    bool wait_until(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point &timeout_time);
+
+    template <class PredicateType>
+    void wait(UniqueLock<Mutex> &lock, PredicateType pred) {
+        while (!pred()) {
+            this->wait(lock);
+        }
+    }
+
+    template <class PredicateType>
+    bool wait_until(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point &timeout_time, PredicateType pred) {
+        while (!pred()) {
+            if (!this->wait_until(lock, timeout_time)) {
+                return pred();
+            }
+        }
+
+        return true;
+    }
+
+    template <class RepType, class PeriodType>
+    bool wait_for(UniqueLock<Mutex> &lock, const std::chrono::duration<RepType, PeriodType> &timeout) {
+        return this->wait_until(lock, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template <class RepType, class PeriodType, class PredicateType>
+    bool wait_for(UniqueLock<Mutex> &lock, const std::chrono::duration<RepType, PeriodType> &timeout, PredicateType pred) {
+        return this->wait_until(lock, std::chrono::steady_clock::now() + timeout, std::move(pred));
+    }
+
+  protected:
+  private:
+    std::shared_ptr<MutexFullMetadata> m_metadata;
+
+    // as Mutex::m_meta.
+    ConditionVariableMetadataImpl *m_meta = nullptr;
+
+    bool Wait(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point *timeout_time);
+};
+
+#else
+
+class ConditionVariable {
+  public:
+    ConditionVariable() = default;
+
+    ConditionVariable(const ConditionVariable &) = delete;
+    ConditionVariable &operator=(const ConditionVariable &) = delete;
+
+    ConditionVariable(ConditionVariable &&) = delete;
+    ConditionVariable &operator=(ConditionVariable &&) = delete;
+
+    void notify_one() {
+        m_cv.notify_one();
+    }
+
+    void notify_all() {
+        m_cv.notify_all();
+    }
+
+    void wait(UniqueLock<Mutex> &lock) {
+        std::unique_lock<std::mutex> std_lock(*lock.mutex(), std::adopt_lock);
+        m_cv.wait(std_lock);
+        std_lock.release();
+    }
+
+    bool wait_until(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point &timeout_time) {
+        std::unique_lock<std::mutex> std_lock(*lock.mutex(), std::adopt_lock);
+        std::cv_status status = m_cv.wait_until(std_lock, timeout_time);
+        std_lock.release();
+        return status == std::cv_status::no_timeout;
+    }
+
+    template <class PredicateType>
+    void wait(UniqueLock<Mutex> &lock, PredicateType pred) {
+        while (!pred()) {
+            this->wait(lock);
+        }
+    }
+
+    template <class PredicateType>
+    bool wait_until(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point &timeout_time, PredicateType pred) {
+        while (!pred()) {
+            if (!this->wait_until(lock, timeout_time)) {
+                return pred();
+            }
+        }
+
+        return true;
+    }
+
+    template <class RepType, class PeriodType>
+    bool wait_for(UniqueLock<Mutex> &lock, const std::chrono::duration<RepType, PeriodType> &timeout) {
+        return this->wait_until(lock, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template <class RepType, class PeriodType, class PredicateType>
+    bool wait_for(UniqueLock<Mutex> &lock, const std::chrono::duration<RepType, PeriodType> &timeout, PredicateType pred) {
+        return this->wait_until(lock, std::chrono::steady_clock::now() + timeout, std::move(pred));
+    }
+
+  protected:
+  private:
+    std::condition_variable m_cv;
+};
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 #endif
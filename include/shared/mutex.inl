@@ -2,5 +2,15 @@
 EBEGIN_DERIVED(uint8_t)
 EPN_BIT_FLAG(Lock, 0)
 EPN_BIT_FLAG(ContendedLock, 1)
+EPN_BIT_FLAG(Unlock, 2)
+EEND()
+#undef ENAME
+
+#define ENAME MutexType
+EBEGIN_DERIVED(uint8_t)
+EPN(Mutex)
+EPN(SharedMutex)
+EPN(ConditionVariable)
+EPN(TicketMutex)
 EEND()
 #undef ENAME
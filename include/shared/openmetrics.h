@@ -0,0 +1,109 @@
+#ifndef HEADER_8E0B6C0F3B8A4D2C9E1F57A6D4C3B291 // -*- mode:c++ -*-
+#define HEADER_8E0B6C0F3B8A4D2C9E1F57A6D4C3B291
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+struct LogSet;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Renders every MetricSet, and the Mutex stats if MUTEX_DEBUGGING, as
+// OpenMetrics text (which Prometheus can scrape).
+//
+// - each Value is a family named after the Value, with a set label giving
+//   the MetricSet name. Counter and StripedCounter are counters, anything
+//   else is a gauge
+//
+// - TimerDefs are all in the timer_seconds summary, with set and timer
+//   labels. The timer label is the path from the root TimerDef, separated
+//   by /s. If the TimerDef has a histogram, there are quantiles too. Self
+//   time is in timer_self_seconds, a counter with the same labels
+//
+// - mutexes are in mutex_locks, mutex_contended_locks and
+//   mutex_lock_wait_seconds, with a mutex label giving the name. Mutexes
+//   with the same name are added together
+//
+// A Value family named like one of the built-in families is left out, as
+// are the gauges in a family that's a counter in some other set. Each is
+// logged, once per exporter.
+//
+// The text, and everything read along the way, goes into buffers that are
+// reused from one render to the next, so once things have settled down
+// there's no allocation. The list of MetricSets is locked while they're
+// read, so creating or destroying a MetricSet waits for that part, and a
+// derived Value's function mustn't do either.
+//
+// Not thread safe. Use one per thread.
+class OpenMetricsExporter {
+  public:
+    OpenMetricsExporter();
+    ~OpenMetricsExporter();
+
+    OpenMetricsExporter(const OpenMetricsExporter &) = delete;
+    OpenMetricsExporter &operator=(const OpenMetricsExporter &) = delete;
+    OpenMetricsExporter(OpenMetricsExporter &&) = delete;
+    OpenMetricsExporter &operator=(OpenMetricsExporter &&) = delete;
+
+    // The result is valid until the next call.
+    const std::string &Render();
+
+    // Render, then save with SaveFlag_AtomicReplace, so anything reading
+    // the file never sees half of it.
+    bool Save(const std::string &path, const LogSet *logs);
+
+  protected:
+  private:
+    struct Scratch;
+
+    std::string m_text;
+    std::unique_ptr<Scratch> m_scratch;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Tiny HTTP server on 127.0.0.1 that responds to any GET with the current
+// OpenMetrics text. One request at a time, on its own thread.
+//
+// Only available on POSIX platforms. Elsewhere, Create always fails.
+class OpenMetricsHTTPServer {
+  public:
+    // Port 0 picks any free port - see GetPort. Returns null on failure,
+    // with the details printed to logs.
+    static std::unique_ptr<OpenMetricsHTTPServer> Create(uint16_t port, const LogSet *logs);
+
+    ~OpenMetricsHTTPServer();
+
+    OpenMetricsHTTPServer(const OpenMetricsHTTPServer &) = delete;
+    OpenMetricsHTTPServer &operator=(const OpenMetricsHTTPServer &) = delete;
+    OpenMetricsHTTPServer(OpenMetricsHTTPServer &&) = delete;
+    OpenMetricsHTTPServer &operator=(OpenMetricsHTTPServer &&) = delete;
+
+    uint16_t GetPort() const;
+
+  protected:
+  private:
+    int m_fd = -1;
+    uint16_t m_port = 0;
+    std::atomic<bool> m_stop{false};
+    OpenMetricsExporter m_exporter;
+    std::thread m_thread;
+
+    OpenMetricsHTTPServer() = default;
+
+    void ThreadMain();
+    void HandleConnection(int fd);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef HEADER_5651AD5E2F1348F99F815B18FF2A6015 // -*- mode:c++ -*-
+#define HEADER_5651AD5E2F1348F99F815B18FF2A6015
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "enum_decl.h"
+#include "perf_counters.inl"
+#include "enum_end.h"
+
+struct LogSet;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Per-thread hardware (or software) performance counters, via
+// perf_event_open. When enabled, each Timer reads its thread's counters at
+// the start and end, and the differences accumulate in the TimerDef along
+// with the ticks (see TimerDefTotals::perf_counters).
+//
+// Each thread opens its own counter group the first time it needs it. A
+// thread that can't (no PMU, perf_event_paranoid, etc.) just doesn't count
+// anything. Reading is one read() call for the group, so it costs a
+// syscall at each end of each Timer.
+//
+// Only available on Linux. Elsewhere, SetMode always fails.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t PERF_COUNTERS_NUM_COUNTERS = 4;
+
+struct PerfCounterValues {
+    uint64_t values[PERF_COUNTERS_NUM_COUNTERS] = {};
+
+    // Nanoseconds the group has been enabled, and actually counting. These
+    // differ if the kernel had to share the PMU between more groups than
+    // it has room for, and multiplexed them.
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+
+    // Changes whenever the mode does, so values from different modes
+    // aren't compared.
+    uint32_t generation = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+class PerfCounters {
+  public:
+    // Checks the counters can be opened on the calling thread first. If
+    // not, returns false, with the details printed to logs, and leaves the
+    // mode as it was. (Individual counters that aren't supported just stay
+    // at 0.) Setting Off always succeeds.
+    static bool SetMode(PerfCounterMode mode, const LogSet *logs);
+    static PerfCounterMode GetMode();
+
+    // Name of each counter in the given mode, e.g., "cycles".
+    static const char *GetCounterName(PerfCounterMode mode, size_t index);
+
+    static inline bool IsEnabled() {
+        return ms_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Reads the calling thread's counters, opening them if necessary.
+    // Returns false if they're not available.
+    static bool ReadThreadCounters(PerfCounterValues *values);
+
+    // Differences between two readings of the same thread's counters. If
+    // the group was only counting for part of the time in between, the
+    // differences are scaled up to estimate the whole. Returns false if
+    // the readings are from different modes, or the group never got to
+    // count in between.
+    static bool GetDeltas(const PerfCounterValues &begin, const PerfCounterValues &end, uint64_t *deltas);
+
+  protected:
+  private:
+    static std::atomic<bool> ms_enabled;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
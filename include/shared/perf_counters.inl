@@ -0,0 +1,21 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Which events the PERF_COUNTERS_NUM_COUNTERS counters count.
+//
+// - Hardware: CPU cycles, instructions retired, last level cache misses,
+//   branch misses
+//
+// - Software: task clock (ns), page faults, context switches, CPU
+//   migrations. These are available even in VMs without a PMU, so they're
+//   mainly useful for testing
+#define ENAME PerfCounterMode
+EBEGIN()
+EPNV(Off, 0)
+EPNV(Hardware, 1)
+EPNV(Software, 2)
+EEND()
+#undef ENAME
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
@@ -26,6 +26,8 @@
 //    - RVAL(X) to do X($)
 //    - RDELETED(BLAH) if you want BLAH=delete
 //    - RMO_ACQUIRE, RMO_ACQ_REL, etc., rather than the Relacy defines
+//    - RFENCE(MO) rather than std::atomic_thread_fence(MO)
+//    - RYIELD() in spin loops, rather than std::this_thread::yield()
 //
 // It looks like Relacy is supposed to make this stuff work relatively
 // transparently, but it doesn't seem to have quite worked for me.
@@ -46,8 +48,14 @@
 //#define RLOAD(V,MO) ((V)($).load(MO))
 #define RVAL(X) ((X)($))
 
+#define RMO_RELAXED (rl::mo_relaxed)
 #define RMO_ACQUIRE (rl::mo_acquire)
+#define RMO_RELEASE (rl::mo_release)
 #define RMO_ACQ_REL (rl::mo_acq_rel)
+#define RMO_SEQ_CST (rl::mo_seq_cst)
+
+#define RFENCE(MO) (rl::atomic_thread_fence((MO), $))
+#define RYIELD() (rl::yield(1, $))
 
 // Relacy redefines "delete", so what can you do. This isn't great,
 // but you'll at least get a linker error if it's ever used.
@@ -56,6 +64,7 @@
 #else
 
 #include <atomic>
+#include <thread>
 
 #define OFF_041EF256A6D140CB9E42AB5BFE98CE21
 
@@ -63,8 +72,14 @@
 //#define RLOAD(V,MO) ((V).load(MO))
 #define RVAL(X) (X)
 
+#define RMO_RELAXED (std::memory_order_relaxed)
 #define RMO_ACQUIRE (std::memory_order_acquire)
+#define RMO_RELEASE (std::memory_order_release)
 #define RMO_ACQ_REL (std::memory_order_acq_rel)
+#define RMO_SEQ_CST (std::memory_order_seq_cst)
+
+#define RFENCE(MO) (std::atomic_thread_fence(MO))
+#define RYIELD() (std::this_thread::yield())
 
 #define RDELETED(...) __VA_ARGS__ = delete
 
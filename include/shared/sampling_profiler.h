@@ -0,0 +1,128 @@
+#ifndef HEADER_B2795E3CAF184B599A005EDFE3ECB849 // -*- mode:c++ -*-
+#define HEADER_B2795E3CAF184B599A005EDFE3ECB849
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+struct LogSet;
+class TimerDef;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Sampling profiler, for finding out where the time goes without putting a
+// Timer in every function. Each registered thread gets a SIGPROF timer
+// that fires every so often as the thread uses CPU time. The signal
+// handler records the thread's stack of active Timers and, optionally, a
+// raw backtrace, into a per-thread buffer. Nothing is allocated or locked
+// in the handler - except that backtraces use backtrace(), which isn't
+// strictly async signal safe, and so they're off by default.
+//
+// Collect moves the samples from the buffers into the profile, turning
+// the TimerDefs into names as it goes. The MetricSet destructor collects,
+// so the names are found while the TimerDefs still exist, and so does
+// Stop. Call Collect every so often while running, if there's any danger
+// of the buffers filling up - samples that don't fit are dropped (and
+// counted).
+//
+// There's only one profiler, as there's only one SIGPROF. Once started,
+// the signal handler stays installed, in case a signal is still pending
+// after Stop.
+//
+// Only available on Linux. Elsewhere, Start always fails.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t SAMPLING_PROFILER_MAX_NUM_TIMER_DEFS = 16;
+static constexpr size_t SAMPLING_PROFILER_MAX_NUM_FRAMES = 32;
+
+// Per thread.
+static constexpr size_t SAMPLING_PROFILER_BUFFER_NUM_SAMPLES = 256;
+
+struct SamplingProfilerOptions {
+    // Samples per second of CPU time, per thread.
+    uint32_t frequency_hz = 100;
+
+    // If set, each sample includes a backtrace.
+    bool backtraces = false;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct SamplingProfileStack {
+    // Outermost first, as "set/name". A sample with no Timer active has
+    // the single entry "(no timer)".
+    std::vector<std::string> timer_defs;
+
+    // Function names, outermost first. Empty if there was no backtrace.
+    std::vector<std::string> frames;
+
+    bool operator<(const SamplingProfileStack &other) const;
+};
+
+struct SamplingProfile {
+    // Number of samples for each distinct stack.
+    std::map<SamplingProfileStack, uint64_t> stacks;
+
+    uint64_t num_samples = 0;
+
+    // Samples lost because a buffer was full.
+    uint64_t num_dropped_samples = 0;
+};
+
+// One line per stack, "a;b;c N", as expected by flamegraph.pl and
+// friends. The TimerDefs come first, then the frames.
+std::string GetSamplingProfileCollapsedStacks(const SamplingProfile &profile);
+
+// Table of TimerDefs, with the number of samples that had each one
+// active (total) and innermost (self), sorted by self.
+std::string GetSamplingProfileReport(const SamplingProfile &profile);
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+class SamplingProfiler {
+  public:
+    // Starts the timers for all registered threads. Returns false, with
+    // the details printed to logs, if it's already running or SIGPROF
+    // timers aren't available.
+    static bool Start(const SamplingProfilerOptions &options, const LogSet *logs);
+
+    // Stops the timers and collects the remaining samples.
+    static void Stop();
+
+    static bool IsRunning();
+
+    // Makes the calling thread one that's sampled, whether or not the
+    // profiler is running. Does nothing if the thread is already
+    // registered. The thread is unregistered automatically when it exits.
+    static void RegisterThread();
+
+    static void Collect();
+
+    // Samples collected since the last ResetProfile.
+    static SamplingProfile GetProfile();
+    static void ResetProfile();
+
+  protected:
+  private:
+    // Innermost first. Called from the signal handler.
+    static size_t GetTimerDefStack(const TimerDef **defs, size_t max_num_defs);
+
+    static std::string GetTimerDefName(const TimerDef *def);
+
+    static void SignalHandler(int signum);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
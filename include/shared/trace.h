@@ -0,0 +1,57 @@
+#ifndef HEADER_A15D2625AE8740AE97FFC12F81D2C3C7 // -*- mode:c++ -*-
+#define HEADER_A15D2625AE8740AE97FFC12F81D2C3C7
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <string>
+
+#include "enum_decl.h"
+#include "trace.inl"
+#include "enum_end.h"
+
+struct LogSet;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Timeline tracing. Each thread records events into its own fixed-size
+// ring buffer, without taking any locks; once a buffer is full, the oldest
+// events are overwritten. The buffers can be written out at any time as
+// Chrome trace event JSON, for chrome://tracing or the Perfetto UI.
+//
+// Times are tick counts, as per GetCurrentTickCount. Names and categories
+// are interned strings, so an event is just a few integers.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Number of events each thread's buffer holds. (While its thread is still
+// running, the oldest event in a full buffer may be left out of the JSON, as
+// it could be partway through being overwritten.)
+static constexpr size_t TRACE_BUFFER_NUM_EVENTS = 8192;
+
+// Get ID for a name or category. The same string always gets the same ID,
+// and the ID is never 0. Takes a lock, so cache the result if possible.
+uint32_t GetTraceNameID(const std::string &name);
+
+// Get string for a name or category ID. Returns an empty string if the ID
+// is invalid.
+std::string GetTraceName(uint32_t name_id);
+
+// For Complete events, duration_ticks is the event's duration; it's ignored
+// for the other types.
+void AddTraceEvent(TraceEventType type, uint32_t category_id, uint32_t name_id, uint64_t ticks, uint64_t duration_ticks = 0);
+
+// Discard all events recorded so far.
+void ClearTraceEvents();
+
+// Get all events recorded so far, as a Chrome trace event JSON object.
+void GetChromeTraceJSON(std::string *json);
+bool SaveChromeTraceJSON(const std::string &path, const LogSet *logs);
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#endif
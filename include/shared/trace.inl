@@ -0,0 +1,15 @@
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Chrome trace event phases B, E, X and i respectively.
+#define ENAME TraceEventType
+EBEGIN_DERIVED(uint8_t)
+EPN(Begin)
+EPN(End)
+EPN(Complete)
+EPN(Instant)
+EEND()
+#undef ENAME
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
@@ -161,6 +161,30 @@ done:;
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// On failure, *err is the errno value, or 0 if there isn't one.
+static bool ReplaceFile(const std::string &old_path, const std::string &new_path, int *err) {
+#if SYSTEM_WINDOWS
+
+    if (!MoveFileExW(GetWideString(old_path).c_str(), GetWideString(new_path).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        *err = 0;
+        return false;
+    }
+
+#else
+
+    if (rename(old_path.c_str(), new_path.c_str()) != 0) {
+        *err = errno;
+        return false;
+    }
+
+#endif
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 static bool SaveFile2(const void *data, size_t data_size, const std::string &path, const LogSet *logs, uint32_t flags, const char *fopen_mode) {
     if (flags & SaveFlag_CreateFolder) {
         if (!PathCreateFolder(PathGetFolder(path))) {
@@ -169,7 +193,12 @@ static bool SaveFile2(const void *data, size_t data_size, const std::string &pat
         }
     }
 
-    FILE *f = fopenUTF8(path.c_str(), fopen_mode);
+    std::string write_path = path;
+    if (flags & SaveFlag_AtomicReplace) {
+        write_path += ".tmp";
+    }
+
+    FILE *f = fopenUTF8(write_path.c_str(), fopen_mode);
     if (!f) {
         AddError(logs, path, "save", "fopen failed", errno);
         return false;
@@ -180,14 +209,28 @@ static bool SaveFile2(const void *data, size_t data_size, const std::string &pat
     bool bad = !!ferror(f);
     int e = errno;
 
-    fclose(f);
+    if (fclose(f) != 0 && !bad) {
+        bad = true;
+        e = errno;
+    }
     f = nullptr;
 
     if (bad) {
         AddError(logs, path, "save", "write failed", e);
+        if (flags & SaveFlag_AtomicReplace) {
+            remove(write_path.c_str());
+        }
         return false;
     }
 
+    if (flags & SaveFlag_AtomicReplace) {
+        if (!ReplaceFile(write_path, path, &e)) {
+            AddError(logs, path, "save", "rename failed", e);
+            remove(write_path.c_str());
+            return false;
+        }
+    }
+
     return true;
 }
 
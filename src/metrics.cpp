@@ -1,12 +1,20 @@
 #include <shared/system.h>
 #include <shared/system.h>
 #include <shared/metrics.h>
+#include <shared/metrics_shm.h>
+#include <shared/sampling_profiler.h>
 #include <shared/debug.h>
+#include <shared/trace.h>
+#include <shared/lockfree.h>
 #include <memory>
 #include <vector>
 #include <string>
 #include <shared/mutex.h>
 #include <mutex>
+#include <algorithm>
+#include <thread>
+#include <map>
+#include <new>
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
@@ -19,129 +27,759 @@ struct MetricsGlobals {
     MetricSet *metric_sets_list_head = nullptr;
     std::shared_ptr<MetricSet> global_metric_set;
     std::unique_ptr<Counter> dummy_counter;
+    std::unique_ptr<StripedCounter> dummy_striped_counter;
+    std::unique_ptr<Gauge> dummy_gauge;
+    std::unique_ptr<MaxGauge> dummy_max_gauge;
+    std::unique_ptr<MinGauge> dummy_min_gauge;
     std::unique_ptr<TimerDef> dummy_timer_def;
+
+    // lock metric_sets_list_mutex before accessing.
+    std::map<std::string, std::shared_ptr<MetricSet>> named_metric_sets;
+
+    // Serializes StaticCounter and StaticTimerDef registration.
+    Mutex static_metrics_mutex;
 };
 
-static MetricsGlobals *g_metrics;
+static MetricsGlobals *g_metrics;
+
+static std::atomic<uint32_t> g_next_metrics_stripe{0};
+
+// MetricSet storage.
+static constexpr size_t METRICS_SLAB_SIZE = 16384;
+static constexpr size_t METRICS_SLAB_ALIGNMENT = 64;
+
+std::atomic<bool> Timer::ms_tracing_enabled{false};
+thread_local Timer *Timer::ms_current;
+
+// Stripe index + 1, or 0 if not yet assigned.
+static thread_local uint32_t t_metrics_stripe;
+
+// Stripes are handed out round robin, so with up to METRICS_NUM_STRIPES
+// threads, each gets its own.
+static size_t GetThreadStripeIndex() {
+    uint32_t stripe = t_metrics_stripe;
+    if (stripe == 0) {
+        stripe = g_next_metrics_stripe.fetch_add(1, std::memory_order_relaxed) % METRICS_NUM_STRIPES + 1;
+        t_metrics_stripe = stripe;
+    }
+
+    return stripe - 1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void DeleteMetricsGlobals() {
+    delete g_metrics;
+    g_metrics = nullptr;
+}
+
+static void InitMetricSetsListGlobals() {
+    g_metrics = new MetricsGlobals;
+
+    MUTEX_SET_NAME(g_metrics->metric_sets_list_mutex, "MetricSets list");
+    MUTEX_SET_NAME(g_metrics->static_metrics_mutex, "Static metrics");
+
+    atexit(&DeleteMetricsGlobals);
+}
+
+static void EnsureMetricsGlobalsInitialised() {
+    std::call_once(g_metric_sets_list_once_flag, &InitMetricSetsListGlobals);
+}
+
+[[nodiscard]] static UniqueLock<Mutex> LockMetricSetsList() {
+    EnsureMetricsGlobalsInitialised();
+
+    if (g_metrics) {
+        return UniqueLock<Mutex>(g_metrics->metric_sets_list_mutex);
+    } else {
+        // Global initialization order fiasco!
+        return UniqueLock<Mutex>();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t HistogramSnapshot::GetPercentile(double percentile) const {
+    if (this->num_samples == 0) {
+        return 0;
+    }
+
+    if (percentile < 0.) {
+        percentile = 0.;
+    } else if (percentile > 100.) {
+        percentile = 100.;
+    }
+
+    // rank of the sample wanted, 1-based.
+    auto rank = (uint64_t)(percentile / 100. * (double)this->num_samples + .5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t n = 0;
+    for (size_t i = 0; i < this->counts.size(); ++i) {
+        n += this->counts[i];
+        if (n >= rank) {
+            return std::min(Histogram::GetBucketMaxValue(i), this->max);
+        }
+    }
+
+    return this->max;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void HistogramSnapshot::Merge(const HistogramSnapshot &other) {
+    if (other.counts.empty()) {
+        return;
+    }
+
+    if (this->counts.empty()) {
+        this->counts.resize(HISTOGRAM_NUM_BUCKETS);
+    }
+
+    ASSERT(other.counts.size() == this->counts.size());
+    for (size_t i = 0; i < this->counts.size(); ++i) {
+        this->counts[i] += other.counts[i];
+    }
+
+    this->num_samples += other.num_samples;
+    this->max = std::max(this->max, other.max);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Keeps the storage, for reuse.
+static void ClearHistogramSnapshot(HistogramSnapshot *snapshot) {
+    snapshot->counts.clear();
+    snapshot->num_samples = 0;
+    snapshot->max = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::Record(uint64_t value) {
+    m_counts[GetBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+
+    this->UpdateMax(value);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::Reset() {
+    for (std::atomic<uint64_t> &count : m_counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::GetSnapshot(HistogramSnapshot *snapshot) const {
+    snapshot->counts.resize(HISTOGRAM_NUM_BUCKETS);
+    snapshot->num_samples = 0;
+
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        snapshot->counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        snapshot->num_samples += snapshot->counts[i];
+    }
+
+    snapshot->max = m_max.load(std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::GetSnapshotAndReset(HistogramSnapshot *snapshot) {
+    snapshot->counts.resize(HISTOGRAM_NUM_BUCKETS);
+    snapshot->num_samples = 0;
+
+    snapshot->max = m_max.exchange(0, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        snapshot->counts[i] = m_counts[i].exchange(0, std::memory_order_relaxed);
+        snapshot->num_samples += snapshot->counts[i];
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::Merge(const HistogramSnapshot &snapshot) {
+    ASSERT(snapshot.counts.empty() || snapshot.counts.size() == HISTOGRAM_NUM_BUCKETS);
+
+    for (size_t i = 0; i < snapshot.counts.size(); ++i) {
+        if (snapshot.counts[i] != 0) {
+            m_counts[i].fetch_add(snapshot.counts[i], std::memory_order_relaxed);
+        }
+    }
+
+    if (snapshot.num_samples > 0) {
+        this->UpdateMax(snapshot.max);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Values below HISTOGRAM_NUM_SUB_BUCKETS get a bucket each. After that,
+// it's HISTOGRAM_NUM_SUB_BUCKETS buckets per power of 2.
+size_t Histogram::GetBucketIndex(uint64_t value) {
+    if (value < HISTOGRAM_NUM_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+
+    auto msb = (size_t)GetHighestSetBitIndex64(value);
+    size_t shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    size_t sub_bucket = (size_t)(value >> shift) & (HISTOGRAM_NUM_SUB_BUCKETS - 1);
+
+    return (shift + 1) * HISTOGRAM_NUM_SUB_BUCKETS + sub_bucket;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Histogram::GetBucketMinValue(size_t index) {
+    ASSERT(index < HISTOGRAM_NUM_BUCKETS);
+
+    if (index < HISTOGRAM_NUM_SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t shift = index / HISTOGRAM_NUM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index % HISTOGRAM_NUM_SUB_BUCKETS;
+
+    return (HISTOGRAM_NUM_SUB_BUCKETS + sub_bucket) << shift;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Histogram::GetBucketMaxValue(size_t index) {
+    ASSERT(index < HISTOGRAM_NUM_BUCKETS);
+
+    if (index < HISTOGRAM_NUM_SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t shift = index / HISTOGRAM_NUM_SUB_BUCKETS - 1;
+
+    return GetBucketMinValue(index) + (((uint64_t)1 << shift) - 1);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Histogram::UpdateMax(uint64_t value) {
+    uint64_t max = m_max.load(std::memory_order_relaxed);
+    while (value > max) {
+        if (m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TimerDef::TimerDef(std::string name_, MetricSet *set, TimerDefStripe *set_stripes)
+    : name(std::move(name_))
+    , m_set(set) {
+    if (set_stripes) {
+        for (size_t i = 0; i < METRICS_NUM_STRIPES; ++i) {
+            new (&set_stripes[i]) TimerDefStripe;
+        }
+
+        m_stripes = set_stripes;
+    } else {
+        m_local_stripes.reset(new TimerDefStripe[METRICS_NUM_STRIPES]);
+        m_stripes = m_local_stripes.get();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TimerDef::~TimerDef() {
+    delete m_histogram.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::Reset() {
+    for (size_t i = 0; i < METRICS_NUM_STRIPES; ++i) {
+        ResetTimerDefStripe(&m_stripes[i]);
+    }
+
+    if (Histogram *histogram = m_histogram.load(std::memory_order_acquire)) {
+        histogram->Reset();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TimerDefTotals TimerDef::GetTotals() const {
+    TimerDefTotals totals;
+    GetStripesTotals(m_stripes, 0, &totals);
+
+    return totals;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Writers have to wait for the stripe's seqlock, so each stripe's values
+// are either all in the result, or all left for next time.
+TimerDefTotals TimerDef::GetTotalsAndReset(HistogramSnapshot *histogram_snapshot) {
+    TimerDefTotals totals;
+
+    for (size_t i = 0; i < METRICS_NUM_STRIPES; ++i) {
+        TakeTimerDefStripe(&m_stripes[i], &totals);
+    }
+
+    Histogram *histogram = m_histogram.load(std::memory_order_acquire);
+    if (histogram_snapshot) {
+        if (histogram) {
+            histogram->GetSnapshotAndReset(histogram_snapshot);
+        } else {
+            ClearHistogramSnapshot(histogram_snapshot);
+        }
+    } else if (histogram) {
+        histogram->Reset();
+    }
+
+    return totals;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool TimerDef::GetStripesTotals(const TimerDefStripe *stripes, size_t max_num_tries, TimerDefTotals *totals) {
+    *totals = TimerDefTotals();
+
+    for (size_t i = 0; i < METRICS_NUM_STRIPES; ++i) {
+        if (!AddTimerDefStripeTotals(&stripes[i], max_num_tries, totals)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t TimerDef::GetTotalNumTicks() const {
+    return this->GetTotals().total_num_ticks;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t TimerDef::GetNumSamples() const {
+    return this->GetTotals().num_samples;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t TimerDef::GetSelfNumTicks() const {
+    return this->GetTotals().self_num_ticks;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::AddTicks(uint64_t num_ticks) {
+    this->AddTicks(num_ticks, num_ticks);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::AddTicks(uint64_t num_ticks, uint64_t self_num_ticks, const uint64_t *perf_counter_deltas) {
+    AddToTimerDefStripe(&m_stripes[GetThreadStripeIndex()], num_ticks, self_num_ticks, perf_counter_deltas);
+
+    if (Histogram *histogram = m_histogram.load(std::memory_order_acquire)) {
+        histogram->Record(num_ticks);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const TimerDef *TimerDef::GetParent() const {
+    if (m_set) {
+        LockGuard lock(m_set->m_mutex);
+
+        return m_parent;
+    } else {
+        return nullptr;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::vector<const TimerDef *> TimerDef::GetChildren() const {
+    if (m_set) {
+        LockGuard lock(m_set->m_mutex);
+
+        return {m_children.begin(), m_children.end()};
+    } else {
+        return {};
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::EnableHistogram() {
+    if (m_histogram.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    auto histogram = new Histogram;
+
+    Histogram *expected = nullptr;
+    if (!m_histogram.compare_exchange_strong(expected, histogram, std::memory_order_acq_rel)) {
+        // somebody else got there first.
+        delete histogram;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Histogram *TimerDef::GetHistogram() const {
+    return m_histogram.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static uint32_t GetTimerTraceCategoryID() {
+    static const uint32_t timer_category_id = GetTraceNameID("timer");
+
+    return timer_category_id;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::AddTraceBeginEvent(uint64_t ticks) {
+    AddTraceEvent(TraceEventType_Begin, GetTimerTraceCategoryID(), this->GetTraceNameID(), ticks);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::AddTraceEndEvent(uint64_t ticks) {
+    AddTraceEvent(TraceEventType_End, GetTimerTraceCategoryID(), this->GetTraceNameID(), ticks);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TimerDef::SetAutoParent(const TimerDef *outer_def) {
+    if (!m_set) {
+        return;
+    }
+
+    LockGuard<Mutex> lock(m_set->m_mutex);
+
+    // Another thread may have got here first.
+    if (!m_auto_parent.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    m_auto_parent.store(false, std::memory_order_relaxed);
+
+    if (!outer_def || outer_def->m_set != m_set) {
+        return;
+    }
+
+    for (const TimerDef *def = outer_def; def; def = def->m_parent) {
+        if (def == this) {
+            return;
+        }
+    }
+
+    std::vector<const TimerDef *> *roots = &m_set->m_root_timer_defs;
+    roots->erase(std::find(roots->begin(), roots->end(), this));
+
+    // The parent is from the same set, and the set's mutex is held, so the
+    // const_cast is harmless.
+    m_parent = const_cast<TimerDef *>(outer_def);
+    m_parent->m_children.push_back(this);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint32_t TimerDef::GetTraceNameID() {
+    uint32_t name_id = m_trace_name_id.load(std::memory_order_acquire);
+    if (name_id == 0) {
+        name_id = ::GetTraceNameID(this->name);
+        m_trace_name_id.store(name_id, std::memory_order_release);
+    }
+
+    return name_id;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Timer::SetTracingEnabled(bool enabled) {
+    ms_tracing_enabled.store(enabled, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Timer::IsTracingEnabled() {
+    return ms_tracing_enabled.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// If the mode changed in the middle, the counters aren't comparable, so
+// only the ticks are added.
+void Timer::AddTicksAndPerfCounters(uint64_t num_ticks, uint64_t self_num_ticks) {
+    PerfCounterValues perf_end;
+    uint64_t deltas[PERF_COUNTERS_NUM_COUNTERS];
+    if (!PerfCounters::ReadThreadCounters(&perf_end) || !PerfCounters::GetDeltas(m_perf_begin, perf_end, deltas)) {
+        m_def->AddTicks(num_ticks, self_num_ticks);
+        return;
+    }
+
+    m_def->AddTicks(num_ticks, self_num_ticks, deltas);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Value::Value(std::string name_)
+    : name(std::move(name_)) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Value::GetValueAndReset() {
+    uint64_t value = this->GetValue();
+    this->Reset();
+    return value;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Value::IsSigned() const {
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Counter::Reset() {
+    m_value_ptr->store(0, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Counter::GetValue() const {
+    return m_value_ptr->load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-static void DeleteMetricsGlobals() {
-    delete g_metrics;
-    g_metrics = nullptr;
+uint64_t Counter::GetValueAndReset() {
+    return m_value_ptr->exchange(0, std::memory_order_acq_rel);
 }
 
-static void InitMetricSetsListGlobals() {
-    g_metrics = new MetricsGlobals;
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    MUTEX_SET_NAME(g_metrics->metric_sets_list_mutex, "MetricSets list");
+Counter::Counter(std::string name_)
+    : Value(std::move(name_)) {
+}
 
-    atexit(&DeleteMetricsGlobals);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The value is a level, not an accumulation, so there's nothing to reset.
+// Zeroing it would leave every later Add or Sub measured from the wrong
+// baseline.
+void Gauge::Reset() {
 }
 
-static void EnsureMetricsGlobalsInitialised() {
-    std::call_once(g_metric_sets_list_once_flag, &InitMetricSetsListGlobals);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Gauge::GetValue() const {
+    return (uint64_t)m_value_ptr->load(std::memory_order_relaxed);
 }
 
-[[nodiscard]] static UniqueLock<Mutex> LockMetricSetsList() {
-    EnsureMetricsGlobalsInitialised();
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    if (g_metrics) {
-        return UniqueLock<Mutex>(g_metrics->metric_sets_list_mutex);
-    } else {
-        // Global initialization order fiasco!
-        return UniqueLock<Mutex>();
-    }
+// As Reset, there's nothing to reset.
+uint64_t Gauge::GetValueAndReset() {
+    return this->GetValue();
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-TimerDef::TimerDef(std::string name_, MetricSet *set)
-    : name(std::move(name_))
-    , m_set(set) {
+bool Gauge::IsSigned() const {
+    return true;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void TimerDef::Reset() {
-    m_total_num_ticks = 0;
-    m_num_samples = 0;
+Gauge::Gauge(std::string name_)
+    : Value(std::move(name_)) {
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-uint64_t TimerDef::GetTotalNumTicks() const {
-    return m_total_num_ticks.load(std::memory_order_acquire);
+uint64_t MaxGauge::GetValueAndReset() {
+    return m_value.exchange(0, std::memory_order_relaxed);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-uint64_t TimerDef::GetNumSamples() const {
-    return m_num_samples.load(std::memory_order_acquire);
+void MaxGauge::Reset() {
+    m_value.store(0, std::memory_order_relaxed);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void TimerDef::AddTicks(uint64_t num_ticks) {
-    m_total_num_ticks.fetch_add(num_ticks, std::memory_order_acq_rel);
-    m_num_samples.fetch_add(1, std::memory_order_acq_rel);
+uint64_t MaxGauge::GetValue() const {
+    return m_value.load(std::memory_order_relaxed);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-const TimerDef *TimerDef::GetParent() const {
-    return m_parent;
+MaxGauge::MaxGauge(std::string name_)
+    : Value(std::move(name_)) {
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-std::vector<const TimerDef *> TimerDef::GetChildren() const {
-    if (m_set) {
-        LockGuard lock(m_set->m_mutex);
+uint64_t MinGauge::GetValueAndReset() {
+    uint64_t value = m_value.exchange(UINT64_MAX, std::memory_order_relaxed);
 
-        return {m_children.begin(), m_children.end()};
-    } else {
-        return {};
-    }
+    return value == UINT64_MAX ? 0 : value;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-Value::Value(std::string name_)
-    : name(std::move(name_)) {
+void MinGauge::Reset() {
+    m_value.store(UINT64_MAX, std::memory_order_relaxed);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void Counter::Reset() {
-    m_value.store(0, std::memory_order_release);
+uint64_t MinGauge::GetValue() const {
+    uint64_t value = m_value.load(std::memory_order_relaxed);
+
+    return value == UINT64_MAX ? 0 : value;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-uint64_t Counter::GetValue() const {
-    return m_value.load(std::memory_order_acquire);
+MinGauge::MinGauge(std::string name_)
+    : Value(std::move(name_)) {
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-Counter::Counter(std::string name_)
+void StripedCounter::Add(uint64_t n) {
+    m_stripes[GetThreadStripeIndex()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void StripedCounter::Reset() {
+    m_reset_value.store(this->GetTotal(), std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Each stripe only ever increases, so the total is never less than the
+// reset value.
+uint64_t StripedCounter::GetValue() const {
+    uint64_t reset_value = m_reset_value.load(std::memory_order_acquire);
+
+    return this->GetTotal() - reset_value;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The reset value is read before the total, so the total is never less,
+// even if another reset gets in first - in which case, try again.
+uint64_t StripedCounter::GetValueAndReset() {
+    uint64_t reset_value = m_reset_value.load(std::memory_order_acquire);
+    for (;;) {
+        uint64_t total = this->GetTotal();
+        if (m_reset_value.compare_exchange_weak(reset_value, total, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return total - reset_value;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+StripedCounter::StripedCounter(std::string name_)
     : Value(std::move(name_)) {
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MetricSet::MetricSet(std::string name) {
+uint64_t StripedCounter::GetTotal() const {
+    uint64_t total = 0;
+    for (const Stripe &stripe : m_stripes) {
+        total += stripe.value.load(std::memory_order_relaxed);
+    }
+
+    return total;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricSet::MetricSet(std::string name, std::shared_ptr<MetricsSharedMemory> shm)
+    : m_shm(std::move(shm)) {
     this->SetName(std::move(name));
 }
 
@@ -149,7 +787,14 @@ MetricSet::MetricSet(std::string name) {
 //////////////////////////////////////////////////////////////////////////
 
 std::shared_ptr<MetricSet> MetricSet::Create(std::string name) {
-    std::shared_ptr<MetricSet> set = Create2(std::move(name));
+    return Create(std::move(name), nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<MetricSet> MetricSet::Create(std::string name, std::shared_ptr<MetricsSharedMemory> shm) {
+    std::shared_ptr<MetricSet> set = Create2(std::move(name), std::move(shm));
 
     UniqueLock<Mutex> lock = LockMetricSetsList();
 
@@ -186,6 +831,28 @@ MetricSet::~MetricSet() {
             // Global initialization order disaster!
         }
     }
+
+    // The sampling profiler's buffers may refer to this set's TimerDefs.
+    SamplingProfiler::Collect();
+
+    // So another process reading the shared memory knows these metrics
+    // are gone.
+    for (uint32_t shm_index : m_shm_entry_indexes) {
+        m_shm->RetireEntry(shm_index);
+    }
+
+    // The metrics live in the slabs, so they're destroyed by hand.
+    m_all_values.ForEach([](Value *value) {
+        value->~Value();
+    });
+
+    m_all_timer_defs.ForEach([](TimerDef *def) {
+        def->~TimerDef();
+    });
+
+    for (void *slab : m_slabs) {
+        operator delete(slab, std::align_val_t(METRICS_SLAB_ALIGNMENT));
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -207,20 +874,80 @@ TimerDef *MetricSet::CreateTimerDef(const std::shared_ptr<MetricSet> &set, std::
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-Counter *MetricSet::CreateCounter(const std::shared_ptr<MetricSet> &set, std::string name) {
+// Nothing can use the TimerDef until it's returned, so setting the flag
+// afterwards is fine.
+TimerDef *MetricSet::CreateAutoTimerDef(const std::shared_ptr<MetricSet> &set, std::string name) {
+    TimerDef *def = CreateTimerDef2(set, std::move(name), nullptr);
+
+    if (set) {
+        def->m_auto_parent.store(true, std::memory_order_relaxed);
+    }
+
+    return def;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// If the set is null, returns the dummy, creating it if necessary.
+template <class ValueType>
+ValueType *MetricSet::CreateValue(const std::shared_ptr<MetricSet> &set, std::string name, std::unique_ptr<ValueType> MetricsGlobals::*dummy_mptr) {
     if (!set) {
-        EnsureMetricsGlobalsInitialised();
-        return g_metrics->dummy_counter.get();
+        UniqueLock<Mutex> lock = LockMetricSetsList();
+
+        std::unique_ptr<ValueType> *dummy = &(g_metrics->*dummy_mptr);
+        if (!*dummy) {
+            dummy->reset(new ValueType("dummy"));
+        }
+
+        return dummy->get();
     } else {
-        auto counter = new Counter(std::move(name));
-        set->AddValue(counter);
-        return counter;
+        LockGuard<Mutex> lock(set->m_mutex);
+
+        auto value = new (set->AllocateLocked(sizeof(ValueType), alignof(ValueType))) ValueType(std::move(name));
+        set->AddLockedValue(value);
+        return value;
     }
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+Counter *MetricSet::CreateCounter(const std::shared_ptr<MetricSet> &set, std::string name) {
+    return CreateValue(set, std::move(name), &MetricsGlobals::dummy_counter);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+StripedCounter *MetricSet::CreateStripedCounter(const std::shared_ptr<MetricSet> &set, std::string name) {
+    return CreateValue(set, std::move(name), &MetricsGlobals::dummy_striped_counter);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Gauge *MetricSet::CreateGauge(const std::shared_ptr<MetricSet> &set, std::string name) {
+    return CreateValue(set, std::move(name), &MetricsGlobals::dummy_gauge);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MaxGauge *MetricSet::CreateMaxGauge(const std::shared_ptr<MetricSet> &set, std::string name) {
+    return CreateValue(set, std::move(name), &MetricsGlobals::dummy_max_gauge);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MinGauge *MetricSet::CreateMinGauge(const std::shared_ptr<MetricSet> &set, std::string name) {
+    return CreateValue(set, std::move(name), &MetricsGlobals::dummy_min_gauge);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 class DerivedValue : public Value {
   public:
     DerivedValue(std::string name_, std::function<uint64_t()> fun)
@@ -243,7 +970,10 @@ class DerivedValue : public Value {
 
 void MetricSet::CreateDerivedValue(const std::shared_ptr<MetricSet> &set, std::string name, std::function<uint64_t()> fun) {
     if (set) {
-        set->AddValue(new DerivedValue(std::move(name), std::move(fun)));
+        LockGuard<Mutex> lock(set->m_mutex);
+
+        auto value = new (set->AllocateLocked(sizeof(DerivedValue), alignof(DerivedValue))) DerivedValue(std::move(name), std::move(fun));
+        set->AddLockedValue(value);
     }
 }
 
@@ -251,11 +981,9 @@ void MetricSet::CreateDerivedValue(const std::shared_ptr<MetricSet> &set, std::s
 //////////////////////////////////////////////////////////////////////////
 
 void MetricSet::ResetTimerDefs() {
-    LockGuard<Mutex> lock(m_mutex);
-
-    for (const std::unique_ptr<TimerDef> &def : m_all_timer_defs) {
+    m_all_timer_defs.ForEach([](TimerDef *def) {
         def->Reset();
-    }
+    });
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -271,20 +999,63 @@ std::vector<const TimerDef *> MetricSet::GetRootTimerDefs() const {
 //////////////////////////////////////////////////////////////////////////
 
 void MetricSet::ResetCounters() {
-    LockGuard<Mutex> lock(m_mutex);
-
-    for (const std::unique_ptr<Value> &counter : m_all_values_unique) {
-        counter->Reset();
-    }
+    m_all_values.ForEach([](Value *value) {
+        value->Reset();
+    });
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
 std::vector<const Value *> MetricSet::GetValues() const {
-    LockGuard<Mutex> lock(m_mutex);
+    std::vector<const Value *> values;
+    values.reserve(m_all_values.GetSize());
+
+    m_all_values.ForEach([&values](const Value *value) {
+        values.push_back(value);
+    });
+
+    return values;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MetricSet::Snapshot(bool reset, MetricSetSnapshot *snapshot) {
+    snapshot->values.clear();
+    m_all_values.ForEach([reset, snapshot](Value *value) {
+        MetricSetSnapshotValue *snapshot_value = &snapshot->values.emplace_back();
+
+        snapshot_value->metric = value;
+        snapshot_value->value = reset ? value->GetValueAndReset() : value->GetValue();
+    });
+
+    // Overwrite the existing entries, rather than clearing, so their
+    // histogram storage gets reused.
+    size_t num_timer_defs = 0;
+    m_all_timer_defs.ForEach([reset, snapshot, &num_timer_defs](TimerDef *def) {
+        if (num_timer_defs == snapshot->timer_defs.size()) {
+            snapshot->timer_defs.emplace_back();
+        }
+
+        MetricSetSnapshotTimerDef *snapshot_def = &snapshot->timer_defs[num_timer_defs++];
 
-    return m_all_values_raw;
+        snapshot_def->def = def;
+
+        if (reset) {
+            snapshot_def->totals = def->GetTotalsAndReset(&snapshot_def->histogram);
+        } else {
+            snapshot_def->totals = def->GetTotals();
+
+            if (const Histogram *histogram = def->GetHistogram()) {
+                histogram->GetSnapshot(&snapshot_def->histogram);
+            } else {
+                ClearHistogramSnapshot(&snapshot_def->histogram);
+            }
+        }
+    });
+
+    snapshot->timer_defs.resize(num_timer_defs);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -299,6 +1070,15 @@ std::string MetricSet::GetName() const {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+void MetricSet::GetName(std::string *name) const {
+    LockGuard<Mutex> lock(m_mutex);
+
+    *name = m_name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 void MetricSet::SetName(std::string name) {
     LockGuard<Mutex> lock(m_mutex);
 
@@ -322,11 +1102,23 @@ TimerDef *MetricSet::CreateTimerDef2(const std::shared_ptr<MetricSet> &set, std:
 
         return g_metrics->dummy_timer_def.get();
     } else {
-        auto def = new TimerDef(std::move(name), set.get());
-        auto unique_def = std::unique_ptr<TimerDef>(def);
-
         LockGuard<Mutex> lock(set->m_mutex);
 
+        TimerDefStripe *stripes = nullptr;
+        if (set->m_shm) {
+            uint32_t shm_index;
+            stripes = (TimerDefStripe *)set->m_shm->AddEntry(MetricsShmType_TimerDef, set->GetLockedShmEntryName(parent, name), &shm_index);
+            if (stripes) {
+                set->m_shm_entry_indexes.push_back(shm_index);
+            }
+        }
+
+        if (!stripes) {
+            stripes = (TimerDefStripe *)set->AllocateLocked(sizeof(TimerDefStripe) * METRICS_NUM_STRIPES, alignof(TimerDefStripe));
+        }
+
+        auto def = new (set->AllocateLocked(sizeof(TimerDef), alignof(TimerDef))) TimerDef(std::move(name), set.get(), stripes);
+
         if (!parent) {
             set->m_root_timer_defs.push_back(def);
         } else {
@@ -334,7 +1126,7 @@ TimerDef *MetricSet::CreateTimerDef2(const std::shared_ptr<MetricSet> &set, std:
             parent->m_children.push_back(def);
         }
 
-        set->m_all_timer_defs.push_back(std::move(unique_def));
+        set->m_all_timer_defs.Append(def);
 
         return def;
     }
@@ -361,6 +1153,19 @@ std::vector<std::shared_ptr<MetricSet>> MetricSet::GetAll() {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+// A set whose last reference has gone is still intact until its destructor
+// has unlinked it, which it can't do while the list is locked.
+void MetricSet::ForEach(const std::function<void(const MetricSet *)> &fun) {
+    UniqueLock<Mutex> lock = LockMetricSetsList();
+
+    for (const MetricSet *set = g_metrics->metric_sets_list_head; set; set = set->m_next) {
+        fun(set);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 std::shared_ptr<MetricSet> MetricSet::GetGlobal() {
     UniqueLock<Mutex> lock = LockMetricSetsList();
 
@@ -376,6 +1181,22 @@ std::shared_ptr<MetricSet> MetricSet::GetGlobal() {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+std::shared_ptr<MetricSet> MetricSet::GetNamed(const char *name) {
+    UniqueLock<Mutex> lock = LockMetricSetsList();
+
+    std::shared_ptr<MetricSet> *set = &g_metrics->named_metric_sets[name];
+    if (!*set) {
+        *set = Create2(name);
+
+        (*set)->LinkIntoLockedList();
+    }
+
+    return *set;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 void MetricSet::CheckLockedList() {
     for (MetricSet *set = g_metrics->metric_sets_list_head; set; set = set->m_next) {
         if (set->m_prev) {
@@ -408,8 +1229,8 @@ void MetricSet::LinkIntoLockedList() {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-std::shared_ptr<MetricSet> MetricSet::Create2(std::string name) {
-    auto set = new MetricSet(std::move(name));
+std::shared_ptr<MetricSet> MetricSet::Create2(std::string name, std::shared_ptr<MetricsSharedMemory> shm) {
+    auto set = new MetricSet(std::move(name), std::move(shm));
 
     // Ugh, but... private constructor...
     auto set_shared = std::shared_ptr<MetricSet>(set);
@@ -420,9 +1241,124 @@ std::shared_ptr<MetricSet> MetricSet::Create2(std::string name) {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void MetricSet::AddValue(Value *value) {
-    LockGuard<Mutex> lock(m_mutex);
+// Metrics are bump allocated from slabs, so each slab holds a run of them
+// back to back, and they never move. Anything too big for a slab gets one
+// to itself.
+void *MetricSet::AllocateLocked(size_t size, size_t alignment) {
+    ASSERT(alignment <= METRICS_SLAB_ALIGNMENT);
+
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    if (size > METRICS_SLAB_SIZE / 4) {
+        void *slab = operator new(size, std::align_val_t(METRICS_SLAB_ALIGNMENT));
+        m_slabs.push_back(slab);
+        return slab;
+    }
+
+    uint8_t *p = (uint8_t *)(((uintptr_t)m_slab_next + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (!m_slab_next || p + size > m_slab_end) {
+        void *slab = operator new(METRICS_SLAB_SIZE, std::align_val_t(METRICS_SLAB_ALIGNMENT));
+        m_slabs.push_back(slab);
+
+        p = (uint8_t *)slab;
+        m_slab_end = p + METRICS_SLAB_SIZE;
+    }
+
+    m_slab_next = p + size;
+
+    return p;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Counters and Gauges move into the shared memory, if there is any. (Nothing
+// else can have seen the new value yet, so this is safe.)
+void MetricSet::AddLockedValue(Value *value) {
+    if (m_shm) {
+        uint32_t shm_index;
+        if (auto counter = dynamic_cast<Counter *>(value)) {
+            if (void *data = m_shm->AddEntry(MetricsShmType_Counter, this->GetLockedShmEntryName(nullptr, value->name), &shm_index)) {
+                counter->m_value_ptr = new (data) std::atomic<uint64_t>(counter->m_value.load(std::memory_order_relaxed));
+                m_shm_entry_indexes.push_back(shm_index);
+            }
+        } else if (auto gauge = dynamic_cast<Gauge *>(value)) {
+            if (void *data = m_shm->AddEntry(MetricsShmType_Gauge, this->GetLockedShmEntryName(nullptr, value->name), &shm_index)) {
+                gauge->m_value_ptr = new (data) std::atomic<int64_t>(gauge->m_value.load(std::memory_order_relaxed));
+                m_shm_entry_indexes.push_back(shm_index);
+            }
+        }
+    }
+
+    m_all_values.Append(value);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::string MetricSet::GetLockedShmEntryName(const TimerDef *parent, const std::string &name) const {
+    std::string path = name;
+    for (const TimerDef *def = parent; def; def = def->m_parent) {
+        path = def->name + "/" + path;
+    }
 
-    m_all_values_raw.push_back(value);
-    m_all_values_unique.push_back(std::unique_ptr<Value>(value));
+    return m_name + "/" + path;
 }
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Counter *StaticCounter::Register() {
+    std::shared_ptr<MetricSet> set = MetricSet::GetNamed(m_set_name);
+
+    LockGuard<Mutex> lock(g_metrics->static_metrics_mutex);
+
+    // Another thread may have got here first.
+    Counter *counter = m_counter.load(std::memory_order_acquire);
+    if (!counter) {
+        counter = MetricSet::CreateCounter(set, m_name);
+        m_counter.store(counter, std::memory_order_release);
+    }
+
+    return counter;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const char *StaticTimerDef::GetSetName() const {
+    const StaticTimerDef *root = this;
+    while (root->m_parent) {
+        root = root->m_parent;
+    }
+
+    return root->m_set_name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TimerDef *StaticTimerDef::Register() {
+    // (Do the parent first, as it takes the same lock.)
+    TimerDef *parent = m_parent ? m_parent->Get() : nullptr;
+
+    std::shared_ptr<MetricSet> set = MetricSet::GetNamed(this->GetSetName());
+
+    LockGuard<Mutex> lock(g_metrics->static_metrics_mutex);
+
+    TimerDef *def = m_def.load(std::memory_order_acquire);
+    if (!def) {
+        if (parent) {
+            def = MetricSet::CreateTimerDef(set, m_name, parent);
+        } else {
+            def = MetricSet::CreateTimerDef(set, m_name);
+        }
+
+        m_def.store(def, std::memory_order_release);
+    }
+
+    return def;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
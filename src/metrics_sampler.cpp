@@ -0,0 +1,239 @@
+#include <shared/system.h>
+#include <shared/metrics_sampler.h>
+#include <shared/metrics.h>
+#include <shared/debug.h>
+#include <algorithm>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct MetricsSamplerReading {
+    const void *metric = nullptr;
+    uint64_t value = 0;
+    uint64_t num_samples = 0;
+    bool is_signed = false;
+    bool counter = false;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AddTimerDefReadings(std::vector<MetricsSamplerReading> *readings, const TimerDef *def) {
+    TimerDefTotals totals = def->GetTotals();
+    readings->push_back({def, totals.total_num_ticks, totals.num_samples, false, true});
+
+    for (const TimerDef *child : def->GetChildren()) {
+        AddTimerDefReadings(readings, child);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static int64_t GetSignedValue(uint64_t value, bool is_signed) {
+    if (!is_signed && value > (uint64_t)INT64_MAX) {
+        return INT64_MAX;
+    }
+
+    return (int64_t)value;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsSampler::MetricsSampler(uint32_t interval_ms, size_t num_samples_per_metric)
+    : m_interval_ms(interval_ms)
+    , m_num_samples_per_metric(std::max(num_samples_per_metric, (size_t)1)) {
+    MUTEX_SET_NAME(m_mutex, "MetricsSampler");
+
+    if (m_interval_ms > 0) {
+        m_thread = std::thread(&MetricsSampler::ThreadMain, this);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsSampler::~MetricsSampler() {
+    {
+        LockGuard<Mutex> lock(m_mutex);
+
+        m_stop = true;
+    }
+
+    m_stop_cv.notify_all();
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MetricsSampler::Sample() {
+    // Read everything first, so m_mutex isn't held while calling out to
+    // arbitrary DerivedValue functions.
+    std::vector<MetricsSamplerReading> readings;
+    for (const std::shared_ptr<MetricSet> &set : MetricSet::GetAll()) {
+        set->ForEachValue([&readings](const Value *value) {
+            bool counter = dynamic_cast<const Counter *>(value) || dynamic_cast<const StripedCounter *>(value);
+            readings.push_back({value, value->GetValue(), 0, value->IsSigned(), counter});
+        });
+
+        for (const TimerDef *def : set->GetRootTimerDefs()) {
+            AddTimerDefReadings(&readings, def);
+        }
+    }
+
+    LockGuard<Mutex> lock(m_mutex);
+
+    // (Get the time with the lock held, so it's always increasing, even if
+    // several threads are sampling.)
+    uint64_t ticks = GetCurrentTickCount();
+
+    ++m_pass;
+
+    for (const MetricsSamplerReading &reading : readings) {
+        this->AddLockedSample(reading.metric, reading.is_signed, reading.counter, ticks, reading.value, reading.num_samples);
+    }
+
+    for (auto it = m_series.begin(); it != m_series.end();) {
+        if (it->second.pass != m_pass) {
+            it = m_series.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool MetricsSampler::GetWindow(const Value *value, double window_seconds, MetricsSamplerWindow *window) const {
+    return this->GetWindow2(value, window_seconds, window);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool MetricsSampler::GetWindow(const TimerDef *def, double window_seconds, MetricsSamplerWindow *window) const {
+    return this->GetWindow2(def, window_seconds, window);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MetricsSampler::ThreadMain() {
+    SetCurrentThreadName("MetricsSampler");
+
+    UniqueLock<Mutex> lock(m_mutex);
+
+    for (;;) {
+        m_stop_cv.wait_for(lock, std::chrono::milliseconds(m_interval_ms), [this]() {
+            return m_stop;
+        });
+
+        if (m_stop) {
+            break;
+        }
+
+        lock.unlock();
+        this->Sample();
+        lock.lock();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The first reading for a metric just sets up the baseline.
+void MetricsSampler::AddLockedSample(const void *metric, bool is_signed, bool counter, uint64_t ticks, uint64_t value, uint64_t num_samples) {
+    auto it = m_series.find(metric);
+    if (it == m_series.end()) {
+        Series *series = &m_series[metric];
+        series->entries.resize(m_num_samples_per_metric);
+        series->is_signed = is_signed;
+        series->counter = counter;
+        series->last_ticks = ticks;
+        series->last_value = value;
+        series->last_num_samples = num_samples;
+        series->pass = m_pass;
+        return;
+    }
+
+    Series *series = &it->second;
+
+    SeriesEntry *entry = &series->entries[series->next_index];
+    entry->interval_ticks = ticks - series->last_ticks;
+    entry->value = GetSignedValue(value, series->is_signed);
+
+    if (series->counter) {
+        entry->delta = GetSignedValue(value >= series->last_value ? value - series->last_value : value, false);
+    } else {
+        // (Via uint64_t, so a huge swing wraps rather than overflowing.)
+        entry->delta = (int64_t)((uint64_t)entry->value - (uint64_t)GetSignedValue(series->last_value, series->is_signed));
+    }
+    entry->num_samples_delta = num_samples >= series->last_num_samples ? num_samples - series->last_num_samples : num_samples;
+
+    series->next_index = (series->next_index + 1) % series->entries.size();
+    series->num_entries = std::min(series->num_entries + 1, series->entries.size());
+
+    series->last_ticks = ticks;
+    series->last_value = value;
+    series->last_num_samples = num_samples;
+    series->pass = m_pass;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool MetricsSampler::GetWindow2(const void *metric, double window_seconds, MetricsSamplerWindow *window) const {
+    *window = MetricsSamplerWindow();
+
+    LockGuard<Mutex> lock(m_mutex);
+
+    auto it = m_series.find(metric);
+    if (it == m_series.end()) {
+        return false;
+    }
+
+    const Series *series = &it->second;
+
+    uint64_t total_ticks = 0;
+    double total_value = 0.;
+    size_t index = series->next_index;
+
+    while (window->num_samples < series->num_entries && GetSecondsFromTicks(total_ticks) < window_seconds) {
+        index = (index + series->entries.size() - 1) % series->entries.size();
+        const SeriesEntry *entry = &series->entries[index];
+
+        if (window->num_samples == 0) {
+            window->min_value = entry->value;
+            window->max_value = entry->value;
+        } else {
+            window->min_value = std::min(window->min_value, entry->value);
+            window->max_value = std::max(window->max_value, entry->value);
+        }
+
+        total_ticks += entry->interval_ticks;
+        total_value += (double)entry->value;
+        window->total_delta += entry->delta;
+        window->total_num_samples_delta += entry->num_samples_delta;
+        ++window->num_samples;
+    }
+
+    if (window->num_samples > 0) {
+        window->seconds = GetSecondsFromTicks(total_ticks);
+        window->mean_value = total_value / (double)window->num_samples;
+
+        if (window->seconds > 0.) {
+            window->delta_per_second = (double)window->total_delta / window->seconds;
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
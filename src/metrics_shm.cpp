@@ -0,0 +1,414 @@
+#include <shared/system.h>
+#include <shared/metrics_shm.h>
+#include <shared/debug.h>
+#include <shared/log.h>
+#include <new>
+#include <string.h>
+#include <inttypes.h>
+
+#if SYSTEM_POSIX
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include <shared/enum_def.h>
+#include <shared/metrics_shm.inl>
+#include <shared/enum_end.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The values are read by another process, so the atomics had better not
+// involve any locks.
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<int64_t>::is_always_lock_free);
+
+static constexpr size_t METRICS_SHM_DATA_ALIGNMENT = 64;
+static constexpr size_t METRICS_SHM_TIMER_DEF_DATA_SIZE = sizeof(TimerDefStripe) * METRICS_NUM_STRIPES;
+
+// A TimerDef that's still being updated after this many tries is assumed
+// to belong to a process that died part way through.
+static constexpr size_t METRICS_SHM_MAX_NUM_READ_TRIES = 1000;
+
+static LOG_DEFINE(METRICS_SHM, "", &log_printer_stderr);
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static size_t GetDataSize(MetricsShmType type) {
+    switch (type) {
+    case MetricsShmType_Counter:
+    case MetricsShmType_Gauge:
+        return METRICS_SHM_DATA_ALIGNMENT;
+
+    case MetricsShmType_TimerDef:
+        return METRICS_SHM_TIMER_DEF_DATA_SIZE;
+    }
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static uint64_t GetEntriesOffset() {
+    return (sizeof(MetricsShmHeader) + alignof(MetricsShmEntry) - 1) / alignof(MetricsShmEntry) * alignof(MetricsShmEntry);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static uint64_t GetDataOffset(uint64_t max_num_entries) {
+    uint64_t offset = GetEntriesOffset() + max_num_entries * sizeof(MetricsShmEntry);
+
+    return (offset + METRICS_SHM_DATA_ALIGNMENT - 1) / METRICS_SHM_DATA_ALIGNMENT * METRICS_SHM_DATA_ALIGNMENT;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_POSIX
+static std::string GetShmName(std::string name) {
+    if (name.empty() || name[0] != '/') {
+        name.insert(name.begin(), '/');
+    }
+
+    return name;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<MetricsSharedMemory> MetricsSharedMemory::Create(std::string name, size_t max_num_entries, const LogSet *logs) {
+#if SYSTEM_POSIX
+
+    name = GetShmName(std::move(name));
+
+    // Assume the worst case, that every entry is a TimerDef.
+    uint64_t size = GetDataOffset(max_num_entries) + max_num_entries * METRICS_SHM_TIMER_DEF_DATA_SIZE;
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to create %s: %s\n", name.c_str(), strerror(errno));
+        }
+
+        return nullptr;
+    }
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to set %s size to %" PRIu64 ": %s\n", name.c_str(), size, strerror(errno));
+        }
+
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to map %s: %s\n", name.c_str(), strerror(errno));
+        }
+
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    std::shared_ptr<MetricsSharedMemory> shm(new MetricsSharedMemory(std::move(name)));
+    shm->m_base = (uint8_t *)base;
+    shm->m_size = (size_t)size;
+    shm->m_next_data_offset = GetDataOffset(max_num_entries);
+
+    // The memory is zeroed already.
+    MetricsShmHeader *header = new (shm->m_base) MetricsShmHeader;
+    header->version = METRICS_SHM_VERSION;
+    header->header_size = sizeof(MetricsShmHeader);
+    header->entry_size = sizeof(MetricsShmEntry);
+    header->max_num_entries = (uint32_t)max_num_entries;
+    header->size = size;
+    header->pid = (uint64_t)getpid();
+    header->num_entries.store(0, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(header->magic, METRICS_SHM_MAGIC, sizeof header->magic);
+
+    return shm;
+
+#else
+
+    (void)name, (void)max_num_entries;
+
+    if (logs) {
+        logs->e.f("metrics shared memory: not supported on this platform\n");
+    }
+
+    return nullptr;
+
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsSharedMemory::~MetricsSharedMemory() {
+#if SYSTEM_POSIX
+    if (m_base) {
+        munmap(m_base, m_size);
+        shm_unlink(m_name.c_str());
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const std::string &MetricsSharedMemory::GetName() const {
+    return m_name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void *MetricsSharedMemory::AddEntry(MetricsShmType type, const std::string &name, uint32_t *index_ptr) {
+    MetricsShmHeader *header = this->GetHeader();
+    size_t data_size = GetDataSize(type);
+    ASSERT(data_size > 0);
+
+    LockGuard<Mutex> lock(m_mutex);
+
+    uint32_t index = header->num_entries.load(std::memory_order_relaxed);
+    if (index >= header->max_num_entries || m_next_data_offset + data_size > m_size) {
+        if (!m_logged_full) {
+            LOGF(METRICS_SHM, "metrics shared memory: %s is full, so %s (and any other metrics that don't fit) won't appear in it\n", m_name.c_str(), name.c_str());
+            m_logged_full = true;
+        }
+
+        return nullptr;
+    }
+
+    MetricsShmEntry *entry = (MetricsShmEntry *)(m_base + GetEntriesOffset()) + index;
+    strlcpy(entry->name, name.c_str(), sizeof entry->name);
+    entry->type = type;
+    entry->live.store(1, std::memory_order_relaxed);
+    entry->offset = m_next_data_offset;
+
+    void *data = m_base + m_next_data_offset;
+    m_next_data_offset += data_size;
+
+    header->num_entries.store(index + 1, std::memory_order_release);
+
+    *index_ptr = index;
+    return data;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MetricsSharedMemory::RetireEntry(uint32_t index) {
+    ASSERT(index < this->GetHeader()->num_entries.load(std::memory_order_relaxed));
+
+    MetricsShmEntry *entry = (MetricsShmEntry *)(m_base + GetEntriesOffset()) + index;
+    entry->live.store(0, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsSharedMemory::MetricsSharedMemory(std::string name)
+    : m_name(std::move(name)) {
+    MUTEX_SET_NAME(m_mutex, "MetricsSharedMemory");
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsShmHeader *MetricsSharedMemory::GetHeader() const {
+    return (MetricsShmHeader *)m_base;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::unique_ptr<MetricsSharedMemoryReader> MetricsSharedMemoryReader::Open(std::string name, const LogSet *logs) {
+#if SYSTEM_POSIX
+
+    name = GetShmName(std::move(name));
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to open %s: %s\n", name.c_str(), strerror(errno));
+        }
+
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to stat %s: %s\n", name.c_str(), strerror(errno));
+        }
+
+        close(fd);
+        return nullptr;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(MetricsShmHeader)) {
+        if (logs) {
+            logs->e.f("metrics shared memory: %s: too small\n", name.c_str());
+        }
+
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        if (logs) {
+            logs->e.f("metrics shared memory: failed to map %s: %s\n", name.c_str(), strerror(errno));
+        }
+
+        return nullptr;
+    }
+
+    std::unique_ptr<MetricsSharedMemoryReader> reader(new MetricsSharedMemoryReader);
+    reader->m_base = (const uint8_t *)base;
+    reader->m_size = size;
+
+    const MetricsShmHeader *header = reader->GetHeader();
+
+    const char *error = nullptr;
+    if (memcmp(header->magic, METRICS_SHM_MAGIC, sizeof header->magic) != 0) {
+        error = "bad magic, or not set up yet";
+    } else {
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (header->version != METRICS_SHM_VERSION) {
+            error = "unsupported version";
+        } else if (header->header_size != sizeof(MetricsShmHeader) || header->entry_size != sizeof(MetricsShmEntry)) {
+            error = "unexpected layout";
+        } else if (header->size != size || GetDataOffset(header->max_num_entries) > size) {
+            error = "unexpected size";
+        }
+    }
+
+    if (error) {
+        if (logs) {
+            logs->e.f("metrics shared memory: %s: %s\n", name.c_str(), error);
+        }
+
+        return nullptr;
+    }
+
+    return reader;
+
+#else
+
+    (void)name;
+
+    if (logs) {
+        logs->e.f("metrics shared memory: not supported on this platform\n");
+    }
+
+    return nullptr;
+
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MetricsSharedMemoryReader::~MetricsSharedMemoryReader() {
+#if SYSTEM_POSIX
+    if (m_base) {
+        munmap((void *)m_base, m_size);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t MetricsSharedMemoryReader::GetPID() const {
+    return this->GetHeader()->pid;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool MetricsSharedMemoryReader::Read(std::vector<MetricsShmValue> *values) const {
+    values->clear();
+
+    const MetricsShmHeader *header = this->GetHeader();
+    bool good = true;
+
+    uint32_t num_entries = header->num_entries.load(std::memory_order_acquire);
+    if (num_entries > header->max_num_entries) {
+        return false;
+    }
+
+    const MetricsShmEntry *entries = (const MetricsShmEntry *)(m_base + GetEntriesOffset());
+    for (uint32_t i = 0; i < num_entries; ++i) {
+        const MetricsShmEntry *entry = &entries[i];
+
+        if (!entry->live.load(std::memory_order_acquire)) {
+            continue;
+        }
+
+        size_t data_size = GetDataSize((MetricsShmType)entry->type);
+        if (data_size == 0 || entry->offset > m_size || m_size - entry->offset < data_size) {
+            good = false;
+            continue;
+        }
+
+        const uint8_t *data = m_base + entry->offset;
+
+        MetricsShmValue value;
+        value.name.assign(entry->name, strnlen(entry->name, sizeof entry->name));
+        value.type = (MetricsShmType)entry->type;
+
+        switch (value.type) {
+        case MetricsShmType_Counter:
+            value.value = ((const std::atomic<uint64_t> *)data)->load(std::memory_order_acquire);
+            break;
+
+        case MetricsShmType_Gauge:
+            value.value = (uint64_t)((const std::atomic<int64_t> *)data)->load(std::memory_order_relaxed);
+            break;
+
+        case MetricsShmType_TimerDef:
+            if (!TimerDef::GetStripesTotals((const TimerDefStripe *)data, METRICS_SHM_MAX_NUM_READ_TRIES, &value.totals)) {
+                good = false;
+                continue;
+            }
+            break;
+        }
+
+        values->push_back(std::move(value));
+    }
+
+    return good;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const MetricsShmHeader *MetricsSharedMemoryReader::GetHeader() const {
+    return (const MetricsShmHeader *)m_base;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
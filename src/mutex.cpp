@@ -1,16 +1,110 @@
 #include <shared/system.h>
 #include <shared/mutex.h>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#if SYSTEM_LINUX
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// glibc 2.30+ can do a timed wait on a std::mutex's pthread mutex, against
+// the same clock as std::chrono::steady_clock.
+//
+// ThreadSanitizer (as of GCC 12) doesn't intercept pthread_mutex_clocklock,
+// and then reports the unlock as unlocking an unlocked mutex.
+#if SYSTEM_LINUX && defined __GLIBC__ && !defined __SANITIZE_THREAD__
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30)
+#define HAVE_PTHREAD_MUTEX_CLOCKLOCK 1
+#endif
+#endif
+
+#ifndef HAVE_PTHREAD_MUTEX_CLOCKLOCK
+#define HAVE_PTHREAD_MUTEX_CLOCKLOCK 0
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Shared by both Mutexes: the non-debug one calls it through
+// TryLockStdMutexUntil.
+static bool TryLockUntil(std::mutex *mutex, const std::chrono::steady_clock::time_point &timeout_time) {
+    if (mutex->try_lock()) {
+        return true;
+    }
+
+#if HAVE_PTHREAD_MUTEX_CLOCKLOCK
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout_time.time_since_epoch()).count();
+    if (ns < 0) {
+        ns = 0;
+    }
+
+    timespec abstime;
+    abstime.tv_sec = (time_t)(ns / 1000000000);
+    abstime.tv_nsec = (long)(ns % 1000000000);
+
+    int rc = pthread_mutex_clocklock(mutex->native_handle(), CLOCK_MONOTONIC, &abstime);
+    return rc == 0;
+
+#else
+
+    // No timed wait available, so poll, backing off to at most 1 ms.
+    std::chrono::microseconds delay(1);
+    for (;;) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (now >= timeout_time) {
+            return false;
+        }
+
+        std::this_thread::sleep_for((std::min)(std::chrono::duration_cast<std::chrono::microseconds>(timeout_time - now), delay));
+
+        if (mutex->try_lock()) {
+            return true;
+        }
+
+        delay = (std::min)(delay * 2, std::chrono::microseconds(1000));
+    }
+
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if !MUTEX_DEBUGGING
+
+bool TryLockStdMutexUntil(std::mutex *mutex, const std::chrono::steady_clock::time_point &timeout_time) {
+    return TryLockUntil(mutex, timeout_time);
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
 #if MUTEX_DEBUGGING
 
 #include <shared/debug.h>
+#include <shared/log.h>
+#include <shared/system_specific.h>
+#include <shared/trace.h>
+#include <shared/strings.h>
+#include <shared/lockfree.h>
+#include <inttypes.h>
 #include <vector>
 #include <set>
 #include <atomic>
 #include <mutex>
 #include <string.h>
 #include <shared_mutex>
-#include <algorithm>
+#include <condition_variable>
 
 #include <shared/enum_def.h>
 #include <shared/mutex.inl>
@@ -19,395 +113,1765 @@
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-struct MutexMetadataImpl : public MutexMetadata {
-    std::mutex mutex;
+// Typical, and good enough. (std::hardware_destructive_interference_size
+// isn't reliably available, and GCC warns about using it in headers anyway.)
+static constexpr size_t MUTEX_CACHE_LINE_SIZE = 64;
+
+// Parts common to all the metadata types.
+//
+// The metadata is split into regions, each starting on its own cache line,
+// so that lockers and monitoring don't keep stealing lines from one another:
+//
+// - cold: the name and type. Touched only by SetName and GetDetails
+//
+// - warm: the stats. Written by whoever holds the lock, read only by
+//   GetDetails
+//
+// - contended: the counts that threads update while trying to get the
+//   lock - num_waiters, num_try_locks and num_lock_timeouts. These are
+//   RMWs by non-owners, so they'd keep stealing the warm line from the
+//   owner if they were on it
+//
+// - read-mostly: the flags checked on every lock, written only by
+//   monitoring. This stays shared between all the lockers
+//
+// - hot: the lock itself, in the derived type
+//
+// (The registry bits in MutexFullMetadata come before all of this, and are
+// cold too.)
+struct MutexMetadataImplBase : public MutexMetadata {
+    const MutexType type;
+
+    // Unique for the life of the process, unlike the address, so the
+    // contention profile can tell apart mutexes that happen to reuse the
+    // same memory.
+    const uint64_t serial;
+
+    mutable std::shared_mutex name_mutex;
+    std::string name;
+
+    // Trace name ID for the current name, or 0 if not yet interned.
+    std::atomic<uint32_t> trace_name_id{0};
 
     // num_try_locks and ever_locked values are both bogus. The caller's copy is filled out correctly on demand by GetDetails.
-    MutexStats stats;
-    std::atomic<bool> reset{false};
+    alignas(MUTEX_CACHE_LINE_SIZE) MutexStats stats;
 
     std::atomic<bool> ever_locked{false};
 
+    // For the barge stats. Controlled by the lock.
+    const void *last_owner = nullptr;
+    uint64_t num_consecutive_barges = 0;
+
+    // The number of threads waiting for exclusive access, for the barge
+    // stats too.
+    alignas(MUTEX_CACHE_LINE_SIZE) std::atomic<uint32_t> num_waiters{0};
+
     // A try_lock needs accounting for even if the mutex ends up not taken.
     std::atomic<uint64_t> num_try_locks{0};
 
-    std::atomic<uint8_t> interesting_events{0};
+    std::atomic<uint64_t> num_lock_timeouts{0};
 
-    mutable std::shared_mutex name_mutex;
-    std::string name;
+    alignas(MUTEX_CACHE_LINE_SIZE) std::atomic<uint8_t> interesting_events{0};
+    std::atomic<bool> reset{false};
 
-    ~MutexMetadataImpl();
+    explicit MutexMetadataImplBase(MutexType type);
+    ~MutexMetadataImplBase();
 
     void RequestReset() override;
     void GetDetails(MutexDetails *details) const override;
     uint8_t GetInterestingEvents() const override;
     void SetInterestingEvents(uint8_t events) override;
 
-    void Reset();
+    virtual void Reset();
+};
+
+struct MutexMetadataImpl : public MutexMetadataImplBase {
+    alignas(MUTEX_CACHE_LINE_SIZE) std::mutex mutex;
+
+    MutexMetadataImpl();
+};
+
+struct SharedMutexMetadataImpl : public MutexMetadataImplBase {
+    alignas(MUTEX_CACHE_LINE_SIZE) std::shared_mutex mutex;
+
+    // Only used when prefer_writers is set. Writers hold this while waiting;
+    // new readers have to get past it if there are any waiting writers.
+    alignas(MUTEX_CACHE_LINE_SIZE) std::mutex writer_gate;
+    std::atomic<uint32_t> num_waiting_writers{0};
+    bool prefer_writers = false;
+
+    // Readers can't touch stats, as they don't have exclusive access.
+    alignas(MUTEX_CACHE_LINE_SIZE) std::atomic<uint64_t> num_shared_locks{0};
+    std::atomic<uint64_t> num_contended_shared_locks{0};
+    std::atomic<uint64_t> total_shared_lock_wait_ticks{0};
+    std::atomic<uint64_t> min_shared_lock_wait_ticks{UINT64_MAX};
+    std::atomic<uint64_t> max_shared_lock_wait_ticks{0};
+    std::atomic<uint64_t> num_successful_try_lock_shareds{0};
+    std::atomic<uint64_t> num_try_lock_shareds{0};
+    std::atomic<bool> shared_sampled{false};
+
+    // Like reset, but for the shared side, which readers can handle too.
+    // Otherwise the shared side might never get reset, if there are never
+    // any exclusive locks.
+    std::atomic<bool> shared_reset{false};
+
+    SharedMutexMetadataImpl();
+
+    void RequestReset() override;
+    void GetDetails(MutexDetails *details) const override;
+
+    void Reset() override;
+
+    void ResetShared();
+};
+
+struct TicketMutexMetadataImpl : public MutexMetadataImplBase {
+    alignas(MUTEX_CACHE_LINE_SIZE) TicketLock lock;
+
+    TicketMutexMetadataImpl();
+
+    void GetDetails(MutexDetails *details) const override;
+};
+
+struct ConditionVariableMetadataImpl : public MutexMetadataImplBase {
+    alignas(MUTEX_CACHE_LINE_SIZE) std::condition_variable cv;
+
+    // Waiters don't have exclusive access to anything, so it's atomics all
+    // the way.
+    alignas(MUTEX_CACHE_LINE_SIZE) std::atomic<uint64_t> num_waits{0};
+    std::atomic<uint64_t> num_wait_timeouts{0};
+    std::atomic<uint64_t> num_notify_ones{0};
+    std::atomic<uint64_t> num_notify_alls{0};
+    std::atomic<uint64_t> total_wait_ticks{0};
+    std::atomic<uint64_t> max_wait_ticks{0};
+    std::atomic<uint64_t> num_wakeups{0};
+    std::atomic<uint64_t> total_wakeup_ticks{0};
+    std::atomic<uint64_t> max_wakeup_ticks{0};
+
+    // Tick count of the most recent notify, for the wakeup ticks.
+    std::atomic<uint64_t> last_notify_ticks{0};
+
+    ConditionVariableMetadataImpl();
+
+    void RequestReset() override;
+    void GetDetails(MutexDetails *details) const override;
+
+    void Reset() override;
+};
+
+// A pending change to the metadata registry. Each MutexFullMetadata has
+// two: one for its registration and one for its unregistration.
+struct MutexRegistryChange {
+    MutexRegistryChange *next = nullptr;
+
+    // Keeps the metadata alive until the change has been applied. Deliberate
+    // reference cycle, broken by ApplyLockedRegistryChanges.
+    std::shared_ptr<MutexFullMetadata> metadata;
+
+    bool add = false;
 };
 
 struct MutexFullMetadata : public std::enable_shared_from_this<MutexFullMetadata> {
-    MutexFullMetadata *next = nullptr, *prev = nullptr;
-    Mutex *mutex = nullptr;
-    MutexMetadataImpl meta;
-
-    // this is just here to grab an appropriate extra ref to the
-    // metadata list mutex. If a global mutex gets created before the
-    // metadata mutex shared_ptr, that mutex would otherwise be
-    // destroyed after it...
-    std::shared_ptr<std::mutex> metadata_list_mutex;
+    const void *mutex = nullptr;
+
+    // Points into the derived MutexFullMetadataWithImpl.
+    MutexMetadataImplBase *const meta = nullptr;
+
+    MutexRegistryChange add_change;
+    MutexRegistryChange remove_change;
+
+    // index in MutexRegistry::all_metadata. Controlled by
+    // MutexRegistry::apply_mutex.
+    size_t registry_index = SIZE_MAX;
+
+    explicit MutexFullMetadata(MutexMetadataImplBase *meta);
+    virtual ~MutexFullMetadata() = default;
+};
+
+template <class MetadataImplType>
+struct MutexFullMetadataWithImpl : public MutexFullMetadata {
+    MetadataImplType impl;
+
+    MutexFullMetadataWithImpl()
+        : MutexFullMetadata(&impl) {
+    }
+};
+
+typedef std::vector<std::shared_ptr<MutexMetadata>> MutexMetadataList;
+
+// Registering or unregistering just pushes a change onto a lock-free list.
+// The changes are applied in batches, either by the next GetAllMetadata, or
+// by a constructor or destructor once enough have built up.
+//
+// GetAllMetadata hands out the current immutable snapshot, which lives for as
+// long as anybody has a reference to it, and is regenerated only when
+// changes have been applied.
+struct MutexRegistry {
+    std::atomic<MutexRegistryChange *> pending_changes_head{nullptr};
+    std::atomic<uint64_t> num_pending_changes{0};
+
+    // never 0.
+    std::atomic<uint64_t> change_counter{1};
+
+    std::mutex apply_mutex;
+
+    // controlled by apply_mutex.
+    std::vector<std::shared_ptr<MutexFullMetadata>> all_metadata;
+
+    // Only held for long enough to copy the shared_ptr.
+    std::mutex snapshot_mutex;
+
+    // controlled by snapshot_mutex. Null if stale.
+    std::shared_ptr<const MutexMetadataList> snapshot;
 };
 
-static std::once_flag g_mutex_metadata_list_mutex_initialise_once_flag;
-static std::shared_ptr<std::mutex> g_mutex_metadata_list_mutex; //shared_ptr() is constexpr
+// Apply pending changes once this many have built up, even if nobody's
+// asking for the list, so they don't accumulate indefinitely.
+static constexpr uint64_t MAX_NUM_PENDING_MUTEX_REGISTRY_CHANGES = 64;
+
+static std::once_flag g_mutex_registry_initialise_once_flag;
+
+// never freed. Mutexes can be destroyed during global destruction, in any
+// order.
+static MutexRegistry *g_mutex_registry;
+
 static std::atomic<uint64_t> g_mutex_name_overhead_ticks{0};
 static std::atomic<bool> g_assume_free_uncontended_locks{false};
+static std::atomic<uint32_t> g_lock_timing_sample_rate{1};
+static std::atomic<uint64_t> g_next_mutex_metadata_serial{1};
+static thread_local uint32_t t_lock_timing_counter;
+
+// Only the address matters. It identifies the thread for the barge stats.
+static thread_local char t_lock_owner_tag;
+
+static void InitMutexRegistry() {
+    ASSERT(!g_mutex_registry);
+    g_mutex_registry = new MutexRegistry;
+}
+
+static MutexRegistry *GetMutexRegistry() {
+    std::call_once(g_mutex_registry_initialise_once_flag, &InitMutexRegistry);
+    return g_mutex_registry;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Call with apply_mutex held. If there were any changes, the snapshot is
+// invalidated, and the old one returned, so the caller can release it
+// outside the lock.
+[[nodiscard]] static std::shared_ptr<const MutexMetadataList> ApplyLockedRegistryChanges(MutexRegistry *registry) {
+    std::shared_ptr<const MutexMetadataList> old_snapshot;
+    MutexRegistryChange *oldest;
+    TakeRegistryChangesLockFree(registry, &oldest, [registry, &old_snapshot]() {
+        LockGuard<std::mutex> snapshot_lock(registry->snapshot_mutex);
+        old_snapshot = std::move(registry->snapshot);
+    });
+
+    MutexRegistryChange *change = oldest;
+    while (change) {
+        // The change may be in the last reference to the metadata, so get
+        // everything out of it first.
+        MutexRegistryChange *next = change->next;
+        std::shared_ptr<MutexFullMetadata> metadata = std::move(change->metadata);
+        bool add = change->add;
+        change->next = nullptr;
+        change = nullptr;
+
+        if (add) {
+            metadata->registry_index = registry->all_metadata.size();
+            registry->all_metadata.push_back(std::move(metadata));
+        } else {
+            size_t index = metadata->registry_index;
+            ASSERT(index < registry->all_metadata.size());
+            ASSERT(registry->all_metadata[index] == metadata);
+
+            if (index != registry->all_metadata.size() - 1) {
+                registry->all_metadata[index] = std::move(registry->all_metadata.back());
+                registry->all_metadata[index]->registry_index = index;
+            }
+
+            registry->all_metadata.pop_back();
+            metadata->registry_index = SIZE_MAX;
+        }
+
+        change = next;
+    }
+
+    return old_snapshot;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void PushRegistryChange(MutexRegistry *registry, MutexRegistryChange *change) {
+    uint64_t num_pending_changes = PushRegistryChangeLockFree(registry, change);
+
+    registry->change_counter.fetch_add(1, std::memory_order_acq_rel);
+
+    if (num_pending_changes >= MAX_NUM_PENDING_MUTEX_REGISTRY_CHANGES) {
+        // If somebody else is already applying changes, let them get on
+        // with it.
+        if (registry->apply_mutex.try_lock()) {
+            std::shared_ptr<const MutexMetadataList> old_snapshot = ApplyLockedRegistryChanges(registry);
+            registry->apply_mutex.unlock();
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void RegisterMutexMetadata(MutexFullMetadata *metadata, const void *mutex) {
+    MutexRegistry *registry = GetMutexRegistry();
+
+    metadata->mutex = mutex;
+
+    metadata->add_change.metadata = metadata->shared_from_this();
+    metadata->add_change.add = true;
+
+    PushRegistryChange(registry, &metadata->add_change);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void UnregisterMutexMetadata(MutexFullMetadata *metadata) {
+    MutexRegistry *registry = GetMutexRegistry();
+
+    metadata->mutex = nullptr;
+
+    metadata->remove_change.metadata = metadata->shared_from_this();
+    metadata->remove_change.add = false;
+
+    PushRegistryChange(registry, &metadata->remove_change);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void SetMetadataName(MutexMetadataImplBase *meta, std::string name) {
+    uint64_t start_ticks = GetCurrentTickCount();
+
+    {
+        LockGuard<std::shared_mutex> lock(meta->name_mutex);
+        meta->name = std::move(name);
+    }
+
+    meta->trace_name_id.store(0, std::memory_order_release);
+
+    g_mutex_name_overhead_ticks.fetch_add(GetCurrentTickCount() - start_ticks, std::memory_order_acq_rel);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static uint32_t GetMutexTraceNameID(MutexMetadataImplBase *meta) {
+    uint32_t name_id = meta->trace_name_id.load(std::memory_order_acquire);
+    if (name_id == 0) {
+        std::string name;
+        {
+            SharedLockGuard<std::shared_mutex> lock(meta->name_mutex);
+            name = meta->name;
+        }
+
+        if (name.empty()) {
+            name = strprintf("Mutex %p", (void *)meta);
+        }
+
+        name_id = GetTraceNameID(name);
+        meta->trace_name_id.store(name_id, std::memory_order_release);
+    }
+
+    return name_id;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Call with the lock held. The hold interval is a begin/end pair on the
+// locking thread; the wait, if there was one, a complete event just
+// before it.
+static void TraceLockEvents(MutexMetadataImplBase *meta, uint8_t interesting_events, uint64_t lock_start_ticks, uint64_t lock_wait_ticks) {
+    static const uint32_t mutex_category_id = GetTraceNameID("mutex");
+    static const uint32_t mutex_wait_category_id = GetTraceNameID("mutex_wait");
+
+    uint32_t name_id = GetMutexTraceNameID(meta);
+
+    if (interesting_events & MutexInterestingEvent_ContendedLock) {
+        AddTraceEvent(TraceEventType_Complete, mutex_wait_category_id, name_id, lock_start_ticks, lock_wait_ticks);
+    }
+
+    if (interesting_events & MutexInterestingEvent_Lock) {
+        AddTraceEvent(TraceEventType_Begin, mutex_category_id, name_id, GetCurrentTickCount());
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TraceUnlockEvent(MutexMetadataImplBase *meta) {
+    static const uint32_t mutex_category_id = GetTraceNameID("mutex");
+
+    AddTraceEvent(TraceEventType_End, mutex_category_id, GetMutexTraceNameID(meta), GetCurrentTickCount());
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void UpdateAtomicMin(std::atomic<uint64_t> *value, uint64_t candidate) {
+    uint64_t old_value = value->load(std::memory_order_relaxed);
+    while (candidate < old_value) {
+        if (value->compare_exchange_weak(old_value, candidate, std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void UpdateAtomicMax(std::atomic<uint64_t> *value, uint64_t candidate) {
+    uint64_t old_value = value->load(std::memory_order_relaxed);
+    while (candidate > old_value) {
+        if (value->compare_exchange_weak(old_value, candidate, std::memory_order_acq_rel)) {
+            break;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Decide whether to time an uncontended lock. Returns 0 if not, or the
+// factor to scale its wait ticks by if so. (Contended locks are always
+// timed, with a scale of 1.)
+static uint32_t GetUncontendedLockTimingScale() {
+    if (g_assume_free_uncontended_locks.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+
+    uint32_t sample_rate = g_lock_timing_sample_rate.load(std::memory_order_relaxed);
+    if (sample_rate <= 1) {
+        return sample_rate;
+    }
+
+    if (++t_lock_timing_counter < sample_rate) {
+        return 0;
+    }
+
+    t_lock_timing_counter = 0;
+    return sample_rate;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Call with the lock held exclusively.
+static void HandleResetRequest(MutexMetadataImplBase *meta) {
+    if (TakeLockFreeRequest(&meta->reset)) {
+        meta->Reset();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Call with the lock held, shared or exclusively. Other readers may be
+// updating the shared stats at the same time, so a few of their updates
+// might get lost in the reset; that's no worse than the reset request
+// arriving a moment later.
+static void HandleSharedResetRequest(SharedMutexMetadataImpl *meta) {
+    if (TakeLockFreeRequest(&meta->shared_reset)) {
+        meta->ResetShared();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Call with the lock held exclusively. timing_scale is as per
+// GetUncontendedLockTimingScale: 0 if lock_wait_ticks is meaningless.
+static void RecordExclusiveLock(MutexMetadataImplBase *meta, uint64_t lock_wait_ticks, uint32_t timing_scale, bool contended) {
+    if (contended) {
+        ++meta->stats.num_contended_locks;
+    }
+
+    ++meta->stats.num_locks;
+
+    HandleResetRequest(meta);
 
-// controlled by g_mutex_metadata_list_mutex
-static std::vector<std::shared_ptr<MutexMetadata>> g_mutex_metadata_list;
+    const void *owner = &t_lock_owner_tag;
+    if (owner == meta->last_owner && meta->num_waiters.load(std::memory_order_relaxed) != 0) {
+        ++meta->stats.num_barges;
+        ++meta->num_consecutive_barges;
 
-// change counter last time g_mutex_metadata_list was regenerated. controlled by g_mutex_metadata_list_mutex.
-static uint64_t g_mutex_metadata_list_last_change_counter = 0;
+        if (meta->num_consecutive_barges > meta->stats.max_consecutive_barges) {
+            meta->stats.max_consecutive_barges = meta->num_consecutive_barges;
+        }
+    } else {
+        meta->num_consecutive_barges = 0;
+    }
+
+    meta->last_owner = owner;
 
-// current change counter. controlled by g_mutex_metadata_list_mutex
-static uint64_t g_mutex_metadata_list_change_counter = 1;
+    if (!meta->ever_locked.load(std::memory_order_relaxed)) {
+        meta->ever_locked.store(true, std::memory_order_release);
+    }
+
+    if (timing_scale != 0) {
+        meta->stats.total_lock_wait_ticks += lock_wait_ticks * timing_scale;
+
+        if (timing_scale > 1) {
+            meta->stats.sampled = true;
+        }
 
-static MutexFullMetadata *g_mutex_metadata_head;
+        if (lock_wait_ticks < meta->stats.min_lock_wait_ticks) {
+            meta->stats.min_lock_wait_ticks = lock_wait_ticks;
+        }
 
-static void InitMutexMetadataListMutex() {
-    ASSERT(!g_mutex_metadata_list_mutex);
-    g_mutex_metadata_list_mutex = std::make_shared<std::mutex>();
+        if (lock_wait_ticks > meta->stats.max_lock_wait_ticks) {
+            meta->stats.max_lock_wait_ticks = lock_wait_ticks;
+        }
+    }
 }
 
-static void EnsureMutexMetadataListInitialised() {
-    std::call_once(g_mutex_metadata_list_mutex_initialise_once_flag, &InitMutexMetadataListMutex);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t CONTENTION_PROFILE_MAX_NUM_FRAMES = 16;
+static constexpr size_t CONTENTION_PROFILE_MAX_NAME_SIZE = 64;
+
+// must be a power of 2.
+static constexpr size_t CONTENTION_PROFILE_NUM_ENTRIES = 1024;
+
+enum ContentionProfileEntryState : uint8_t {
+    ContentionProfileEntryState_Free,
+    ContentionProfileEntryState_Filling,
+    ContentionProfileEntryState_Ready,
+};
+
+struct ContentionProfileEntry {
+    std::atomic<uint8_t> state{ContentionProfileEntryState_Free};
+
+    // The key. Only valid once state is Ready.
+    uint64_t hash = 0;
+    uint64_t meta_serial = 0;
+    void *frames[CONTENTION_PROFILE_MAX_NUM_FRAMES] = {};
+    int num_frames = 0;
+
+    // copy of the mutex name when the entry was first filled in. The mutex
+    // may well be gone by the time anybody's looking at this.
+    char name[CONTENTION_PROFILE_MAX_NAME_SIZE] = {};
+
+    std::atomic<uint64_t> num_samples{0};
+    std::atomic<uint64_t> total_wait_ticks{0};
+    std::atomic<uint64_t> max_wait_ticks{0};
+};
+
+struct ContentionProfile {
+    ContentionProfileEntry entries[CONTENTION_PROFILE_NUM_ENTRIES];
+    std::atomic<uint64_t> num_dropped_samples{0};
+};
+
+struct ContentionSample {
+    void *frames[CONTENTION_PROFILE_MAX_NUM_FRAMES + 1];
+    int num_frames = 0;
+};
+
+static std::atomic<uint32_t> g_contention_profiler_sample_rate{0};
+
+// Allocated the first time the profiler is enabled, then never freed, so
+// the lock-free accesses don't need to worry about it going away.
+static std::atomic<ContentionProfile *> g_contention_profile{nullptr};
+
+static thread_local uint32_t t_contention_profiler_counter;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static bool ShouldSampleContention() {
+    uint32_t sample_rate = g_contention_profiler_sample_rate.load(std::memory_order_relaxed);
+    if (sample_rate == 0) {
+        return false;
+    }
+
+    if (++t_contention_profiler_counter < sample_rate) {
+        return false;
+    }
+
+    t_contention_profiler_counter = 0;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void CaptureContentionSample(ContentionSample *sample) {
+    sample->num_frames = backtrace(sample->frames, (int)(sizeof sample->frames / sizeof sample->frames[0]));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static uint64_t GetContentionSampleHash(const MutexMetadataImplBase *meta, void *const *frames, int num_frames) {
+    // FNV-1a, a pointer at a time.
+    uint64_t hash = 14695981039346656037ull;
+
+    hash = (hash ^ meta->serial) * 1099511628211ull;
+
+    for (int i = 0; i < num_frames; ++i) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 1099511628211ull;
+    }
+
+    // 0 is never a valid hash, so the entry check doesn't need to care.
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    return hash;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static bool IsContentionProfileEntryMatch(const ContentionProfileEntry *entry,
+                                          uint64_t hash,
+                                          const MutexMetadataImplBase *meta,
+                                          void *const *frames,
+                                          int num_frames) {
+    if (entry->hash != hash || entry->meta_serial != meta->serial || entry->num_frames != num_frames) {
+        return false;
+    }
+
+    for (int i = 0; i < num_frames; ++i) {
+        if (entry->frames[i] != frames[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void RecordContentionSample(const ContentionSample *sample, const MutexMetadataImplBase *meta, uint64_t wait_ticks) {
+    ContentionProfile *profile = g_contention_profile.load(std::memory_order_acquire);
+    if (!profile) {
+        return;
+    }
+
+    // Skip the frame for the lock function itself.
+    void *const *frames = sample->frames;
+    int num_frames = sample->num_frames;
+    if (num_frames > 0) {
+        ++frames;
+        --num_frames;
+    }
+
+    if (num_frames > (int)CONTENTION_PROFILE_MAX_NUM_FRAMES) {
+        num_frames = (int)CONTENTION_PROFILE_MAX_NUM_FRAMES;
+    }
+
+    uint64_t hash = GetContentionSampleHash(meta, frames, num_frames);
+
+    // Open addressing, linear probing. Entries are never removed, so once a
+    // Ready entry doesn't match, it will never match.
+    for (size_t i = 0; i < CONTENTION_PROFILE_NUM_ENTRIES; ++i) {
+        ContentionProfileEntry *entry = &profile->entries[(hash + i) & (CONTENTION_PROFILE_NUM_ENTRIES - 1)];
+
+        uint8_t state = entry->state.load(std::memory_order_acquire);
+
+        if (state == ContentionProfileEntryState_Free) {
+            if (entry->state.compare_exchange_strong(state, ContentionProfileEntryState_Filling, std::memory_order_acq_rel)) {
+                entry->hash = hash;
+                entry->meta_serial = meta->serial;
+                entry->num_frames = num_frames;
+                for (int j = 0; j < num_frames; ++j) {
+                    entry->frames[j] = frames[j];
+                }
+
+                {
+                    SharedLockGuard<std::shared_mutex> lock(meta->name_mutex);
+                    strlcpy(entry->name, meta->name.c_str(), sizeof entry->name);
+                }
+
+                entry->state.store(ContentionProfileEntryState_Ready, std::memory_order_release);
+                state = ContentionProfileEntryState_Ready;
+            }
+        }
+
+        // Somebody else is filling in this entry. It only takes a moment.
+        while (state == ContentionProfileEntryState_Filling) {
+            std::this_thread::yield();
+            state = entry->state.load(std::memory_order_acquire);
+        }
+
+        if (IsContentionProfileEntryMatch(entry, hash, meta, frames, num_frames)) {
+            entry->num_samples.fetch_add(1, std::memory_order_relaxed);
+            entry->total_wait_ticks.fetch_add(wait_ticks, std::memory_order_relaxed);
+            UpdateAtomicMax(&entry->max_wait_ticks, wait_ticks);
+            return;
+        }
+    }
+
+    profile->num_dropped_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexStats::MutexStats()
+    : start_ticks(GetCurrentTickCount()) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadata::MutexMetadata() {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadata::~MutexMetadata() {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexFullMetadata::MutexFullMetadata(MutexMetadataImplBase *meta_)
+    : meta(meta_) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadataImplBase::MutexMetadataImplBase(MutexType type_)
+    : type(type_)
+    , serial(g_next_mutex_metadata_serial.fetch_add(1, std::memory_order_relaxed)) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadataImplBase::~MutexMetadataImplBase() {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The stats belong to whoever holds the lock, so leave them alone, and let
+// the next lock do the actual reset. GetDetails hides the stale values in
+// the meantime.
+void MutexMetadataImplBase::RequestReset() {
+    PostLockFreeRequest(&this->reset);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MutexMetadataImplBase::GetDetails(MutexDetails *details) const {
+    details->type = this->type;
+
+    if (this->reset.load(std::memory_order_acquire)) {
+        details->stats = {};
+    } else {
+        details->stats = this->stats;
+
+        details->stats.num_try_locks = this->num_try_locks.load(std::memory_order_acquire);
+        details->stats.num_lock_timeouts = this->num_lock_timeouts.load(std::memory_order_acquire);
+    }
+
+    details->stats.ever_locked = this->ever_locked.load(std::memory_order_acquire);
+    details->stats.num_waiters = this->num_waiters.load(std::memory_order_acquire);
+
+    {
+        uint64_t start_ticks = GetCurrentTickCount();
+
+        this->name_mutex.lock_shared();
+        details->name = this->name;
+        this->name_mutex.unlock_shared();
+
+        g_mutex_name_overhead_ticks.fetch_add(GetCurrentTickCount() - start_ticks, std::memory_order_acq_rel);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint8_t MutexMetadataImplBase::GetInterestingEvents() const {
+    return this->interesting_events;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MutexMetadataImplBase::SetInterestingEvents(uint8_t events) {
+    // don't generate an unnecessary write
+    if (events != this->interesting_events.load(std::memory_order_relaxed)) {
+        this->interesting_events.store(events, std::memory_order_relaxed);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void MutexMetadataImplBase::Reset() {
+    this->stats = {};
+    this->num_try_locks.store(0);
+    this->num_lock_timeouts.store(0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadataImpl::MutexMetadataImpl()
+    : MutexMetadataImplBase(MutexType_Mutex) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+SharedMutexMetadataImpl::SharedMutexMetadataImpl()
+    : MutexMetadataImplBase(MutexType_SharedMutex) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SharedMutexMetadataImpl::RequestReset() {
+    PostLockFreeRequest(&this->shared_reset);
+    this->MutexMetadataImplBase::RequestReset();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SharedMutexMetadataImpl::GetDetails(MutexDetails *details) const {
+    this->MutexMetadataImplBase::GetDetails(details);
+
+    if (this->shared_reset.load(std::memory_order_acquire)) {
+        // Reset requested, but no lock has got round to it yet.
+        return;
+    }
+
+    details->stats.num_shared_locks = this->num_shared_locks.load(std::memory_order_acquire);
+    details->stats.num_contended_shared_locks = this->num_contended_shared_locks.load(std::memory_order_acquire);
+    details->stats.total_shared_lock_wait_ticks = this->total_shared_lock_wait_ticks.load(std::memory_order_acquire);
+    details->stats.min_shared_lock_wait_ticks = this->min_shared_lock_wait_ticks.load(std::memory_order_acquire);
+    details->stats.max_shared_lock_wait_ticks = this->max_shared_lock_wait_ticks.load(std::memory_order_acquire);
+    details->stats.num_successful_try_lock_shareds = this->num_successful_try_lock_shareds.load(std::memory_order_acquire);
+    details->stats.num_try_lock_shareds = this->num_try_lock_shareds.load(std::memory_order_acquire);
+
+    if (this->shared_sampled.load(std::memory_order_acquire)) {
+        details->stats.sampled = true;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SharedMutexMetadataImpl::Reset() {
+    this->MutexMetadataImplBase::Reset();
+
+    // Nothing else can be touching the shared side, so do it now.
+    this->shared_reset.store(false, std::memory_order_release);
+    this->ResetShared();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SharedMutexMetadataImpl::ResetShared() {
+    this->num_shared_locks.store(0, std::memory_order_release);
+    this->num_contended_shared_locks.store(0, std::memory_order_release);
+    this->total_shared_lock_wait_ticks.store(0, std::memory_order_release);
+    this->min_shared_lock_wait_ticks.store(UINT64_MAX, std::memory_order_release);
+    this->max_shared_lock_wait_ticks.store(0, std::memory_order_release);
+    this->num_successful_try_lock_shareds.store(0, std::memory_order_release);
+    this->num_try_lock_shareds.store(0, std::memory_order_release);
+    this->shared_sampled.store(false, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TicketMutexMetadataImpl::TicketMutexMetadataImpl()
+    : MutexMetadataImplBase(MutexType_TicketMutex) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void TicketMutexMetadataImpl::GetDetails(MutexDetails *details) const {
+    this->MutexMetadataImplBase::GetDetails(details);
+
+    // num_waiters goes up just before the ticket is taken, so it can't say
+    // whether a thread is actually in the queue yet. The lock can.
+    details->stats.num_waiters = this->lock.GetNumWaiters();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+ConditionVariableMetadataImpl::ConditionVariableMetadataImpl()
+    : MutexMetadataImplBase(MutexType_ConditionVariable) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void ConditionVariableMetadataImpl::RequestReset() {
+    // There's no lock that would pick up the reset flag, so just do it now.
+    // It's all atomics, so that's safe enough.
+    this->Reset();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void ConditionVariableMetadataImpl::GetDetails(MutexDetails *details) const {
+    this->MutexMetadataImplBase::GetDetails(details);
+
+    details->stats.num_waits = this->num_waits.load(std::memory_order_acquire);
+    details->stats.num_wait_timeouts = this->num_wait_timeouts.load(std::memory_order_acquire);
+    details->stats.num_notify_ones = this->num_notify_ones.load(std::memory_order_acquire);
+    details->stats.num_notify_alls = this->num_notify_alls.load(std::memory_order_acquire);
+    details->stats.total_wait_ticks = this->total_wait_ticks.load(std::memory_order_acquire);
+    details->stats.max_wait_ticks = this->max_wait_ticks.load(std::memory_order_acquire);
+    details->stats.num_wakeups = this->num_wakeups.load(std::memory_order_acquire);
+    details->stats.total_wakeup_ticks = this->total_wakeup_ticks.load(std::memory_order_acquire);
+    details->stats.max_wakeup_ticks = this->max_wakeup_ticks.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Doesn't touch stats: nothing ever writes it, and a plain store would race
+// with GetDetails.
+void ConditionVariableMetadataImpl::Reset() {
+    this->num_try_locks.store(0, std::memory_order_release);
+    this->num_lock_timeouts.store(0, std::memory_order_release);
+
+    this->num_waits.store(0, std::memory_order_release);
+    this->num_wait_timeouts.store(0, std::memory_order_release);
+    this->num_notify_ones.store(0, std::memory_order_release);
+    this->num_notify_alls.store(0, std::memory_order_release);
+    this->total_wait_ticks.store(0, std::memory_order_release);
+    this->max_wait_ticks.store(0, std::memory_order_release);
+    this->num_wakeups.store(0, std::memory_order_release);
+    this->total_wakeup_ticks.store(0, std::memory_order_release);
+    this->max_wakeup_ticks.store(0, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Mutex::Mutex()
+    : m_metadata(std::make_shared<MutexFullMetadataWithImpl<MutexMetadataImpl>>()) {
+    m_meta = static_cast<MutexMetadataImpl *>(m_metadata->meta);
+
+    RegisterMutexMetadata(m_metadata.get(), this);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+Mutex::~Mutex() {
+    UnregisterMutexMetadata(m_metadata.get());
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::SetName(std::string name) {
+    SetMetadataName(m_meta, std::move(name));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadata *Mutex::GetMutableMetadata() {
+    return m_meta;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const MutexMetadata *Mutex::GetMetadata() const {
+    return m_meta;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::lock() {
+    this->Lock(nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Mutex::try_lock_until(const std::chrono::steady_clock::time_point &timeout_time) {
+    return this->Lock(&timeout_time);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Mutex::Lock(const std::chrono::steady_clock::time_point *timeout_time) {
+    const uint32_t timing_scale = GetUncontendedLockTimingScale();
+
+    uint64_t lock_start_ticks = 0; //spurious initialization to inhibit warning
+    if (timing_scale != 0) {
+        lock_start_ticks = GetCurrentTickCount();
+    }
+
+    uint8_t interesting_events = m_meta->interesting_events.load(std::memory_order_relaxed);
+    interesting_events &= (uint8_t)~MutexInterestingEvent_Unlock;
+
+    bool contended = false;
+    bool sample_contention = false;
+    ContentionSample contention_sample;
+    if (m_meta->mutex.try_lock()) {
+        interesting_events &= (uint8_t)~MutexInterestingEvent_ContendedLock;
+    } else {
+        // It's going to have to wait anyway, so get the backtrace now -
+        // but don't count the time it takes as waiting.
+        sample_contention = ShouldSampleContention();
+        if (sample_contention) {
+            CaptureContentionSample(&contention_sample);
+        }
+
+        if (timing_scale == 0 || sample_contention) {
+            lock_start_ticks = GetCurrentTickCount();
+        }
+
+        m_meta->num_waiters.fetch_add(1, std::memory_order_relaxed);
+
+        bool locked = true;
+        if (timeout_time) {
+            locked = TryLockUntil(&m_meta->mutex, *timeout_time);
+        } else {
+            m_meta->mutex.lock();
+        }
+
+        m_meta->num_waiters.fetch_sub(1, std::memory_order_relaxed);
+
+        if (!locked) {
+            // No lock, so no access to the stats.
+            m_meta->num_lock_timeouts.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        contended = true;
+    }
+
+    uint64_t lock_wait_ticks = 0;
+    if (contended || timing_scale != 0) {
+        lock_wait_ticks = GetCurrentTickCount() - lock_start_ticks;
+    }
+
+    RecordExclusiveLock(m_meta, lock_wait_ticks, contended ? 1 : timing_scale, contended);
+
+    if (sample_contention) {
+        RecordContentionSample(&contention_sample, m_meta, lock_wait_ticks);
+    }
+
+    if (interesting_events != 0) {
+        TraceLockEvents(m_meta, interesting_events, lock_start_ticks, lock_wait_ticks);
+        this->OnInterestingEvents(interesting_events, m_meta);
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Mutex::try_lock() {
+    bool succeeded = m_meta->mutex.try_lock();
+
+    if (succeeded) {
+        ++m_meta->stats.num_successful_try_locks;
+
+        HandleResetRequest(m_meta);
+
+        // no need so set ever_locked - the successful lock that's blocking this
+        // one already did it
+
+        uint8_t interesting_events = m_meta->interesting_events.load(std::memory_order_relaxed);
+        interesting_events &= (uint8_t)MutexInterestingEvent_Lock;
+        if (interesting_events != 0) {
+            TraceLockEvents(m_meta, interesting_events, 0, 0);
+            this->OnInterestingEvents(interesting_events, m_meta);
+        }
+    }
+
+    ++m_meta->num_try_locks;
+
+    return succeeded;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::unlock() {
+    if (m_meta->interesting_events.load(std::memory_order_relaxed) & MutexInterestingEvent_Unlock) {
+        TraceUnlockEvent(m_meta);
+        this->OnInterestingEvents(MutexInterestingEvent_Unlock, m_meta);
+    }
+
+    m_meta->mutex.unlock();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Mutex::GetMetadataChangeCounter() {
+    return GetMutexRegistry()->change_counter.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::vector<std::shared_ptr<MutexMetadata>> Mutex::GetAllMetadata() {
+    return *GetAllMetadataSnapshot();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> Mutex::GetAllMetadataSnapshot() {
+    MutexRegistry *registry = GetMutexRegistry();
+
+    if (!registry->pending_changes_head.load(std::memory_order_acquire)) {
+        LockGuard<std::mutex> snapshot_lock(registry->snapshot_mutex);
+
+        if (registry->snapshot) {
+            return registry->snapshot;
+        }
+    }
+
+    std::shared_ptr<const MutexMetadataList> old_snapshot;
+
+    LockGuard<std::mutex> lock(registry->apply_mutex);
+
+    old_snapshot = ApplyLockedRegistryChanges(registry);
+
+    {
+        LockGuard<std::mutex> snapshot_lock(registry->snapshot_mutex);
+
+        if (registry->snapshot) {
+            return registry->snapshot;
+        }
+    }
+
+    // Build the new snapshot without holding snapshot_mutex. Nothing else
+    // can modify the snapshot while apply_mutex is held.
+    auto snapshot = std::make_shared<MutexMetadataList>();
+    snapshot->reserve(registry->all_metadata.size());
+    for (const std::shared_ptr<MutexFullMetadata> &metadata : registry->all_metadata) {
+        snapshot->push_back(std::shared_ptr<MutexMetadata>(metadata, metadata->meta));
+    }
+
+    LockGuard<std::mutex> snapshot_lock(registry->snapshot_mutex);
+    registry->snapshot = snapshot;
+
+    return snapshot;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint64_t Mutex::GetNameOverheadTicks() {
+    return g_mutex_name_overhead_ticks.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool Mutex::GetAssumeFreeUncontendedLocks() {
+    return g_assume_free_uncontended_locks.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::SetAssumeFreeUncontendedLocks(bool assume_free_uncontended_locks) {
+    g_assume_free_uncontended_locks.store(assume_free_uncontended_locks, std::memory_order_release);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-static void CheckLockedMetadataList() {
-    if (MutexFullMetadata *m = g_mutex_metadata_head) {
-        do {
-            ASSERT(m->prev->next == m);
-            ASSERT(m->next->prev == m);
+SharedMutex::SharedMutex()
+    : m_metadata(std::make_shared<MutexFullMetadataWithImpl<SharedMutexMetadataImpl>>()) {
+    m_meta = static_cast<SharedMutexMetadataImpl *>(m_metadata->meta);
 
-            m = m->next;
-        } while (m != g_mutex_metadata_head);
-    }
+    RegisterMutexMetadata(m_metadata.get(), this);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-static void InvalidateLockedMetadataList() {
-    ++g_mutex_metadata_list_change_counter;
-
-    // don't let any control blocks hang around unnecessarily.
-    g_mutex_metadata_list.clear();
+SharedMutex::~SharedMutex() {
+    UnregisterMutexMetadata(m_metadata.get());
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MutexStats::MutexStats()
-    : start_ticks(GetCurrentTickCount()) {
+void SharedMutex::SetName(std::string name) {
+    SetMetadataName(m_meta, std::move(name));
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MutexMetadata::MutexMetadata() {
+MutexMetadata *SharedMutex::GetMutableMetadata() {
+    return m_meta;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MutexMetadata::~MutexMetadata() {
+const MutexMetadata *SharedMutex::GetMetadata() const {
+    return m_meta;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MutexMetadataImpl::~MutexMetadataImpl() {
+bool SharedMutex::GetPreferWriters() const {
+    return m_meta->prefer_writers;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void MutexMetadataImpl::RequestReset() {
-    // TODO: a little ill-advised, as it's not protected by any kind of lock! But it'll just about hang together.
-    this->stats = {};
-    this->reset.store(true, std::memory_order_release);
+void SharedMutex::SetPreferWriters(bool prefer_writers) {
+    m_meta->prefer_writers = prefer_writers;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void MutexMetadataImpl::GetDetails(MutexDetails *details) const {
-    details->stats = this->stats;
+void SharedMutex::lock() {
+    const uint32_t timing_scale = GetUncontendedLockTimingScale();
 
-    details->stats.num_try_locks = this->num_try_locks.load(std::memory_order_acquire);
+    uint64_t lock_start_ticks = 0; //spurious initialization to inhibit warning
+    if (timing_scale != 0) {
+        lock_start_ticks = GetCurrentTickCount();
+    }
 
-    details->stats.ever_locked = this->ever_locked.load(std::memory_order_acquire);
+    bool contended = false;
 
-    {
-        uint64_t start_ticks = GetCurrentTickCount();
+    if (m_meta->prefer_writers) {
+        // Readers that turn up after this point will queue up behind the
+        // writer gate rather than keep the lock shared.
+        m_meta->num_waiting_writers.fetch_add(1, std::memory_order_acq_rel);
 
-        this->name_mutex.lock_shared();
-        details->name = this->name;
-        this->name_mutex.unlock_shared();
+        if (!m_meta->writer_gate.try_lock()) {
+            if (timing_scale == 0) {
+                lock_start_ticks = GetCurrentTickCount();
+            }
 
-        g_mutex_name_overhead_ticks.fetch_add(GetCurrentTickCount() - start_ticks, std::memory_order_acq_rel);
+            m_meta->num_waiters.fetch_add(1, std::memory_order_relaxed);
+            m_meta->writer_gate.lock();
+            contended = true;
+        }
     }
-}
 
-//////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////
+    if (!m_meta->mutex.try_lock()) {
+        if (!contended) {
+            if (timing_scale == 0) {
+                lock_start_ticks = GetCurrentTickCount();
+            }
 
-uint8_t MutexMetadataImpl::GetInterestingEvents() const {
-    return this->interesting_events;
+            m_meta->num_waiters.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        m_meta->mutex.lock();
+        contended = true;
+    }
+
+    if (contended) {
+        m_meta->num_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    if (m_meta->prefer_writers) {
+        m_meta->writer_gate.unlock();
+        m_meta->num_waiting_writers.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    uint64_t lock_wait_ticks = 0;
+    if (contended || timing_scale != 0) {
+        lock_wait_ticks = GetCurrentTickCount() - lock_start_ticks;
+    }
+
+    RecordExclusiveLock(m_meta, lock_wait_ticks, contended ? 1 : timing_scale, contended);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void MutexMetadataImpl::SetInterestingEvents(uint8_t events) {
-    // don't generate an unnecessary write
-    if (events != this->interesting_events.load(std::memory_order_relaxed)) {
-        this->interesting_events.store(events, std::memory_order_relaxed);
+bool SharedMutex::try_lock() {
+    bool succeeded = m_meta->mutex.try_lock();
+
+    if (succeeded) {
+        ++m_meta->stats.num_successful_try_locks;
+
+        HandleResetRequest(m_meta);
     }
+
+    ++m_meta->num_try_locks;
+
+    return succeeded;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void MutexMetadataImpl::Reset() {
-    this->stats = {};
-    this->num_try_locks.store(0);
+void SharedMutex::unlock() {
+    m_meta->mutex.unlock();
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-Mutex::Mutex()
-    : m_metadata(std::make_shared<MutexFullMetadata>()) {
-    EnsureMutexMetadataListInitialised();
+void SharedMutex::lock_shared() {
+    uint32_t timing_scale = GetUncontendedLockTimingScale();
+
+    uint64_t lock_start_ticks = 0; //spurious initialization to inhibit warning
+    if (timing_scale != 0) {
+        lock_start_ticks = GetCurrentTickCount();
+    }
 
-    m_meta = &m_metadata.get()->meta;
+    bool contended = false;
 
-    m_metadata->next = m_metadata.get();
-    m_metadata->prev = m_metadata.get();
-    m_metadata->mutex = this;
-    m_metadata->metadata_list_mutex = g_mutex_metadata_list_mutex;
+    if (m_meta->prefer_writers && m_meta->num_waiting_writers.load(std::memory_order_acquire) != 0) {
+        // Wait for the writer(s) to get in first.
+        if (timing_scale == 0) {
+            lock_start_ticks = GetCurrentTickCount();
+        }
 
-    LockGuard<std::mutex> lock(*g_mutex_metadata_list_mutex);
+        m_meta->writer_gate.lock();
+        m_meta->writer_gate.unlock();
+        contended = true;
+    }
 
-    if (!g_mutex_metadata_head) {
-        g_mutex_metadata_head = m_metadata.get();
-    } else {
-        m_metadata->prev = g_mutex_metadata_head->prev;
-        m_metadata->next = g_mutex_metadata_head;
+    if (!m_meta->mutex.try_lock_shared()) {
+        if (timing_scale == 0 && !contended) {
+            lock_start_ticks = GetCurrentTickCount();
+        }
+
+        m_meta->mutex.lock_shared();
+        contended = true;
+    }
+
+    HandleSharedResetRequest(m_meta);
+
+    if (contended) {
+        timing_scale = 1;
+        m_meta->num_contended_shared_locks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    m_meta->num_shared_locks.fetch_add(1, std::memory_order_relaxed);
+
+    if (timing_scale != 0) {
+        uint64_t lock_wait_ticks = GetCurrentTickCount() - lock_start_ticks;
 
-        m_metadata->prev->next = m_metadata.get();
-        m_metadata->next->prev = m_metadata.get();
+        m_meta->total_shared_lock_wait_ticks.fetch_add(lock_wait_ticks * timing_scale, std::memory_order_relaxed);
+        UpdateAtomicMin(&m_meta->min_shared_lock_wait_ticks, lock_wait_ticks);
+        UpdateAtomicMax(&m_meta->max_shared_lock_wait_ticks, lock_wait_ticks);
+
+        if (timing_scale > 1 && !m_meta->shared_sampled.load(std::memory_order_relaxed)) {
+            m_meta->shared_sampled.store(true, std::memory_order_relaxed);
+        }
     }
 
-    InvalidateLockedMetadataList();
-    CheckLockedMetadataList();
+    if (!m_meta->ever_locked.load(std::memory_order_relaxed)) {
+        m_meta->ever_locked.store(true, std::memory_order_release);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-Mutex::~Mutex() {
-    {
-        LockGuard<std::mutex> lock(*m_metadata->metadata_list_mutex);
+bool SharedMutex::try_lock_shared() {
+    bool succeeded;
+    if (m_meta->prefer_writers && m_meta->num_waiting_writers.load(std::memory_order_acquire) != 0) {
+        succeeded = false;
+    } else {
+        succeeded = m_meta->mutex.try_lock_shared();
+    }
+
+    if (succeeded) {
+        HandleSharedResetRequest(m_meta);
 
-        if (m_metadata.get() == g_mutex_metadata_head) {
-            g_mutex_metadata_head = m_metadata->next;
+        m_meta->num_successful_try_lock_shareds.fetch_add(1, std::memory_order_relaxed);
+    }
 
-            if (m_metadata.get() == g_mutex_metadata_head) {
-                // this was the last one in the list...
-                g_mutex_metadata_head = nullptr;
-            }
-        }
+    m_meta->num_try_lock_shareds.fetch_add(1, std::memory_order_relaxed);
 
-        m_metadata->next->prev = m_metadata->prev;
-        m_metadata->prev->next = m_metadata->next;
+    return succeeded;
+}
 
-        m_metadata->mutex = nullptr;
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-        InvalidateLockedMetadataList();
-        CheckLockedMetadataList();
-    }
+void SharedMutex::unlock_shared() {
+    m_meta->mutex.unlock_shared();
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void Mutex::SetName(std::string name) {
-    uint64_t start_ticks = GetCurrentTickCount();
+TicketMutex::TicketMutex()
+    : m_metadata(std::make_shared<MutexFullMetadataWithImpl<TicketMutexMetadataImpl>>()) {
+    m_meta = static_cast<TicketMutexMetadataImpl *>(m_metadata->meta);
+
+    RegisterMutexMetadata(m_metadata.get(), this);
+}
 
-    LockGuard<std::shared_mutex> lock(m_meta->name_mutex);
-    m_meta->name = std::move(name);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    g_mutex_name_overhead_ticks.fetch_add(GetCurrentTickCount() - start_ticks, std::memory_order_acq_rel);
+TicketMutex::~TicketMutex() {
+    UnregisterMutexMetadata(m_metadata.get());
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-MutexMetadata *Mutex::GetMutableMetadata() {
+void TicketMutex::SetName(std::string name) {
+    SetMetadataName(m_meta, std::move(name));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexMetadata *TicketMutex::GetMutableMetadata() {
     return m_meta;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-const MutexMetadata *Mutex::GetMetadata() const {
+const MutexMetadata *TicketMutex::GetMetadata() const {
     return m_meta;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void Mutex::lock() {
-    const bool assume_free_uncontended_locks = g_assume_free_uncontended_locks.load(std::memory_order_acquire);
+void TicketMutex::lock() {
+    const uint32_t timing_scale = GetUncontendedLockTimingScale();
 
     uint64_t lock_start_ticks = 0; //spurious initialization to inhibit warning
-    if (!assume_free_uncontended_locks) {
+    if (timing_scale != 0) {
         lock_start_ticks = GetCurrentTickCount();
     }
 
-    uint64_t lock_wait_ticks = 0;
-
-    uint8_t interesting_events = m_meta->interesting_events.load(std::memory_order_relaxed);
-
-    if (m_meta->mutex.try_lock()) {
-        interesting_events &= (uint8_t)~MutexInterestingEvent_ContendedLock;
-    } else {
-        if (assume_free_uncontended_locks) {
+    bool contended = false;
+    if (!m_meta->lock.try_lock()) {
+        if (timing_scale == 0) {
             lock_start_ticks = GetCurrentTickCount();
         }
 
-        m_meta->mutex.lock();
-        ++m_meta->stats.num_contended_locks;
-
-        if (assume_free_uncontended_locks) {
-            lock_wait_ticks += GetCurrentTickCount() - lock_start_ticks;
-        }
+        m_meta->num_waiters.fetch_add(1, std::memory_order_relaxed);
+        m_meta->lock.lock();
+        m_meta->num_waiters.fetch_sub(1, std::memory_order_relaxed);
+        contended = true;
     }
 
-    ++m_meta->stats.num_locks;
-    if (!assume_free_uncontended_locks) {
-        lock_wait_ticks += GetCurrentTickCount() - lock_start_ticks;
+    uint64_t lock_wait_ticks = 0;
+    if (contended || timing_scale != 0) {
+        lock_wait_ticks = GetCurrentTickCount() - lock_start_ticks;
     }
 
-    if (m_meta->reset.exchange(false)) {
-        m_meta->Reset();
-    }
+    RecordExclusiveLock(m_meta, lock_wait_ticks, contended ? 1 : timing_scale, contended);
+}
 
-    m_meta->ever_locked.store(true, std::memory_order_release);
-    m_meta->stats.total_lock_wait_ticks += lock_wait_ticks;
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    if (lock_wait_ticks < m_meta->stats.min_lock_wait_ticks) {
-        m_meta->stats.min_lock_wait_ticks = lock_wait_ticks;
-    }
+bool TicketMutex::try_lock() {
+    bool succeeded = m_meta->lock.try_lock();
 
-    if (lock_wait_ticks > m_meta->stats.max_lock_wait_ticks) {
-        m_meta->stats.max_lock_wait_ticks = lock_wait_ticks;
-    }
+    if (succeeded) {
+        ++m_meta->stats.num_successful_try_locks;
 
-    if (interesting_events != 0) {
-        this->OnInterestingEvents(interesting_events, m_meta);
+        HandleResetRequest(m_meta);
     }
+
+    ++m_meta->num_try_locks;
+
+    return succeeded;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-bool Mutex::try_lock() {
-    bool succeeded = m_meta->mutex.try_lock();
+void TicketMutex::unlock() {
+    m_meta->lock.unlock();
+}
 
-    if (succeeded) {
-        ++m_meta->stats.num_successful_try_locks;
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-        // no need so set ever_locked - the successful lock that's blocking this
-        // one already did it
-    }
+ConditionVariable::ConditionVariable()
+    : m_metadata(std::make_shared<MutexFullMetadataWithImpl<ConditionVariableMetadataImpl>>()) {
+    m_meta = static_cast<ConditionVariableMetadataImpl *>(m_metadata->meta);
 
-    ++m_meta->num_try_locks;
+    RegisterMutexMetadata(m_metadata.get(), this);
+}
 
-    if (m_meta->reset.exchange(false)) {
-        m_meta->Reset();
-    }
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    return succeeded;
+ConditionVariable::~ConditionVariable() {
+    UnregisterMutexMetadata(m_metadata.get());
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void Mutex::unlock() {
-    m_meta->mutex.unlock();
+void ConditionVariable::SetName(std::string name) {
+    SetMetadataName(m_meta, std::move(name));
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-uint64_t Mutex::GetMetadataChangeCounter() {
-    EnsureMutexMetadataListInitialised();
+MutexMetadata *ConditionVariable::GetMutableMetadata() {
+    return m_meta;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const MutexMetadata *ConditionVariable::GetMetadata() const {
+    return m_meta;
+}
 
-    LockGuard<std::mutex> lock(*g_mutex_metadata_list_mutex);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
 
-    return g_mutex_metadata_list_change_counter;
+void ConditionVariable::notify_one() {
+    m_meta->num_notify_ones.fetch_add(1, std::memory_order_relaxed);
+    m_meta->last_notify_ticks.store(GetCurrentTickCount(), std::memory_order_release);
+    m_meta->cv.notify_one();
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-std::vector<std::shared_ptr<MutexMetadata>> Mutex::GetAllMetadata() {
-    EnsureMutexMetadataListInitialised();
+void ConditionVariable::notify_all() {
+    m_meta->num_notify_alls.fetch_add(1, std::memory_order_relaxed);
+    m_meta->last_notify_ticks.store(GetCurrentTickCount(), std::memory_order_release);
+    m_meta->cv.notify_all();
+}
 
-    LockGuard<std::mutex> lock(*g_mutex_metadata_list_mutex);
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void ConditionVariable::wait(UniqueLock<Mutex> &lock) {
+    this->Wait(lock, nullptr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool ConditionVariable::wait_until(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point &timeout_time) {
+    return this->Wait(lock, &timeout_time);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool ConditionVariable::Wait(UniqueLock<Mutex> &lock, const std::chrono::steady_clock::time_point *timeout_time) {
+    ASSERT(lock.owns_lock());
+
+    // Wait on the Mutex's std::mutex directly. The UniqueLock still owns the
+    // lock afterwards, same as it did before.
+    std::unique_lock<std::mutex> std_lock(lock.mutex()->m_meta->mutex, std::adopt_lock);
+
+    uint64_t wait_start_ticks = GetCurrentTickCount();
+
+    bool woken = true;
+    if (timeout_time) {
+        woken = m_meta->cv.wait_until(std_lock, *timeout_time) == std::cv_status::no_timeout;
+    } else {
+        m_meta->cv.wait(std_lock);
+    }
+
+    uint64_t wait_end_ticks = GetCurrentTickCount();
+
+    std_lock.release();
 
-    if (g_mutex_metadata_list_last_change_counter != g_mutex_metadata_list_change_counter) {
-        g_mutex_metadata_list.clear();
+    uint64_t wait_ticks = wait_end_ticks - wait_start_ticks;
+    m_meta->num_waits.fetch_add(1, std::memory_order_relaxed);
+    m_meta->total_wait_ticks.fetch_add(wait_ticks, std::memory_order_relaxed);
+    UpdateAtomicMax(&m_meta->max_wait_ticks, wait_ticks);
 
-        if (MutexFullMetadata *m = g_mutex_metadata_head) {
-            do {
-                g_mutex_metadata_list.push_back(std::shared_ptr<MutexMetadata>(m->shared_from_this(), &m->meta));
+    if (woken) {
+        // The notify may have come in before the wait even started, if it
+        // was for some other waiter. (Spurious wakeups also count, with
+        // whatever the most recent notify was.)
+        uint64_t wakeup_start_ticks = (std::max)(m_meta->last_notify_ticks.load(std::memory_order_acquire), wait_start_ticks);
 
-                m = m->next;
-            } while (m != g_mutex_metadata_head);
+        uint64_t wakeup_ticks = 0;
+        if (wait_end_ticks > wakeup_start_ticks) {
+            wakeup_ticks = wait_end_ticks - wakeup_start_ticks;
         }
 
-        g_mutex_metadata_list_last_change_counter = g_mutex_metadata_list_change_counter;
+        m_meta->num_wakeups.fetch_add(1, std::memory_order_relaxed);
+        m_meta->total_wakeup_ticks.fetch_add(wakeup_ticks, std::memory_order_relaxed);
+        UpdateAtomicMax(&m_meta->max_wakeup_ticks, wakeup_ticks);
+    } else {
+        m_meta->num_wait_timeouts.fetch_add(1, std::memory_order_relaxed);
     }
 
-    return g_mutex_metadata_list;
+    return woken;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-uint64_t Mutex::GetNameOverheadTicks() {
-    return g_mutex_name_overhead_ticks.load(std::memory_order_acquire);
+uint32_t Mutex::GetLockTimingSampleRate() {
+    return g_lock_timing_sample_rate.load(std::memory_order_acquire);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-bool Mutex::GetAssumeFreeUncontendedLocks() {
-    return g_assume_free_uncontended_locks.load(std::memory_order_acquire);
+void Mutex::SetLockTimingSampleRate(uint32_t sample_rate) {
+    g_lock_timing_sample_rate.store(sample_rate, std::memory_order_release);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
-void Mutex::SetAssumeFreeUncontendedLocks(bool assume_free_uncontended_locks) {
-    g_assume_free_uncontended_locks.store(assume_free_uncontended_locks, std::memory_order_release);
+uint32_t Mutex::GetContentionProfilerSampleRate() {
+    return g_contention_profiler_sample_rate.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::SetContentionProfilerSampleRate(uint32_t sample_rate) {
+    if (sample_rate > 0 && !g_contention_profile.load(std::memory_order_acquire)) {
+        auto profile = new ContentionProfile;
+
+        ContentionProfile *expected = nullptr;
+        if (!g_contention_profile.compare_exchange_strong(expected, profile, std::memory_order_acq_rel)) {
+            // somebody else got there first.
+            delete profile;
+        }
+    }
+
+    g_contention_profiler_sample_rate.store(sample_rate, std::memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::ResetContentionProfile() {
+    ContentionProfile *profile = g_contention_profile.load(std::memory_order_acquire);
+    if (!profile) {
+        return;
+    }
+
+    for (ContentionProfileEntry &entry : profile->entries) {
+        entry.num_samples.store(0, std::memory_order_relaxed);
+        entry.total_wait_ticks.store(0, std::memory_order_relaxed);
+        entry.max_wait_ticks.store(0, std::memory_order_relaxed);
+    }
+
+    profile->num_dropped_samples.store(0, std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void Mutex::LogContentionProfile(Log *log, size_t max_num_entries) {
+    if (!log) {
+        return;
+    }
+
+    ContentionProfile *profile = g_contention_profile.load(std::memory_order_acquire);
+    if (!profile) {
+        log->f("Contention profiler has never been enabled.\n");
+        return;
+    }
+
+    struct Row {
+        const ContentionProfileEntry *entry;
+        uint64_t num_samples;
+        uint64_t total_wait_ticks;
+        uint64_t max_wait_ticks;
+    };
+    std::vector<Row> rows;
+
+    for (const ContentionProfileEntry &entry : profile->entries) {
+        if (entry.state.load(std::memory_order_acquire) == ContentionProfileEntryState_Ready) {
+            Row row;
+            row.entry = &entry;
+            row.num_samples = entry.num_samples.load(std::memory_order_relaxed);
+            row.total_wait_ticks = entry.total_wait_ticks.load(std::memory_order_relaxed);
+            row.max_wait_ticks = entry.max_wait_ticks.load(std::memory_order_relaxed);
+
+            if (row.num_samples > 0) {
+                rows.push_back(row);
+            }
+        }
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+        return a.total_wait_ticks > b.total_wait_ticks;
+    });
+
+    log->f("Contention profile: %zu call stacks (1 in %" PRIu32 " contended locks sampled; %" PRIu64 " samples dropped)\n",
+           rows.size(),
+           g_contention_profiler_sample_rate.load(std::memory_order_acquire),
+           profile->num_dropped_samples.load(std::memory_order_relaxed));
+
+    if (rows.size() > max_num_entries) {
+        rows.resize(max_num_entries);
+    }
+
+    LogIndenter indent(log);
+
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const Row *row = &rows[i];
+        const ContentionProfileEntry *entry = row->entry;
+
+        log->f("%zu. %s: %" PRIu64 " samples; total wait: %.3f ms; max wait: %.3f ms\n",
+               i + 1,
+               entry->name[0] == 0 ? "<<unnamed>>" : entry->name,
+               row->num_samples,
+               GetMillisecondsFromTicks(row->total_wait_ticks),
+               GetMillisecondsFromTicks(row->max_wait_ticks));
+
+        LogIndenter indent2(log);
+
+        char **symbols = GetBacktraceSymbols(entry->frames, entry->num_frames);
+
+        for (int j = 0; j < entry->num_frames; ++j) {
+            if (symbols) {
+                log->f("%s\n", symbols[j]);
+            } else {
+                log->f("%p\n", entry->frames[j]);
+            }
+        }
+
+        free(symbols);
+        symbols = nullptr;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -432,6 +1896,15 @@ void Mutex::OnInterestingEvents(uint8_t interesting_events, MutexMetadataImpl *m
 #elif __APPLE__
         int x = 0;
         (void)x;
+#endif
+    }
+
+    if (interesting_events & MutexInterestingEvent_Unlock) {
+#ifdef _MSC_VER
+        __nop();
+#elif __APPLE__
+        int x = 0;
+        (void)x;
 #endif
     }
 }
@@ -446,4 +1919,25 @@ MutexNameSetter::MutexNameSetter(Mutex *mutex, const char *name) {
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 
+MutexNameSetter::MutexNameSetter(SharedMutex *mutex, const char *name) {
+    MUTEX_SET_NAME(*mutex, name);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexNameSetter::MutexNameSetter(ConditionVariable *cv, const char *name) {
+    MUTEX_SET_NAME(*cv, name);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+MutexNameSetter::MutexNameSetter(TicketMutex *mutex, const char *name) {
+    MUTEX_SET_NAME(*mutex, name);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
 #endif
@@ -0,0 +1,736 @@
+#include <shared/system.h>
+#include <shared/openmetrics.h>
+#include <shared/metrics.h>
+#include <shared/mutex.h>
+#include <shared/file_io.h>
+#include <shared/log.h>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <string.h>
+#include <inttypes.h>
+
+#if SYSTEM_POSIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#if SYSTEM_POSIX && !defined MSG_NOSIGNAL
+// macOS. SO_NOSIGPIPE is set on the socket instead.
+#define MSG_NOSIGNAL 0
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct OpenMetricsValueEntry {
+    std::string family;
+    std::string set;
+    // Signed values are stored as their two's complement bit pattern, so
+    // they still add up correctly.
+    uint64_t value = 0;
+    bool counter = false;
+    bool is_signed = false;
+};
+
+struct OpenMetricsTimerEntry {
+    std::string set;
+    std::string timer;
+    uint64_t total_num_ticks = 0;
+    uint64_t num_samples = 0;
+    uint64_t self_num_ticks = 0;
+    bool has_histogram = false;
+    HistogramSnapshot histogram;
+};
+
+struct OpenMetricsMutexEntry {
+    std::string name;
+    uint64_t num_locks = 0;
+    uint64_t num_contended_locks = 0;
+    uint64_t total_lock_wait_ticks = 0;
+};
+
+// The entry vectors only ever grow, and num_xxx says how many are in use,
+// so the strings and histogram vectors in them can be reused.
+struct OpenMetricsExporter::Scratch {
+    std::vector<OpenMetricsValueEntry> values;
+    size_t num_values = 0;
+
+    std::vector<OpenMetricsTimerEntry> timers;
+    size_t num_timers = 0;
+
+    std::vector<OpenMetricsMutexEntry> mutexes;
+    size_t num_mutexes = 0;
+
+    std::string set_name;
+#if MUTEX_DEBUGGING
+    MutexDetails mutex_details;
+#endif
+
+    // Value families that have been left out, so each is only logged
+    // once.
+    std::set<std::string> skipped_families;
+};
+
+static const double OPENMETRICS_QUANTILES[] = {.5, .9, .99, 1.};
+
+static const char TIMER_FAMILY[] = "timer_seconds";
+static const char TIMER_SELF_FAMILY[] = "timer_self_seconds";
+static const char MUTEX_LOCKS_FAMILY[] = "mutex_locks";
+static const char MUTEX_CONTENDED_LOCKS_FAMILY[] = "mutex_contended_locks";
+static const char MUTEX_LOCK_WAIT_FAMILY[] = "mutex_lock_wait_seconds";
+
+// A Value family with one of these names would clash with the built-in
+// families' samples. (The summary's samples are named after the family,
+// with or without _sum or _count.)
+static const char *const OPENMETRICS_RESERVED_FAMILIES[] = {
+    TIMER_FAMILY,
+    "timer_seconds_sum",
+    "timer_seconds_count",
+    TIMER_SELF_FAMILY,
+    MUTEX_LOCKS_FAMILY,
+    MUTEX_CONTENDED_LOCKS_FAMILY,
+    MUTEX_LOCK_WAIT_FAMILY,
+};
+
+static LOG_DEFINE(OPENMETRICS, "", &log_printer_stderr);
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+template <class T>
+static T *AddEntry(std::vector<T> *entries, size_t *num_entries) {
+    if (*num_entries == entries->size()) {
+        entries->emplace_back();
+    }
+
+    return &(*entries)[(*num_entries)++];
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Metric names are [a-zA-Z_:][a-zA-Z0-9_:]*. Anything else becomes _.
+static void AssignMetricName(std::string *dest, const std::string &src) {
+    dest->clear();
+
+    for (char c : src) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || (c >= '0' && c <= '9' && !dest->empty())) {
+            dest->push_back(c);
+        } else {
+            dest->push_back('_');
+        }
+    }
+
+    if (dest->empty()) {
+        dest->push_back('_');
+    }
+
+    // The _total is added back on when printing.
+    static const char TOTAL_SUFFIX[] = "_total";
+    static const size_t TOTAL_SUFFIX_LEN = sizeof TOTAL_SUFFIX - 1;
+    if (dest->size() > TOTAL_SUFFIX_LEN && dest->compare(dest->size() - TOTAL_SUFFIX_LEN, TOTAL_SUFFIX_LEN, TOTAL_SUFFIX) == 0) {
+        dest->resize(dest->size() - TOTAL_SUFFIX_LEN);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendLabel(std::string *text, const char *name, const std::string &value) {
+    if (text->back() != '{') {
+        text->push_back(',');
+    }
+
+    *text += name;
+    *text += "=\"";
+
+    for (char c : value) {
+        if (c == '\\') {
+            *text += "\\\\";
+        } else if (c == '"') {
+            *text += "\\\"";
+        } else if (c == '\n') {
+            *text += "\\n";
+        } else {
+            text->push_back(c);
+        }
+    }
+
+    text->push_back('"');
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendUInt64(std::string *text, uint64_t value) {
+    char buf[30];
+    snprintf(buf, sizeof buf, "%" PRIu64, value);
+    *text += buf;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendInt64(std::string *text, int64_t value) {
+    char buf[30];
+    snprintf(buf, sizeof buf, "%" PRId64, value);
+    *text += buf;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendDouble(std::string *text, double value) {
+    char buf[40];
+    snprintf(buf, sizeof buf, "%.9g", value);
+    *text += buf;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendFamilyHeader(std::string *text, const char *family, const char *type, const char *unit) {
+    *text += "# TYPE ";
+    *text += family;
+    text->push_back(' ');
+    *text += type;
+    text->push_back('\n');
+
+    if (unit) {
+        *text += "# UNIT ";
+        *text += family;
+        text->push_back(' ');
+        *text += unit;
+        text->push_back('\n');
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The path from the root TimerDef, separated by /s.
+static void AppendTimerPath(std::string *path, const TimerDef *def) {
+    if (const TimerDef *parent = def->GetParent()) {
+        AppendTimerPath(path, parent);
+        path->push_back('/');
+    }
+
+    *path += def->name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static bool IsReservedFamily(const std::string &family) {
+    for (const char *reserved : OPENMETRICS_RESERVED_FAMILIES) {
+        if (family == reserved) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void LogSkippedFamily(std::set<std::string> *skipped_families, const char *what, const std::string &family, const char *reason) {
+    if (skipped_families->insert(family).second) {
+        LOGF(OPENMETRICS, "OpenMetrics: leaving out %s%s, as %s\n", what, family.c_str(), reason);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+OpenMetricsExporter::OpenMetricsExporter()
+    : m_scratch(std::make_unique<Scratch>()) {
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+OpenMetricsExporter::~OpenMetricsExporter() = default;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const std::string &OpenMetricsExporter::Render() {
+    Scratch *scratch = m_scratch.get();
+
+    scratch->num_values = 0;
+    scratch->num_timers = 0;
+    scratch->num_mutexes = 0;
+
+    // Everything is assigned into the existing entries, so once the
+    // vectors and strings are big enough there's no allocation.
+    MetricSet::ForEach([scratch](const MetricSet *set) {
+        set->GetName(&scratch->set_name);
+
+        set->ForEachValue([scratch](const Value *value) {
+            OpenMetricsValueEntry *entry = AddEntry(&scratch->values, &scratch->num_values);
+            AssignMetricName(&entry->family, value->name);
+            entry->set = scratch->set_name;
+            entry->value = value->GetValue();
+            entry->counter = dynamic_cast<const Counter *>(value) || dynamic_cast<const StripedCounter *>(value);
+            entry->is_signed = value->IsSigned();
+        });
+
+        set->ForEachTimerDef([scratch](const TimerDef *def) {
+            OpenMetricsTimerEntry *entry = AddEntry(&scratch->timers, &scratch->num_timers);
+            entry->set = scratch->set_name;
+            entry->timer.clear();
+            AppendTimerPath(&entry->timer, def);
+            TimerDefTotals totals = def->GetTotals();
+            entry->total_num_ticks = totals.total_num_ticks;
+            entry->num_samples = totals.num_samples;
+            entry->self_num_ticks = totals.self_num_ticks;
+
+            if (const Histogram *histogram = def->GetHistogram()) {
+                entry->has_histogram = true;
+                histogram->GetSnapshot(&entry->histogram);
+            } else {
+                entry->has_histogram = false;
+            }
+        });
+    });
+
+#if MUTEX_DEBUGGING
+    {
+        std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> snapshot = Mutex::GetAllMetadataSnapshot();
+        MutexDetails *details = &scratch->mutex_details;
+        for (const std::shared_ptr<MutexMetadata> &metadata : *snapshot) {
+            metadata->GetDetails(details);
+
+            OpenMetricsMutexEntry *entry = AddEntry(&scratch->mutexes, &scratch->num_mutexes);
+            entry->name = details->name;
+            entry->num_locks = details->stats.num_locks + details->stats.num_shared_locks;
+            entry->num_contended_locks = details->stats.num_contended_locks + details->stats.num_contended_shared_locks;
+            entry->total_lock_wait_ticks = details->stats.total_lock_wait_ticks + details->stats.total_shared_lock_wait_ticks;
+        }
+    }
+#endif
+
+    // Each family's samples have to be together, and each label set can
+    // only appear once, so sort, and merge duplicates. Within a family,
+    // counters come first - see below.
+    auto values_begin = scratch->values.begin(), values_end = values_begin + (ptrdiff_t)scratch->num_values;
+    std::sort(values_begin, values_end, [](const OpenMetricsValueEntry &a, const OpenMetricsValueEntry &b) {
+        if (a.family != b.family) {
+            return a.family < b.family;
+        }
+
+        if (a.counter != b.counter) {
+            return a.counter;
+        }
+
+        return a.set < b.set;
+    });
+
+    auto timers_begin = scratch->timers.begin(), timers_end = timers_begin + (ptrdiff_t)scratch->num_timers;
+    std::sort(timers_begin, timers_end, [](const OpenMetricsTimerEntry &a, const OpenMetricsTimerEntry &b) {
+        if (a.set != b.set) {
+            return a.set < b.set;
+        }
+
+        return a.timer < b.timer;
+    });
+
+    auto mutexes_begin = scratch->mutexes.begin(), mutexes_end = mutexes_begin + (ptrdiff_t)scratch->num_mutexes;
+    std::sort(mutexes_begin, mutexes_end, [](const OpenMetricsMutexEntry &a, const OpenMetricsMutexEntry &b) {
+        return a.name < b.name;
+    });
+
+    m_text.clear();
+
+    for (size_t i = 0; i < scratch->num_values;) {
+        const OpenMetricsValueEntry *first = &scratch->values[i];
+
+        size_t family_end = i + 1;
+        while (family_end < scratch->num_values && scratch->values[family_end].family == first->family) {
+            ++family_end;
+        }
+
+        if (IsReservedFamily(first->family)) {
+            LogSkippedFamily(&scratch->skipped_families, "", first->family, "its name clashes with a built-in family");
+            i = family_end;
+            continue;
+        }
+
+        // A family only has one type. If the same name is a counter in one
+        // set and a gauge in another, the counters (which sort first) win.
+        size_t kind_end = i + 1;
+        while (kind_end < family_end && scratch->values[kind_end].counter == first->counter) {
+            ++kind_end;
+        }
+
+        if (kind_end < family_end) {
+            LogSkippedFamily(&scratch->skipped_families, "the gauges named ", first->family, "it's a counter in other sets");
+        }
+
+        AppendFamilyHeader(&m_text, first->family.c_str(), first->counter ? "counter" : "gauge", nullptr);
+
+        while (i < kind_end) {
+            const OpenMetricsValueEntry *entry = &scratch->values[i];
+
+            uint64_t value = 0;
+            do {
+                value += scratch->values[i].value;
+                ++i;
+            } while (i < kind_end && scratch->values[i].set == entry->set);
+
+            m_text += entry->family;
+            if (first->counter) {
+                m_text += "_total";
+            }
+            m_text.push_back('{');
+            AppendLabel(&m_text, "set", entry->set);
+            m_text += "} ";
+            if (entry->is_signed) {
+                AppendInt64(&m_text, (int64_t)value);
+            } else {
+                AppendUInt64(&m_text, value);
+            }
+            m_text.push_back('\n');
+        }
+
+        i = family_end;
+    }
+
+    if (scratch->num_timers > 0) {
+        AppendFamilyHeader(&m_text, TIMER_FAMILY, "summary", "seconds");
+
+        // Same-named TimerDefs are merged, and the results moved down, for
+        // the self time family afterwards.
+        size_t num_merged = 0;
+        for (size_t i = 0; i < scratch->num_timers;) {
+            OpenMetricsTimerEntry *entry = &scratch->timers[i++];
+
+            while (i < scratch->num_timers && scratch->timers[i].set == entry->set && scratch->timers[i].timer == entry->timer) {
+                const OpenMetricsTimerEntry *dup = &scratch->timers[i++];
+
+                entry->total_num_ticks += dup->total_num_ticks;
+                entry->num_samples += dup->num_samples;
+                entry->self_num_ticks += dup->self_num_ticks;
+
+                if (dup->has_histogram) {
+                    if (entry->has_histogram) {
+                        entry->histogram.Merge(dup->histogram);
+                    } else {
+                        entry->histogram = dup->histogram;
+                        entry->has_histogram = true;
+                    }
+                }
+            }
+
+            if (entry->has_histogram) {
+                for (double quantile : OPENMETRICS_QUANTILES) {
+                    m_text += TIMER_FAMILY;
+                    m_text.push_back('{');
+                    AppendLabel(&m_text, "set", entry->set);
+                    AppendLabel(&m_text, "timer", entry->timer);
+                    m_text += ",quantile=\"";
+                    AppendDouble(&m_text, quantile);
+                    m_text += "\"} ";
+                    AppendDouble(&m_text, GetSecondsFromTicks(entry->histogram.GetPercentile(quantile * 100.)));
+                    m_text.push_back('\n');
+                }
+            }
+
+            m_text += TIMER_FAMILY;
+            m_text += "_sum{";
+            AppendLabel(&m_text, "set", entry->set);
+            AppendLabel(&m_text, "timer", entry->timer);
+            m_text += "} ";
+            AppendDouble(&m_text, GetSecondsFromTicks(entry->total_num_ticks));
+            m_text.push_back('\n');
+
+            m_text += TIMER_FAMILY;
+            m_text += "_count{";
+            AppendLabel(&m_text, "set", entry->set);
+            AppendLabel(&m_text, "timer", entry->timer);
+            m_text += "} ";
+            AppendUInt64(&m_text, entry->num_samples);
+            m_text.push_back('\n');
+
+            if (&scratch->timers[num_merged] != entry) {
+                std::swap(scratch->timers[num_merged], *entry);
+            }
+            ++num_merged;
+        }
+
+        AppendFamilyHeader(&m_text, TIMER_SELF_FAMILY, "counter", "seconds");
+
+        for (size_t i = 0; i < num_merged; ++i) {
+            const OpenMetricsTimerEntry *entry = &scratch->timers[i];
+
+            m_text += TIMER_SELF_FAMILY;
+            m_text += "_total{";
+            AppendLabel(&m_text, "set", entry->set);
+            AppendLabel(&m_text, "timer", entry->timer);
+            m_text += "} ";
+            AppendDouble(&m_text, GetSecondsFromTicks(entry->self_num_ticks));
+            m_text.push_back('\n');
+        }
+    }
+
+    if (scratch->num_mutexes > 0) {
+        // Merge same-named mutexes in place first, as there are three
+        // families to print.
+        size_t num_merged = 0;
+        for (size_t i = 0; i < scratch->num_mutexes; ++i) {
+            OpenMetricsMutexEntry *src = &scratch->mutexes[i];
+
+            if (num_merged > 0 && scratch->mutexes[num_merged - 1].name == src->name) {
+                OpenMetricsMutexEntry *dest = &scratch->mutexes[num_merged - 1];
+                dest->num_locks += src->num_locks;
+                dest->num_contended_locks += src->num_contended_locks;
+                dest->total_lock_wait_ticks += src->total_lock_wait_ticks;
+            } else {
+                if (num_merged != i) {
+                    std::swap(scratch->mutexes[num_merged], *src);
+                }
+
+                ++num_merged;
+            }
+        }
+
+        AppendFamilyHeader(&m_text, MUTEX_LOCKS_FAMILY, "counter", nullptr);
+        for (size_t i = 0; i < num_merged; ++i) {
+            m_text += MUTEX_LOCKS_FAMILY;
+            m_text += "_total{";
+            AppendLabel(&m_text, "mutex", scratch->mutexes[i].name);
+            m_text += "} ";
+            AppendUInt64(&m_text, scratch->mutexes[i].num_locks);
+            m_text.push_back('\n');
+        }
+
+        AppendFamilyHeader(&m_text, MUTEX_CONTENDED_LOCKS_FAMILY, "counter", nullptr);
+        for (size_t i = 0; i < num_merged; ++i) {
+            m_text += MUTEX_CONTENDED_LOCKS_FAMILY;
+            m_text += "_total{";
+            AppendLabel(&m_text, "mutex", scratch->mutexes[i].name);
+            m_text += "} ";
+            AppendUInt64(&m_text, scratch->mutexes[i].num_contended_locks);
+            m_text.push_back('\n');
+        }
+
+        AppendFamilyHeader(&m_text, MUTEX_LOCK_WAIT_FAMILY, "counter", "seconds");
+        for (size_t i = 0; i < num_merged; ++i) {
+            m_text += MUTEX_LOCK_WAIT_FAMILY;
+            m_text += "_total{";
+            AppendLabel(&m_text, "mutex", scratch->mutexes[i].name);
+            m_text += "} ";
+            AppendDouble(&m_text, GetSecondsFromTicks(scratch->mutexes[i].total_lock_wait_ticks));
+            m_text.push_back('\n');
+        }
+    }
+
+    m_text += "# EOF\n";
+
+    return m_text;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool OpenMetricsExporter::Save(const std::string &path, const LogSet *logs) {
+    const std::string &text = this->Render();
+
+    return SaveFile(text.data(), text.size(), path, logs, SaveFlag_AtomicReplace);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::unique_ptr<OpenMetricsHTTPServer> OpenMetricsHTTPServer::Create(uint16_t port, const LogSet *logs) {
+#if SYSTEM_POSIX
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        if (logs) {
+            logs->e.f("OpenMetrics server: socket failed: %s\n", strerror(errno));
+        }
+
+        return nullptr;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (const sockaddr *)&addr, sizeof addr) != 0 || listen(fd, 8) != 0) {
+        if (logs) {
+            logs->e.f("OpenMetrics server: failed to listen on port %u: %s\n", port, strerror(errno));
+        }
+
+        close(fd);
+        return nullptr;
+    }
+
+    socklen_t addr_size = sizeof addr;
+    if (getsockname(fd, (sockaddr *)&addr, &addr_size) != 0) {
+        if (logs) {
+            logs->e.f("OpenMetrics server: getsockname failed: %s\n", strerror(errno));
+        }
+
+        close(fd);
+        return nullptr;
+    }
+
+    std::unique_ptr<OpenMetricsHTTPServer> server(new OpenMetricsHTTPServer);
+    server->m_fd = fd;
+    server->m_port = ntohs(addr.sin_port);
+    server->m_thread = std::thread(&OpenMetricsHTTPServer::ThreadMain, server.get());
+
+    return server;
+
+#else
+
+    (void)port;
+
+    if (logs) {
+        logs->e.f("OpenMetrics server: not supported on this platform\n");
+    }
+
+    return nullptr;
+
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+OpenMetricsHTTPServer::~OpenMetricsHTTPServer() {
+    m_stop.store(true, std::memory_order_release);
+
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+
+#if SYSTEM_POSIX
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint16_t OpenMetricsHTTPServer::GetPort() const {
+    return m_port;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void OpenMetricsHTTPServer::ThreadMain() {
+#if SYSTEM_POSIX
+    SetCurrentThreadName("OpenMetrics server");
+
+    // Poll with a timeout, so the destructor doesn't have to wake it up.
+    while (!m_stop.load(std::memory_order_acquire)) {
+        pollfd p = {};
+        p.fd = m_fd;
+        p.events = POLLIN;
+
+        if (poll(&p, 1, 100) <= 0) {
+            continue;
+        }
+
+        int fd = accept(m_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        this->HandleConnection(fd);
+
+        close(fd);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_POSIX
+static bool SendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += n;
+        size -= (size_t)n;
+    }
+
+    return true;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void OpenMetricsHTTPServer::HandleConnection(int fd) {
+#if SYSTEM_POSIX
+    // Don't let a client that never sends anything hold things up.
+    timeval timeout = {};
+    timeout.tv_sec = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+#ifdef SO_NOSIGPIPE
+    int no_sigpipe = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof no_sigpipe);
+#endif
+
+    // Only the request line matters.
+    char request[1024];
+    size_t request_size = 0;
+    while (request_size < sizeof request) {
+        ssize_t n = recv(fd, request + request_size, sizeof request - request_size, 0);
+        if (n <= 0) {
+            break;
+        }
+
+        request_size += (size_t)n;
+
+        if (memmem(request, request_size, "\r\n\r\n", 4)) {
+            break;
+        }
+    }
+
+    char header[200];
+    const std::string *body = nullptr;
+    if (request_size >= 4 && memcmp(request, "GET ", 4) == 0) {
+        body = &m_exporter.Render();
+        snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body->size());
+    } else {
+        snprintf(header, sizeof header, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+
+    if (SendAll(fd, header, strlen(header)) && body) {
+        SendAll(fd, body->data(), body->size());
+    }
+#else
+    (void)fd;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,318 @@
+#include <shared/system.h>
+#include <shared/perf_counters.h>
+#include <shared/debug.h>
+#include <shared/log.h>
+#include <string.h>
+#include <algorithm>
+
+#if SYSTEM_LINUX
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include <shared/enum_def.h>
+#include <shared/perf_counters.inl>
+#include <shared/enum_end.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static const char *const PERF_COUNTER_HARDWARE_NAMES[PERF_COUNTERS_NUM_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "branch_misses",
+};
+
+static const char *const PERF_COUNTER_SOFTWARE_NAMES[PERF_COUNTERS_NUM_COUNTERS] = {
+    "task_clock_ns",
+    "page_faults",
+    "context_switches",
+    "cpu_migrations",
+};
+
+std::atomic<bool> PerfCounters::ms_enabled{false};
+
+// Generation in the top 32 bits, PerfCounterMode in the bottom 32. Each
+// thread compares this with what it opened its counters for, so it can
+// tell when to reopen them.
+static std::atomic<uint64_t> g_perf_counters_state{0};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_LINUX
+
+struct PerfEventType {
+    uint32_t type;
+    uint64_t config;
+};
+
+static const PerfEventType PERF_COUNTER_HARDWARE_EVENTS[PERF_COUNTERS_NUM_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const PerfEventType PERF_COUNTER_SOFTWARE_EVENTS[PERF_COUNTERS_NUM_COUNTERS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// One thread's counter group.
+struct PerfThreadCounters {
+    int group_fd = -1;
+    int fds[PERF_COUNTERS_NUM_COUNTERS] = {-1, -1, -1, -1};
+
+    // Index of each counter in the group read, or -1 if that one
+    // couldn't be opened.
+    int read_indexes[PERF_COUNTERS_NUM_COUNTERS] = {-1, -1, -1, -1};
+
+    // g_perf_counters_state value the counters were opened for.
+    uint64_t state = 0;
+
+    PerfThreadCounters() = default;
+    ~PerfThreadCounters();
+
+    PerfThreadCounters(const PerfThreadCounters &) = delete;
+    PerfThreadCounters &operator=(const PerfThreadCounters &) = delete;
+    PerfThreadCounters(PerfThreadCounters &&) = delete;
+    PerfThreadCounters &operator=(PerfThreadCounters &&) = delete;
+
+    // Returns false if none of the counters could be opened.
+    bool Open(PerfCounterMode mode, const LogSet *logs);
+    void Close();
+};
+
+static thread_local PerfThreadCounters t_perf_thread_counters;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+PerfThreadCounters::~PerfThreadCounters() {
+    this->Close();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool PerfThreadCounters::Open(PerfCounterMode mode, const LogSet *logs) {
+    this->Close();
+
+    const PerfEventType *events;
+    const char *const *names;
+    if (mode == PerfCounterMode_Hardware) {
+        events = PERF_COUNTER_HARDWARE_EVENTS;
+        names = PERF_COUNTER_HARDWARE_NAMES;
+    } else if (mode == PerfCounterMode_Software) {
+        events = PERF_COUNTER_SOFTWARE_EVENTS;
+        names = PERF_COUNTER_SOFTWARE_NAMES;
+    } else {
+        return false;
+    }
+
+    int num_open = 0;
+    for (size_t i = 0; i < PERF_COUNTERS_NUM_COUNTERS; ++i) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // User space only, so it works with perf_event_paranoid=2.
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // The first counter that opens leads the group.
+        int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, this->group_fd, PERF_FLAG_FD_CLOEXEC);
+        if (fd < 0) {
+            if (logs) {
+                logs->e.f("perf counters: failed to open %s: %s\n", names[i], strerror(errno));
+            }
+
+            continue;
+        }
+
+        if (this->group_fd < 0) {
+            this->group_fd = fd;
+        }
+
+        this->fds[i] = fd;
+        this->read_indexes[i] = num_open++;
+    }
+
+    return this->group_fd >= 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Members first, then the leader.
+void PerfThreadCounters::Close() {
+    for (size_t i = 0; i < PERF_COUNTERS_NUM_COUNTERS; ++i) {
+        if (this->fds[i] >= 0 && this->fds[i] != this->group_fd) {
+            close(this->fds[i]);
+        }
+
+        this->fds[i] = -1;
+        this->read_indexes[i] = -1;
+    }
+
+    if (this->group_fd >= 0) {
+        close(this->group_fd);
+        this->group_fd = -1;
+    }
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool PerfCounters::SetMode(PerfCounterMode mode, const LogSet *logs) {
+    if (mode != PerfCounterMode_Off) {
+#if SYSTEM_LINUX
+        PerfThreadCounters test;
+        if (!test.Open(mode, logs)) {
+            if (logs) {
+                logs->e.f("perf counters: not available\n");
+            }
+
+            return false;
+        }
+#else
+        if (logs) {
+            logs->e.f("perf counters: not supported on this platform\n");
+        }
+
+        return false;
+#endif
+    }
+
+    uint64_t state = g_perf_counters_state.load(std::memory_order_relaxed);
+    uint64_t new_state;
+    do {
+        new_state = ((state >> 32) + 1) << 32 | (uint32_t)mode;
+    } while (!g_perf_counters_state.compare_exchange_weak(state, new_state, std::memory_order_acq_rel));
+
+    ms_enabled.store(mode != PerfCounterMode_Off, std::memory_order_release);
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+PerfCounterMode PerfCounters::GetMode() {
+    return (PerfCounterMode)(uint32_t)g_perf_counters_state.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+const char *PerfCounters::GetCounterName(PerfCounterMode mode, size_t index) {
+    ASSERT(index < PERF_COUNTERS_NUM_COUNTERS);
+
+    if (mode == PerfCounterMode_Hardware) {
+        return PERF_COUNTER_HARDWARE_NAMES[index];
+    } else if (mode == PerfCounterMode_Software) {
+        return PERF_COUNTER_SOFTWARE_NAMES[index];
+    } else {
+        return nullptr;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool PerfCounters::ReadThreadCounters(PerfCounterValues *values) {
+#if SYSTEM_LINUX
+    uint64_t state = g_perf_counters_state.load(std::memory_order_acquire);
+    PerfCounterMode mode = (PerfCounterMode)(uint32_t)state;
+    PerfThreadCounters *counters = &t_perf_thread_counters;
+    if (mode == PerfCounterMode_Off) {
+        // Don't leave the fds open until the thread exits.
+        if (counters->state != state) {
+            counters->Close();
+            counters->state = state;
+        }
+
+        return false;
+    }
+
+    if (counters->state != state) {
+        counters->Open(mode, nullptr);
+        counters->state = state;
+    }
+
+    if (counters->group_fd < 0) {
+        return false;
+    }
+
+    // The number of counters, the enabled and running times, then each
+    // value.
+    uint64_t buf[3 + PERF_COUNTERS_NUM_COUNTERS];
+    ssize_t n = read(counters->group_fd, buf, sizeof buf);
+    if (n < (ssize_t)(3 * sizeof buf[0])) {
+        return false;
+    }
+
+    uint64_t num_read = std::min(buf[0], (uint64_t)((size_t)n / sizeof buf[0] - 3));
+    for (size_t i = 0; i < PERF_COUNTERS_NUM_COUNTERS; ++i) {
+        int index = counters->read_indexes[i];
+        if (index >= 0 && (uint64_t)index < num_read) {
+            values->values[i] = buf[3 + index];
+        } else {
+            values->values[i] = 0;
+        }
+    }
+
+    values->time_enabled = buf[1];
+    values->time_running = buf[2];
+
+    values->generation = (uint32_t)(state >> 32);
+
+    return true;
+#else
+    (void)values;
+
+    return false;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool PerfCounters::GetDeltas(const PerfCounterValues &begin, const PerfCounterValues &end, uint64_t *deltas) {
+    if (end.generation != begin.generation) {
+        return false;
+    }
+
+    uint64_t time_enabled = end.time_enabled - begin.time_enabled;
+    uint64_t time_running = end.time_running - begin.time_running;
+    if (time_running == 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < PERF_COUNTERS_NUM_COUNTERS; ++i) {
+        deltas[i] = end.values[i] - begin.values[i];
+
+        if (time_running < time_enabled) {
+            deltas[i] = (uint64_t)((double)deltas[i] * (double)time_enabled / (double)time_running);
+        }
+    }
+
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
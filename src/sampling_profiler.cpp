@@ -0,0 +1,664 @@
+#include <shared/system.h>
+#include <shared/sampling_profiler.h>
+#include <shared/metrics.h>
+#include <shared/mutex.h>
+#include <shared/debug.h>
+#include <shared/log.h>
+#include <shared/strings.h>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <inttypes.h>
+#include <string.h>
+
+#if SYSTEM_LINUX
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Not defined by older glibcs.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static const char NO_TIMER_NAME[] = "(no timer)";
+
+// Frames for the signal handler and the kernel's signal trampoline, at the
+// start of every backtrace.
+static constexpr size_t NUM_SIGNAL_HANDLER_FRAMES = 2;
+
+struct SamplingProfilerSample {
+    uint32_t num_timer_defs = 0;
+    uint32_t num_frames = 0;
+
+    // Innermost first.
+    const TimerDef *timer_defs[SAMPLING_PROFILER_MAX_NUM_TIMER_DEFS];
+    void *frames[SAMPLING_PROFILER_MAX_NUM_FRAMES];
+};
+
+// The buffer is a ring, written only by the thread's signal handler and
+// read only by Collect, so it needs no lock.
+struct SamplingProfilerThread {
+    std::atomic<uint64_t> write_index{0};
+    std::atomic<uint64_t> read_index{0};
+
+    // Written by the signal handler only.
+    std::atomic<uint64_t> num_dropped{0};
+
+    SamplingProfilerSample samples[SAMPLING_PROFILER_BUFFER_NUM_SAMPLES];
+
+    // controlled by SamplingProfilerGlobals::mutex.
+    uint64_t num_dropped_collected = 0;
+    bool exited = false;
+#if SYSTEM_LINUX
+    pid_t tid = 0;
+    pthread_t pthread{};
+    bool has_timer = false;
+    timer_t timer{};
+#endif
+};
+
+// Never freed, as registered threads may exit at any time, even after
+// global destruction.
+struct SamplingProfilerGlobals {
+    Mutex mutex;
+
+    // controlled by mutex.
+    std::vector<std::shared_ptr<SamplingProfilerThread>> threads;
+    SamplingProfilerOptions options;
+    bool running = false;
+    bool handler_installed = false;
+    SamplingProfile profile;
+};
+
+static SamplingProfilerGlobals *g_sampling_profiler;
+static std::once_flag g_sampling_profiler_once_flag;
+
+// Set once g_sampling_profiler exists, so that Collect, which every
+// MetricSet destructor calls, can skip creating it.
+static std::atomic<bool> g_sampling_profiler_created{false};
+
+// Copies of the corresponding SamplingProfilerGlobals state, for the signal
+// handler.
+static std::atomic<bool> g_sampling_profiler_running{false};
+static std::atomic<bool> g_sampling_profiler_backtraces{false};
+
+// Trivially constructible, so it's safe to access from the signal handler.
+static thread_local SamplingProfilerThread *t_sampling_profiler_thread;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static SamplingProfilerGlobals *GetSamplingProfilerGlobals() {
+    std::call_once(g_sampling_profiler_once_flag, []() {
+        g_sampling_profiler = new SamplingProfilerGlobals;
+        MUTEX_SET_NAME(g_sampling_profiler->mutex, "SamplingProfiler");
+        g_sampling_profiler_created.store(true, std::memory_order_release);
+    });
+
+    return g_sampling_profiler;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_LINUX
+static bool StartLockedThreadTimer(SamplingProfilerThread *thread, const SamplingProfilerOptions &options, const LogSet *logs) {
+    ASSERT(!thread->has_timer);
+    ASSERT(!thread->exited);
+
+    // Per-thread CPU time, so threads are sampled in proportion to the CPU
+    // they use, and idle threads aren't sampled at all.
+    clockid_t clock_id;
+    int rc = pthread_getcpuclockid(thread->pthread, &clock_id);
+    if (rc != 0) {
+        if (logs) {
+            logs->e.f("sampling profiler: pthread_getcpuclockid failed: %s\n", strerror(rc));
+        }
+
+        return false;
+    }
+
+    struct sigevent sev;
+    memset(&sev, 0, sizeof sev);
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGPROF;
+    sev.sigev_notify_thread_id = thread->tid;
+
+    if (timer_create(clock_id, &sev, &thread->timer) != 0) {
+        if (logs) {
+            logs->e.f("sampling profiler: timer_create failed: %s\n", strerror(errno));
+        }
+
+        return false;
+    }
+
+    uint64_t interval_ns = 1000000000 / options.frequency_hz;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+    spec.it_interval.tv_sec = (time_t)(interval_ns / 1000000000);
+    spec.it_interval.tv_nsec = (long)(interval_ns % 1000000000);
+    spec.it_value = spec.it_interval;
+
+    if (timer_settime(thread->timer, 0, &spec, nullptr) != 0) {
+        if (logs) {
+            logs->e.f("sampling profiler: timer_settime failed: %s\n", strerror(errno));
+        }
+
+        timer_delete(thread->timer);
+        return false;
+    }
+
+    thread->has_timer = true;
+    return true;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void DeleteLockedThreadTimer(SamplingProfilerThread *thread) {
+#if SYSTEM_LINUX
+    if (thread->has_timer) {
+        timer_delete(thread->timer);
+        thread->has_timer = false;
+    }
+#else
+    (void)thread;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Unregisters the thread when it exits.
+struct SamplingProfilerThreadRegistration {
+    std::shared_ptr<SamplingProfilerThread> thread;
+
+    ~SamplingProfilerThreadRegistration() {
+        if (!this->thread) {
+            return;
+        }
+
+        // Any signal from here on finds nothing to do.
+        t_sampling_profiler_thread = nullptr;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+        LockGuard<Mutex> lock(globals->mutex);
+
+        DeleteLockedThreadTimer(this->thread.get());
+        this->thread->exited = true;
+    }
+};
+
+static thread_local SamplingProfilerThreadRegistration t_sampling_profiler_registration;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_LINUX
+// Function name if there's a symbol for it, or module+offset if not.
+static std::string GetFrameName(void *address) {
+    Dl_info info;
+    if (dladdr(address, &info) == 0) {
+        return strprintf("%p", address);
+    }
+
+    if (info.dli_sname) {
+        int status;
+        char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        if (demangled) {
+            std::string name = demangled;
+            free(demangled);
+            return name;
+        }
+
+        return info.dli_sname;
+    }
+
+    const char *module_name = info.dli_fname ? info.dli_fname : "?";
+    if (const char *slash = strrchr(module_name, '/')) {
+        module_name = slash + 1;
+    }
+
+    return strprintf("%s+0x%" PRIxPTR, module_name, (uintptr_t)address - (uintptr_t)info.dli_fbase);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Semicolons separate the frames in collapsed stacks.
+static std::string GetCollapsedFrameName(const std::string &name) {
+    std::string result = name;
+    std::replace(result.begin(), result.end(), ';', ':');
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool SamplingProfileStack::operator<(const SamplingProfileStack &other) const {
+    if (this->timer_defs != other.timer_defs) {
+        return this->timer_defs < other.timer_defs;
+    } else {
+        return this->frames < other.frames;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::string GetSamplingProfileCollapsedStacks(const SamplingProfile &profile) {
+    std::string result;
+
+    for (const auto &it : profile.stacks) {
+        const char *separator = "";
+
+        for (const std::string &name : it.first.timer_defs) {
+            result += separator;
+            result += GetCollapsedFrameName(name);
+            separator = ";";
+        }
+
+        for (const std::string &name : it.first.frames) {
+            result += separator;
+            result += GetCollapsedFrameName(name);
+            separator = ";";
+        }
+
+        result += strprintf(" %" PRIu64 "\n", it.second);
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::string GetSamplingProfileReport(const SamplingProfile &profile) {
+    struct Row {
+        std::string name;
+        uint64_t total = 0;
+        uint64_t self = 0;
+    };
+
+    std::map<std::string, Row> rows_by_name;
+
+    for (const auto &it : profile.stacks) {
+        const std::vector<std::string> &timer_defs = it.first.timer_defs;
+
+        for (size_t i = 0; i < timer_defs.size(); ++i) {
+            Row *row = &rows_by_name[timer_defs[i]];
+            row->name = timer_defs[i];
+
+            // A recursive TimerDef only counts once.
+            auto end = timer_defs.begin() + (ptrdiff_t)i;
+            if (std::find(timer_defs.begin(), end, timer_defs[i]) == end) {
+                row->total += it.second;
+            }
+
+            if (i == timer_defs.size() - 1) {
+                row->self += it.second;
+            }
+        }
+    }
+
+    std::vector<Row> rows;
+    for (auto &it : rows_by_name) {
+        rows.push_back(std::move(it.second));
+    }
+
+    std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+        if (a.self != b.self) {
+            return a.self > b.self;
+        } else {
+            return a.name < b.name;
+        }
+    });
+
+    double scale = profile.num_samples > 0 ? 100. / (double)profile.num_samples : 0.;
+
+    std::string result = strprintf("%" PRIu64 " samples (%" PRIu64 " dropped)\n", profile.num_samples, profile.num_dropped_samples);
+    result += strprintf("%10s %7s %10s %7s  %s\n", "self", "self%", "total", "total%", "timer");
+    for (const Row &row : rows) {
+        result += strprintf("%10" PRIu64 " %6.2f%% %10" PRIu64 " %6.2f%%  %s\n", row.self, (double)row.self * scale, row.total, (double)row.total * scale, row.name.c_str());
+    }
+
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool SamplingProfiler::Start(const SamplingProfilerOptions &options, const LogSet *logs) {
+#if SYSTEM_LINUX
+    if (options.frequency_hz == 0) {
+        if (logs) {
+            logs->e.f("sampling profiler: frequency must be at least 1 Hz\n");
+        }
+
+        return false;
+    }
+
+    SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+    LockGuard<Mutex> lock(globals->mutex);
+
+    if (globals->running) {
+        if (logs) {
+            logs->e.f("sampling profiler: already running\n");
+        }
+
+        return false;
+    }
+
+    if (!globals->handler_installed) {
+        // The first backtrace call loads the unwinder, which isn't safe to do
+        // in the signal handler.
+        void *frame;
+        backtrace(&frame, 1);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = &SignalHandler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        if (sigaction(SIGPROF, &sa, nullptr) != 0) {
+            if (logs) {
+                logs->e.f("sampling profiler: sigaction failed: %s\n", strerror(errno));
+            }
+
+            return false;
+        }
+
+        globals->handler_installed = true;
+    }
+
+    globals->options = options;
+    globals->running = true;
+    g_sampling_profiler_backtraces.store(options.backtraces, std::memory_order_relaxed);
+    g_sampling_profiler_running.store(true, std::memory_order_release);
+
+    for (const std::shared_ptr<SamplingProfilerThread> &thread : globals->threads) {
+        if (!thread->exited) {
+            StartLockedThreadTimer(thread.get(), globals->options, logs);
+        }
+    }
+
+    return true;
+#else
+    (void)options;
+
+    if (logs) {
+        logs->e.f("sampling profiler: not supported on this platform\n");
+    }
+
+    return false;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SamplingProfiler::Stop() {
+    {
+        SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+        LockGuard<Mutex> lock(globals->mutex);
+
+        if (!globals->running) {
+            return;
+        }
+
+        globals->running = false;
+        g_sampling_profiler_running.store(false, std::memory_order_release);
+
+        for (const std::shared_ptr<SamplingProfilerThread> &thread : globals->threads) {
+            DeleteLockedThreadTimer(thread.get());
+        }
+    }
+
+    Collect();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool SamplingProfiler::IsRunning() {
+    return g_sampling_profiler_running.load(std::memory_order_acquire);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SamplingProfiler::RegisterThread() {
+    if (t_sampling_profiler_thread) {
+        return;
+    }
+
+    auto thread = std::make_shared<SamplingProfilerThread>();
+#if SYSTEM_LINUX
+    thread->tid = (pid_t)syscall(SYS_gettid);
+    thread->pthread = pthread_self();
+#endif
+
+    SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+    LockGuard<Mutex> lock(globals->mutex);
+
+    globals->threads.push_back(thread);
+    t_sampling_profiler_registration.thread = thread;
+
+    // Before the timer starts.
+    t_sampling_profiler_thread = thread.get();
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+
+#if SYSTEM_LINUX
+    if (globals->running) {
+        StartLockedThreadTimer(thread.get(), globals->options, nullptr);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SamplingProfiler::Collect() {
+    if (!g_sampling_profiler_created.load(std::memory_order_acquire)) {
+        // No threads, so no samples.
+        return;
+    }
+
+    SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+
+    std::vector<SamplingProfilerSample> samples;
+    uint64_t num_dropped = 0;
+
+    // The TimerDef names are found with the lock held: a MetricSet being
+    // destroyed calls Collect first, so this way its TimerDefs stay valid
+    // for as long as any samples that refer to them are being looked at.
+    std::unordered_map<const TimerDef *, std::string> timer_def_names;
+
+    {
+        LockGuard<Mutex> lock(globals->mutex);
+
+        for (const std::shared_ptr<SamplingProfilerThread> &thread : globals->threads) {
+            uint64_t read_index = thread->read_index.load(std::memory_order_relaxed);
+            uint64_t write_index = thread->write_index.load(std::memory_order_acquire);
+
+            for (uint64_t i = read_index; i < write_index; ++i) {
+                const SamplingProfilerSample *sample = &thread->samples[i % SAMPLING_PROFILER_BUFFER_NUM_SAMPLES];
+
+                for (uint32_t j = 0; j < sample->num_timer_defs; ++j) {
+                    const TimerDef *def = sample->timer_defs[j];
+                    if (timer_def_names.count(def) == 0) {
+                        timer_def_names[def] = GetTimerDefName(def);
+                    }
+                }
+
+                samples.push_back(*sample);
+            }
+
+            // The handler may reuse the slots from now on.
+            thread->read_index.store(write_index, std::memory_order_release);
+
+            uint64_t thread_num_dropped = thread->num_dropped.load(std::memory_order_relaxed);
+            num_dropped += thread_num_dropped - thread->num_dropped_collected;
+            thread->num_dropped_collected = thread_num_dropped;
+        }
+
+        // Exited threads can't add any more samples.
+        globals->threads.erase(std::remove_if(globals->threads.begin(), globals->threads.end(), [](const std::shared_ptr<SamplingProfilerThread> &thread) {
+                                   return thread->exited;
+                               }),
+                               globals->threads.end());
+    }
+
+    // Get the frame names without the lock held, as the symbol lookups
+    // could take a while.
+    std::unordered_map<void *, std::string> frame_names;
+    std::map<SamplingProfileStack, uint64_t> stacks;
+    SamplingProfileStack stack;
+
+    for (const SamplingProfilerSample &sample : samples) {
+        stack.timer_defs.clear();
+        stack.frames.clear();
+
+        if (sample.num_timer_defs == 0) {
+            stack.timer_defs.push_back(NO_TIMER_NAME);
+        } else {
+            for (uint32_t i = sample.num_timer_defs; i > 0; --i) {
+                stack.timer_defs.push_back(timer_def_names[sample.timer_defs[i - 1]]);
+            }
+        }
+
+#if SYSTEM_LINUX
+        for (uint32_t i = sample.num_frames; i > NUM_SIGNAL_HANDLER_FRAMES; --i) {
+            void *address = sample.frames[i - 1];
+
+            // The rest are return addresses, which could be just past the
+            // end of the calling function.
+            if (i - 1 > NUM_SIGNAL_HANDLER_FRAMES) {
+                address = (char *)address - 1;
+            }
+
+            auto it = frame_names.find(address);
+            if (it == frame_names.end()) {
+                it = frame_names.insert({address, GetFrameName(address)}).first;
+            }
+
+            stack.frames.push_back(it->second);
+        }
+#endif
+
+        ++stacks[stack];
+    }
+
+    LockGuard<Mutex> lock(globals->mutex);
+
+    for (auto &it : stacks) {
+        globals->profile.stacks[it.first] += it.second;
+    }
+
+    globals->profile.num_samples += samples.size();
+    globals->profile.num_dropped_samples += num_dropped;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+SamplingProfile SamplingProfiler::GetProfile() {
+    SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+    LockGuard<Mutex> lock(globals->mutex);
+
+    return globals->profile;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void SamplingProfiler::ResetProfile() {
+    SamplingProfilerGlobals *globals = GetSamplingProfilerGlobals();
+    LockGuard<Mutex> lock(globals->mutex);
+
+    globals->profile = SamplingProfile();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+size_t SamplingProfiler::GetTimerDefStack(const TimerDef **defs, size_t max_num_defs) {
+    size_t num_defs = 0;
+
+    for (const Timer *timer = Timer::ms_current; timer && num_defs < max_num_defs; timer = timer->m_outer) {
+        defs[num_defs++] = timer->m_def;
+    }
+
+    return num_defs;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::string SamplingProfiler::GetTimerDefName(const TimerDef *def) {
+    std::string set_name;
+    if (def->m_set) {
+        set_name = def->m_set->GetName();
+    }
+
+    return set_name + "/" + def->name;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Must be async signal safe.
+void SamplingProfiler::SignalHandler(int signum) {
+    (void)signum;
+
+    int old_errno = errno;
+
+    SamplingProfilerThread *thread = t_sampling_profiler_thread;
+    if (thread && g_sampling_profiler_running.load(std::memory_order_acquire)) {
+        uint64_t write_index = thread->write_index.load(std::memory_order_relaxed);
+        uint64_t read_index = thread->read_index.load(std::memory_order_acquire);
+
+        if (write_index - read_index >= SAMPLING_PROFILER_BUFFER_NUM_SAMPLES) {
+            thread->num_dropped.store(thread->num_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        } else {
+            SamplingProfilerSample *sample = &thread->samples[write_index % SAMPLING_PROFILER_BUFFER_NUM_SAMPLES];
+
+            sample->num_timer_defs = (uint32_t)GetTimerDefStack(sample->timer_defs, SAMPLING_PROFILER_MAX_NUM_TIMER_DEFS);
+
+            sample->num_frames = 0;
+#if SYSTEM_LINUX
+            if (g_sampling_profiler_backtraces.load(std::memory_order_relaxed)) {
+                int num_frames = backtrace(sample->frames, (int)SAMPLING_PROFILER_MAX_NUM_FRAMES);
+                if (num_frames > 0) {
+                    sample->num_frames = (uint32_t)num_frames;
+                }
+            }
+#endif
+
+            thread->write_index.store(write_index + 1, std::memory_order_release);
+        }
+    }
+
+    errno = old_errno;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
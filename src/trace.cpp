@@ -0,0 +1,317 @@
+#include <shared/system.h>
+#include <shared/trace.h>
+#include <shared/debug.h>
+#include <shared/mutex.h>
+#include <shared/file_io.h>
+#include <shared/strings.h>
+#include <shared/lockfree.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <inttypes.h>
+
+#include <shared/enum_def.h>
+#include <shared/trace.inl>
+#include <shared/enum_end.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static_assert((TRACE_BUFFER_NUM_EVENTS & (TRACE_BUFFER_NUM_EVENTS - 1)) == 0);
+
+// Each field is atomic, so that the buffer can be read while the owning
+// thread is writing to it. The reader discards any events that might have
+// been overwritten while it was reading them.
+struct TraceEventSlot {
+    std::atomic<uint64_t> ticks{0};
+    std::atomic<uint64_t> duration_ticks{0};
+    std::atomic<uint32_t> category_id{0};
+    std::atomic<uint32_t> name_id{0};
+    std::atomic<uint32_t> thread_id{0};
+    std::atomic<uint8_t> type{0};
+};
+
+struct TraceEvent {
+    uint64_t ticks = 0;
+    uint64_t duration_ticks = 0;
+    uint32_t category_id = 0;
+    uint32_t name_id = 0;
+    uint32_t thread_id = 0;
+    TraceEventType type = TraceEventType_Instant;
+};
+
+// Buffers are never freed. When a thread exits, its buffer is up for grabs
+// by the next new thread; the events stay put until overwritten, and each
+// one records its own thread ID.
+struct TraceThreadBuffer {
+    // Never changes once the buffer is in the list.
+    TraceThreadBuffer *next = nullptr;
+
+    std::atomic<bool> in_use{true};
+
+    // Only the owning thread writes this.
+    std::atomic<uint64_t> write_index{0};
+
+    // Events before this one have been cleared. Any thread can write this,
+    // via ClearTraceEvents, and readers (ReadRingBufferSlots, on whichever
+    // thread is getting the events) read it. The owning thread never
+    // touches it.
+    std::atomic<uint64_t> clear_index{0};
+
+    TraceEventSlot slots[TRACE_BUFFER_NUM_EVENTS];
+};
+
+struct TraceThreadState {
+    TraceThreadBuffer *buffer = nullptr;
+    uint32_t thread_id = 0;
+
+    ~TraceThreadState();
+};
+
+struct TraceNames {
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> id_by_name;
+
+    // index is ID. Entry 0 is a dummy.
+    std::vector<std::string> names;
+};
+
+static std::atomic<TraceThreadBuffer *> g_trace_buffers_head{nullptr};
+static std::atomic<uint32_t> g_next_trace_thread_id{1};
+static thread_local TraceThreadState t_trace_thread_state;
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+TraceThreadState::~TraceThreadState() {
+    if (this->buffer) {
+        this->buffer->in_use.store(false, std::memory_order_release);
+        this->buffer = nullptr;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// never freed, as events may be added during global destruction.
+static TraceNames *GetTraceNames() {
+    static TraceNames *names = new TraceNames;
+    return names;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static TraceThreadBuffer *GetTraceThreadBuffer() {
+    TraceThreadState *state = &t_trace_thread_state;
+    if (state->buffer) {
+        return state->buffer;
+    }
+
+    state->thread_id = g_next_trace_thread_id.fetch_add(1, std::memory_order_relaxed);
+
+    for (TraceThreadBuffer *buffer = g_trace_buffers_head.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        bool in_use = false;
+        if (buffer->in_use.compare_exchange_strong(in_use, true, std::memory_order_acq_rel)) {
+            state->buffer = buffer;
+            return buffer;
+        }
+    }
+
+    auto buffer = new TraceThreadBuffer;
+
+    TraceThreadBuffer *head = g_trace_buffers_head.load(std::memory_order_relaxed);
+    do {
+        buffer->next = head;
+    } while (!g_trace_buffers_head.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+
+    state->buffer = buffer;
+    return buffer;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+uint32_t GetTraceNameID(const std::string &name) {
+    TraceNames *names = GetTraceNames();
+    LockGuard<std::mutex> lock(names->mutex);
+
+    if (names->names.empty()) {
+        names->names.emplace_back();
+    }
+
+    auto it = names->id_by_name.find(name);
+    if (it != names->id_by_name.end()) {
+        return it->second;
+    }
+
+    auto id = (uint32_t)names->names.size();
+    names->names.push_back(name);
+    names->id_by_name[name] = id;
+
+    return id;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+std::string GetTraceName(uint32_t name_id) {
+    TraceNames *names = GetTraceNames();
+    LockGuard<std::mutex> lock(names->mutex);
+
+    if (name_id == 0 || name_id >= names->names.size()) {
+        return std::string();
+    }
+
+    return names->names[name_id];
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void AddTraceEvent(TraceEventType type, uint32_t category_id, uint32_t name_id, uint64_t ticks, uint64_t duration_ticks) {
+    TraceThreadBuffer *buffer = GetTraceThreadBuffer();
+    uint32_t thread_id = t_trace_thread_state.thread_id;
+
+    WriteRingBufferSlot(buffer, [=](TraceEventSlot *slot) {
+        slot->ticks.store(ticks, std::memory_order_relaxed);
+        slot->duration_ticks.store(duration_ticks, std::memory_order_relaxed);
+        slot->category_id.store(category_id, std::memory_order_relaxed);
+        slot->name_id.store(name_id, std::memory_order_relaxed);
+        slot->thread_id.store(thread_id, std::memory_order_relaxed);
+        slot->type.store(type, std::memory_order_relaxed);
+    });
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+void ClearTraceEvents() {
+    for (TraceThreadBuffer *buffer = g_trace_buffers_head.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        buffer->clear_index.store(buffer->write_index.load(std::memory_order_acquire), std::memory_order_release);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void GetTraceEvents(std::vector<TraceEvent> *events, const TraceThreadBuffer *buffer) {
+    size_t first = events->size();
+
+    uint64_t num_overwritten = ReadRingBufferSlots(buffer, [events](const TraceEventSlot *slot) {
+        TraceEvent event;
+        event.ticks = slot->ticks.load(std::memory_order_relaxed);
+        event.duration_ticks = slot->duration_ticks.load(std::memory_order_relaxed);
+        event.category_id = slot->category_id.load(std::memory_order_relaxed);
+        event.name_id = slot->name_id.load(std::memory_order_relaxed);
+        event.thread_id = slot->thread_id.load(std::memory_order_relaxed);
+        event.type = (TraceEventType)slot->type.load(std::memory_order_relaxed);
+        events->push_back(event);
+    });
+
+    // Anything overwritten in the meantime is suspect.
+    events->erase(events->begin() + (ptrdiff_t)first, events->begin() + (ptrdiff_t)(first + num_overwritten));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void AppendJSONString(std::string *json, const std::string &str) {
+    json->push_back('"');
+
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            json->push_back('\\');
+            json->push_back(c);
+        } else if ((unsigned char)c < 32) {
+            *json += strprintf("\\u%04x", (unsigned char)c);
+        } else {
+            json->push_back(c);
+        }
+    }
+
+    json->push_back('"');
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static const char TRACE_EVENT_PHASES[] = {
+    'B', // TraceEventType_Begin
+    'E', // TraceEventType_End
+    'X', // TraceEventType_Complete
+    'i', // TraceEventType_Instant
+};
+
+void GetChromeTraceJSON(std::string *json) {
+    std::vector<TraceEvent> events;
+    for (TraceThreadBuffer *buffer = g_trace_buffers_head.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+        GetTraceEvents(&events, buffer);
+    }
+
+    std::vector<std::string> names;
+    {
+        TraceNames *trace_names = GetTraceNames();
+        LockGuard<std::mutex> lock(trace_names->mutex);
+        names = trace_names->names;
+    }
+
+    // Times are relative to the first event, to keep the numbers
+    // manageable.
+    uint64_t base_ticks = UINT64_MAX;
+    for (const TraceEvent &event : events) {
+        base_ticks = std::min(base_ticks, event.ticks);
+    }
+
+    json->clear();
+    *json += "{\"traceEvents\":[";
+
+    for (size_t i = 0; i < events.size(); ++i) {
+        const TraceEvent &event = events[i];
+
+        if (i > 0) {
+            json->push_back(',');
+        }
+
+        *json += "\n{\"ph\":\"";
+        if (event.type < sizeof TRACE_EVENT_PHASES) {
+            json->push_back(TRACE_EVENT_PHASES[event.type]);
+        } else {
+            json->push_back('i');
+        }
+        json->push_back('"');
+
+        *json += ",\"cat\":";
+        AppendJSONString(json, event.category_id < names.size() ? names[event.category_id] : std::string());
+
+        *json += ",\"name\":";
+        AppendJSONString(json, event.name_id < names.size() ? names[event.name_id] : std::string());
+
+        *json += strprintf(",\"pid\":0,\"tid\":%" PRIu32 ",\"ts\":%.3f", event.thread_id, GetSecondsFromTicks(event.ticks - base_ticks) * 1e6);
+
+        if (event.type == TraceEventType_Complete) {
+            *json += strprintf(",\"dur\":%.3f", GetSecondsFromTicks(event.duration_ticks) * 1e6);
+        } else if (event.type == TraceEventType_Instant) {
+            *json += ",\"s\":\"t\"";
+        }
+
+        json->push_back('}');
+    }
+
+    *json += "\n]}\n";
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+bool SaveChromeTraceJSON(const std::string &path, const LogSet *logs) {
+    std::string json;
+    GetChromeTraceJSON(&json);
+
+    return SaveTextFile(json, path, logs);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
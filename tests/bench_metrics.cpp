@@ -0,0 +1,223 @@
+#include <shared/system.h>
+#include <shared/metrics.h>
+#include <shared/CommandLineParser.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <inttypes.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// TimerDef throughput with N threads all timing into the same TimerDef:
+//
+// - add_ticks: TimerDef::AddTicks
+// - timer: a Timer scope, so AddTicks plus reading the clock twice
+// - two_atomics: a pair of shared fetch_adds, which is how TimerDef used to
+//   work, for comparison
+//
+// With --monitor, another thread continually reads the totals, as the
+// MetricsSampler or OpenMetrics exporter would.
+//
+// Use --format csv to get output that can be compared across commits. The
+// results are only really meaningful on a machine with at least as many
+// cores as threads.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct Options {
+    int duration_ms = 500;
+    int max_num_threads = 0;
+    bool monitor = false;
+    std::string format = "text";
+};
+
+struct BenchmarkResult {
+    std::string benchmark;
+    int num_threads = 0;
+    uint64_t num_ops = 0;
+    double seconds = 0.;
+};
+
+struct TwoAtomics {
+    std::atomic<uint64_t> total_num_ticks{0};
+    std::atomic<uint64_t> num_samples{0};
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static std::vector<int> GetThreadCounts(const Options &options) {
+    std::vector<int> counts = {1, 2, 4, 8, (int)std::thread::hardware_concurrency()};
+
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [&options](int count) {
+                     return count < 1 || (options.max_num_threads > 0 && count > options.max_num_threads);
+                 }),
+                 counts.end());
+
+    return counts;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// op_fn is called repeatedly on each thread until the time is up.
+// monitor_fn, if the monitor option is set, is likewise called repeatedly
+// on its own thread.
+template <class OpFn, class MonitorFn>
+static void RunBenchmark(const char *name, const Options &options, OpFn &&op_fn, MonitorFn &&monitor_fn, std::vector<BenchmarkResult> *results) {
+    for (int num_threads : GetThreadCounts(options)) {
+        std::atomic<bool> stop{false};
+        std::atomic<uint64_t> total_num_ops{0};
+        std::vector<std::thread> threads;
+
+        uint64_t start_ticks = GetCurrentTickCount();
+
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&op_fn, &stop, &total_num_ops]() {
+                uint64_t num_ops = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    op_fn();
+                    ++num_ops;
+                }
+
+                total_num_ops.fetch_add(num_ops, std::memory_order_relaxed);
+            });
+        }
+
+        if (options.monitor) {
+            threads.emplace_back([&monitor_fn, &stop]() {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    monitor_fn();
+                }
+            });
+        }
+
+        SleepMS((unsigned)options.duration_ms);
+        stop.store(true, std::memory_order_relaxed);
+
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        results->push_back({std::string(name) + (options.monitor ? "_monitored" : ""), num_threads, total_num_ops.load(std::memory_order_relaxed), GetSecondsFromTicks(GetCurrentTickCount() - start_ticks)});
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static double GetNSPerOp(const BenchmarkResult &result) {
+    if (result.num_ops == 0) {
+        return 0.;
+    }
+
+    return result.seconds * 1e9 / (double)result.num_ops;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static double GetOpsPerSecond(const BenchmarkResult &result) {
+    if (result.seconds <= 0.) {
+        return 0.;
+    }
+
+    return (double)result.num_ops / result.seconds;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void PrintText(const std::vector<BenchmarkResult> &results) {
+    printf("%u hardware threads\n", std::thread::hardware_concurrency());
+    printf("%-24s %8s %12s %16s\n", "benchmark", "threads", "ns/op", "ops/sec");
+    for (const BenchmarkResult &result : results) {
+        printf("%-24s %8d %12.2f %16.0f\n", result.benchmark.c_str(), result.num_threads, GetNSPerOp(result), GetOpsPerSecond(result));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void PrintCSV(const std::vector<BenchmarkResult> &results) {
+    printf("hardware_threads,benchmark,threads,ops,seconds,ns_per_op,ops_per_sec\n");
+    for (const BenchmarkResult &result : results) {
+        printf("%u,%s,%d,%" PRIu64 ",%.6f,%.3f,%.0f\n", std::thread::hardware_concurrency(), result.benchmark.c_str(), result.num_threads, result.num_ops, result.seconds, GetNSPerOp(result), GetOpsPerSecond(result));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[]) {
+    Options options;
+
+    CommandLineParser p("TimerDef throughput benchmarks");
+    p.AddHelpOption();
+    p.AddOption('d', "duration").Arg(&options.duration_ms).Help("duration of each run in ms").ShowDefault().Meta("MS");
+    p.AddOption('t', "max-threads").Arg(&options.max_num_threads).Help("skip runs with more than this many threads (0 = no limit)").ShowDefault().Meta("N");
+    p.AddOption('m', "monitor").SetIfPresent(&options.monitor).Help("continually read the totals during each run");
+    p.AddOption('f', "format").Arg(&options.format).Help("output format: text or csv").ShowDefault().Meta("FORMAT");
+
+    if (!p.Parse(argc, argv)) {
+        return 1;
+    }
+
+    if (options.duration_ms < 1) {
+        fprintf(stderr, "FATAL: duration must be at least 1\n");
+        return 1;
+    }
+
+    if (options.format != "text" && options.format != "csv") {
+        fprintf(stderr, "FATAL: unknown format: %s\n", options.format.c_str());
+        return 1;
+    }
+
+    std::shared_ptr<MetricSet> set = MetricSet::Create("bench_metrics");
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+    TwoAtomics two_atomics;
+
+    auto read_def = [def]() {
+        TimerDefTotals totals = def->GetTotals();
+        (void)totals;
+    };
+
+    std::vector<BenchmarkResult> results;
+
+    RunBenchmark(
+        "add_ticks", options, [def]() {
+            def->AddTicks(1);
+        },
+        read_def, &results);
+
+    RunBenchmark(
+        "timer", options, [def]() {
+            Timer timer(def);
+        },
+        read_def, &results);
+
+    RunBenchmark(
+        "two_atomics", options, [&two_atomics]() {
+            two_atomics.total_num_ticks.fetch_add(1, std::memory_order_acq_rel);
+            two_atomics.num_samples.fetch_add(1, std::memory_order_acq_rel);
+        },
+        [&two_atomics]() {
+            uint64_t total_num_ticks = two_atomics.total_num_ticks.load(std::memory_order_acquire);
+            uint64_t num_samples = two_atomics.num_samples.load(std::memory_order_acquire);
+            (void)total_num_ticks, (void)num_samples;
+        },
+        &results);
+
+    if (options.format == "csv") {
+        PrintCSV(results);
+    } else {
+        PrintText(results);
+    }
+}
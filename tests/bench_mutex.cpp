@@ -0,0 +1,332 @@
+#include <shared/system.h>
+#include <shared/mutex.h>
+#include <shared/CommandLineParser.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <inttypes.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Lock overhead benchmarks, for each mutex backend:
+//
+// - lock_unlock: uncontended lock+unlock on one thread
+// - try_lock: uncontended try_lock+unlock on one thread
+// - contended: lock throughput with N threads hammering one mutex,
+//   optionally with another thread continually fetching all the mutex
+//   details, as a monitoring UI would
+//
+// Use --format csv or --format json to get output that can be compared
+// across commits. The contended results are only really meaningful on a
+// machine with at least as many cores as threads.
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+struct Options {
+    int num_iterations = 10000000;
+    int duration_ms = 500;
+    int max_num_threads = 0;
+    bool monitor = false;
+    std::string format = "text";
+    std::vector<std::string> backends;
+};
+
+struct BenchmarkResult {
+    std::string backend;
+    std::string benchmark;
+    int num_threads = 0;
+    uint64_t num_ops = 0;
+    double seconds = 0.;
+};
+
+struct Backend {
+    const char *name;
+    void (*run_fn)(const char *name, const Options &options, std::vector<BenchmarkResult> *results);
+
+    // Optional. Set up any global state the backend needs, and put it back
+    // afterwards.
+    void (*begin_fn)();
+    void (*end_fn)();
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static std::vector<int> GetContendedThreadCounts(const Options &options) {
+    std::vector<int> counts = {2, 4, 8, (int)std::thread::hardware_concurrency()};
+
+    std::sort(counts.begin(), counts.end());
+    counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+
+    counts.erase(std::remove_if(counts.begin(), counts.end(), [&options](int count) {
+                     return count < 2 || (options.max_num_threads > 0 && count > options.max_num_threads);
+                 }),
+                 counts.end());
+
+    return counts;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void MonitorMutexes(const std::atomic<bool> *stop) {
+    while (!stop->load(std::memory_order_relaxed)) {
+#if MUTEX_DEBUGGING
+        std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> snapshot = Mutex::GetAllMetadataSnapshot();
+        for (const std::shared_ptr<MutexMetadata> &metadata : *snapshot) {
+            MutexDetails details;
+            metadata->GetDetails(&details);
+        }
+#else
+        std::this_thread::yield();
+#endif
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+template <class MutexType>
+static void RunBenchmarks(const char *name, const Options &options, std::vector<BenchmarkResult> *results) {
+    const uint64_t num_iterations = (uint64_t)options.num_iterations;
+
+    {
+        MutexType mutex;
+
+        uint64_t start_ticks = GetCurrentTickCount();
+        for (uint64_t i = 0; i < num_iterations; ++i) {
+            mutex.lock();
+            mutex.unlock();
+        }
+
+        results->push_back({name, "lock_unlock", 1, num_iterations, GetSecondsFromTicks(GetCurrentTickCount() - start_ticks)});
+    }
+
+    {
+        MutexType mutex;
+
+        uint64_t start_ticks = GetCurrentTickCount();
+        for (uint64_t i = 0; i < num_iterations; ++i) {
+            if (mutex.try_lock()) {
+                mutex.unlock();
+            }
+        }
+
+        results->push_back({name, "try_lock", 1, num_iterations, GetSecondsFromTicks(GetCurrentTickCount() - start_ticks)});
+    }
+
+    for (int num_threads : GetContendedThreadCounts(options)) {
+        MutexType mutex;
+        std::atomic<bool> stop{false};
+        std::atomic<uint64_t> total_num_locks{0};
+        std::vector<std::thread> threads;
+
+        uint64_t start_ticks = GetCurrentTickCount();
+
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&mutex, &stop, &total_num_locks]() {
+                uint64_t num_locks = 0;
+                while (!stop.load(std::memory_order_relaxed)) {
+                    LockGuard<MutexType> lock(mutex);
+                    ++num_locks;
+                }
+
+                total_num_locks.fetch_add(num_locks, std::memory_order_relaxed);
+            });
+        }
+
+        if (options.monitor) {
+            threads.emplace_back(&MonitorMutexes, &stop);
+        }
+
+        SleepMS((unsigned)options.duration_ms);
+        stop.store(true, std::memory_order_relaxed);
+
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        results->push_back({name, options.monitor ? "contended_monitored" : "contended", num_threads, total_num_locks.load(std::memory_order_relaxed), GetSecondsFromTicks(GetCurrentTickCount() - start_ticks)});
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if MUTEX_DEBUGGING
+
+static void BeginAssumeFree() {
+    Mutex::SetAssumeFreeUncontendedLocks(true);
+}
+
+static void EndAssumeFree() {
+    Mutex::SetAssumeFreeUncontendedLocks(false);
+}
+
+static uint32_t g_old_lock_timing_sample_rate;
+
+static void BeginSampledTiming() {
+    g_old_lock_timing_sample_rate = Mutex::GetLockTimingSampleRate();
+    Mutex::SetLockTimingSampleRate(16);
+}
+
+static void EndSampledTiming() {
+    Mutex::SetLockTimingSampleRate(g_old_lock_timing_sample_rate);
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// (Without MUTEX_DEBUGGING, Mutex is std::mutex, so there's no separate
+// entry for it.)
+static const Backend BACKENDS[] = {
+    {"std::mutex", &RunBenchmarks<std::mutex>, nullptr, nullptr},
+#if MUTEX_DEBUGGING
+    {"Mutex", &RunBenchmarks<Mutex>, nullptr, nullptr},
+    {"Mutex/assume_free", &RunBenchmarks<Mutex>, &BeginAssumeFree, &EndAssumeFree},
+    {"Mutex/sampled_timing", &RunBenchmarks<Mutex>, &BeginSampledTiming, &EndSampledTiming},
+#endif
+    {"SharedMutex", &RunBenchmarks<SharedMutex>, nullptr, nullptr},
+    {"TicketMutex", &RunBenchmarks<TicketMutex>, nullptr, nullptr},
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static double GetNSPerOp(const BenchmarkResult &result) {
+    if (result.num_ops == 0) {
+        return 0.;
+    }
+
+    return result.seconds * 1e9 / (double)result.num_ops;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static double GetOpsPerSecond(const BenchmarkResult &result) {
+    if (result.seconds <= 0.) {
+        return 0.;
+    }
+
+    return (double)result.num_ops / result.seconds;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void PrintText(const std::vector<BenchmarkResult> &results) {
+    printf("MUTEX_DEBUGGING=%d, %u hardware threads\n", MUTEX_DEBUGGING, std::thread::hardware_concurrency());
+    printf("%-24s %-20s %8s %12s %16s\n", "backend", "benchmark", "threads", "ns/op", "ops/sec");
+
+    for (const BenchmarkResult &result : results) {
+        printf("%-24s %-20s %8d %12.2f %16.0f\n", result.backend.c_str(), result.benchmark.c_str(), result.num_threads, GetNSPerOp(result), GetOpsPerSecond(result));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void PrintCSV(const std::vector<BenchmarkResult> &results) {
+    printf("mutex_debugging,hardware_threads,backend,benchmark,threads,ops,seconds,ns_per_op,ops_per_sec\n");
+
+    for (const BenchmarkResult &result : results) {
+        printf("%d,%u,%s,%s,%d,%" PRIu64 ",%.6f,%.3f,%.0f\n", MUTEX_DEBUGGING, std::thread::hardware_concurrency(), result.backend.c_str(), result.benchmark.c_str(), result.num_threads, result.num_ops, result.seconds, GetNSPerOp(result), GetOpsPerSecond(result));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The strings are all known to need no escaping.
+static void PrintJSON(const std::vector<BenchmarkResult> &results) {
+    printf("{\n");
+    printf("  \"mutex_debugging\": %d,\n", MUTEX_DEBUGGING);
+    printf("  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+    printf("  \"results\": [");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &result = results[i];
+
+        printf("%s\n    {\"backend\": \"%s\", \"benchmark\": \"%s\", \"threads\": %d, \"ops\": %" PRIu64 ", \"seconds\": %.6f, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f}", i == 0 ? "" : ",", result.backend.c_str(), result.benchmark.c_str(), result.num_threads, result.num_ops, result.seconds, GetNSPerOp(result), GetOpsPerSecond(result));
+    }
+
+    printf("\n  ]\n");
+    printf("}\n");
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char *argv[]) {
+    Options options;
+
+    CommandLineParser p("Mutex overhead benchmarks");
+    p.AddHelpOption();
+    p.AddOption('n', "iterations").Arg(&options.num_iterations).Help("number of iterations for the uncontended benchmarks").ShowDefault().Meta("N");
+    p.AddOption('d', "duration").Arg(&options.duration_ms).Help("duration of each contended run in ms").ShowDefault().Meta("MS");
+    p.AddOption('t', "max-threads").Arg(&options.max_num_threads).Help("skip contended runs with more than this many threads (0 = no limit)").ShowDefault().Meta("N");
+    p.AddOption('m', "monitor").SetIfPresent(&options.monitor).Help("continually fetch all mutex details during the contended runs");
+    p.AddOption('f', "format").Arg(&options.format).Help("output format: text, csv or json").ShowDefault().Meta("FORMAT");
+    p.AddOption('b', "backend").AddArgToList(&options.backends).Help("only run this backend (may be specified multiple times)").Meta("NAME");
+
+    if (!p.Parse(argc, argv)) {
+        return 1;
+    }
+
+    if (options.num_iterations < 1 || options.duration_ms < 1) {
+        fprintf(stderr, "FATAL: iterations and duration must be at least 1\n");
+        return 1;
+    }
+
+    if (options.format != "text" && options.format != "csv" && options.format != "json") {
+        fprintf(stderr, "FATAL: unknown format: %s\n", options.format.c_str());
+        return 1;
+    }
+
+    for (const std::string &name : options.backends) {
+        bool found = false;
+        for (const Backend &backend : BACKENDS) {
+            if (name == backend.name) {
+                found = true;
+            }
+        }
+
+        if (!found) {
+            fprintf(stderr, "FATAL: unknown backend: %s\n", name.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<BenchmarkResult> results;
+    for (const Backend &backend : BACKENDS) {
+        if (!options.backends.empty() && std::find(options.backends.begin(), options.backends.end(), backend.name) == options.backends.end()) {
+            continue;
+        }
+
+        if (backend.begin_fn) {
+            (*backend.begin_fn)();
+        }
+
+        (*backend.run_fn)(backend.name, options, &results);
+
+        if (backend.end_fn) {
+            (*backend.end_fn)();
+        }
+    }
+
+    if (options.format == "csv") {
+        PrintCSV(results);
+    } else if (options.format == "json") {
+        PrintJSON(results);
+    } else {
+        PrintText(results);
+    }
+}
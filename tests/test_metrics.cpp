@@ -0,0 +1,1252 @@
+#include <shared/system.h>
+#include <shared/metrics.h>
+#include <shared/openmetrics.h>
+#include <shared/metrics_sampler.h>
+#include <shared/metrics_shm.h>
+#include <shared/sampling_profiler.h>
+#include <shared/trace.h>
+#include <shared/file_io.h>
+#include <shared/testing.h>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#if SYSTEM_POSIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestCounter() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestCounter");
+
+    Counter *counter = MetricSet::CreateCounter(set, "counter");
+    counter->Add(10);
+    counter->Increment();
+    TEST_EQ_UU(counter->GetValue(), 11);
+
+    set->ResetCounters();
+    TEST_EQ_UU(counter->GetValue(), 0);
+
+    Counter *dummy = MetricSet::CreateCounter(nullptr, "dummy");
+    TEST_NON_NULL(dummy);
+    dummy->Increment();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestStripedCounter() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestStripedCounter");
+
+    StripedCounter *counter = MetricSet::CreateStripedCounter(set, "striped");
+
+    std::vector<const Value *> values = set->GetValues();
+    TEST_TRUE(std::find(values.begin(), values.end(), counter) != values.end());
+
+    static constexpr size_t NUM_THREADS = StripedCounter::NUM_STRIPES + 3;
+    static constexpr uint64_t NUM_ADDS = 10000;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([counter]() {
+            for (uint64_t j = 0; j < NUM_ADDS; ++j) {
+                counter->Increment();
+            }
+        });
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    TEST_EQ_UU(counter->GetValue(), NUM_THREADS * NUM_ADDS);
+
+    set->ResetCounters();
+    TEST_EQ_UU(counter->GetValue(), 0);
+
+    counter->Add(5);
+    TEST_EQ_UU(counter->GetValue(), 5);
+
+    StripedCounter *dummy = MetricSet::CreateStripedCounter(nullptr, "dummy");
+    TEST_NON_NULL(dummy);
+    dummy->Increment();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestHistogramBuckets() {
+    for (size_t i = 0; i < HISTOGRAM_NUM_BUCKETS; ++i) {
+        uint64_t min = Histogram::GetBucketMinValue(i);
+        uint64_t max = Histogram::GetBucketMaxValue(i);
+        TEST_LE_UU(min, max);
+        TEST_EQ_UU(Histogram::GetBucketIndex(min), i);
+        TEST_EQ_UU(Histogram::GetBucketIndex(max), i);
+
+        if (i > 0) {
+            TEST_EQ_UU(Histogram::GetBucketMaxValue(i - 1) + 1, min);
+        }
+    }
+
+    TEST_EQ_UU(Histogram::GetBucketMaxValue(HISTOGRAM_NUM_BUCKETS - 1), UINT64_MAX);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestHistogram() {
+    Histogram histogram;
+
+    HistogramSnapshot snapshot;
+    histogram.GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 0);
+    TEST_EQ_UU(snapshot.GetPercentile(50.), 0);
+
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        histogram.Record(i);
+    }
+
+    histogram.GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 1000);
+    TEST_EQ_UU(snapshot.max, 1000);
+    TEST_EQ_UU(snapshot.GetPercentile(100.), 1000);
+
+    // within a bucket's width of the true value.
+    uint64_t p50 = snapshot.GetPercentile(50.);
+    TEST_GE_UU(p50, 500);
+    TEST_LE_UU(p50, 500 + 500 / HISTOGRAM_NUM_SUB_BUCKETS);
+
+    uint64_t p99 = snapshot.GetPercentile(99.);
+    TEST_GE_UU(p99, 990);
+    TEST_LE_UU(p99, 1000);
+
+    HistogramSnapshot merged = snapshot;
+    merged.Merge(snapshot);
+    TEST_EQ_UU(merged.num_samples, 2000);
+    TEST_EQ_UU(merged.GetPercentile(50.), p50);
+
+    HistogramSnapshot taken;
+    histogram.GetSnapshotAndReset(&taken);
+    TEST_EQ_UU(taken.num_samples, 1000);
+    TEST_EQ_UU(taken.max, 1000);
+
+    histogram.GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 0);
+    TEST_EQ_UU(snapshot.max, 0);
+
+    histogram.Merge(taken);
+    histogram.GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 1000);
+    TEST_EQ_UU(snapshot.GetPercentile(50.), p50);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTimerDefHistogram() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestTimerDefHistogram");
+
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+    TEST_NULL(def->GetHistogram());
+
+    {
+        Timer timer(def);
+    }
+
+    def->EnableHistogram();
+    Histogram *histogram = def->GetHistogram();
+    TEST_NON_NULL(histogram);
+
+    def->EnableHistogram();
+    TEST_EQ_PP(def->GetHistogram(), histogram);
+
+    for (int i = 0; i < 10; ++i) {
+        Timer timer(def);
+    }
+
+    HistogramSnapshot snapshot;
+    histogram->GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 10);
+    TEST_EQ_UU(def->GetNumSamples(), 11);
+
+    set->ResetTimerDefs();
+    histogram->GetSnapshot(&snapshot);
+    TEST_EQ_UU(snapshot.num_samples, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTimerDefTotals() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestTimerDefTotals");
+
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+
+    static constexpr size_t NUM_THREADS = METRICS_NUM_STRIPES + 3;
+    static constexpr uint64_t NUM_ADDS = 10000;
+    static constexpr uint64_t NUM_TICKS = 3;
+
+    std::atomic<bool> stop{false};
+    std::atomic<bool> torn{false};
+    std::thread reader([def, &stop, &torn]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            TimerDefTotals totals = def->GetTotals();
+            if (totals.total_num_ticks != totals.num_samples * NUM_TICKS) {
+                torn.store(true, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([def]() {
+            for (uint64_t j = 0; j < NUM_ADDS; ++j) {
+                def->AddTicks(NUM_TICKS);
+            }
+        });
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    stop.store(true, std::memory_order_relaxed);
+    reader.join();
+
+    TEST_FALSE(torn.load(std::memory_order_relaxed));
+
+    TimerDefTotals totals = def->GetTotals();
+    TEST_EQ_UU(totals.num_samples, NUM_THREADS * NUM_ADDS);
+    TEST_EQ_UU(totals.total_num_ticks, NUM_THREADS * NUM_ADDS * NUM_TICKS);
+
+    set->ResetTimerDefs();
+    TEST_EQ_UU(def->GetTotalNumTicks(), 0);
+    TEST_EQ_UU(def->GetNumSamples(), 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static bool Contains(const std::string &text, const char *needle) {
+    bool found = text.find(needle) != std::string::npos;
+    if (!found) {
+        printf("not found: %s\n", needle);
+    }
+
+    return found;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static size_t CountOccurrences(const std::string &str, const std::string &needle) {
+    size_t n = 0;
+    for (size_t pos = str.find(needle); pos != std::string::npos; pos = str.find(needle, pos + 1)) {
+        ++n;
+    }
+
+    return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestOpenMetrics() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("OpenMetrics \"test\"");
+
+    Counter *counter = MetricSet::CreateCounter(set, "requests_total");
+    counter->Add(3);
+
+    StripedCounter *striped = MetricSet::CreateStripedCounter(set, "striped.requests");
+    striped->Add(4);
+
+    MetricSet::CreateDerivedValue(set, "derived", [counter]() {
+        return counter->GetValue() * 2;
+    });
+
+    TimerDef *parent = MetricSet::CreateTimerDef(set, "parent");
+    TimerDef *child = MetricSet::CreateTimerDef(set, "child", parent);
+    child->EnableHistogram();
+    parent->AddTicks(100);
+    child->AddTicks(50);
+
+    OpenMetricsExporter exporter;
+    std::string text = exporter.Render();
+    printf("%s", text.c_str());
+
+    TEST_TRUE(Contains(text, "# TYPE requests counter\n"));
+    TEST_TRUE(Contains(text, "requests_total{set=\"OpenMetrics \\\"test\\\"\"} 3\n"));
+    TEST_TRUE(Contains(text, "# TYPE striped_requests counter\n"));
+    TEST_TRUE(Contains(text, "striped_requests_total{set=\"OpenMetrics \\\"test\\\"\"} 4\n"));
+    TEST_TRUE(Contains(text, "# TYPE derived gauge\n"));
+    TEST_TRUE(Contains(text, "derived{set=\"OpenMetrics \\\"test\\\"\"} 6\n"));
+    TEST_TRUE(Contains(text, "# TYPE timer_seconds summary\n"));
+    TEST_TRUE(Contains(text, "timer_seconds_count{set=\"OpenMetrics \\\"test\\\"\",timer=\"parent\"} 1\n"));
+    TEST_TRUE(Contains(text, "timer_seconds_count{set=\"OpenMetrics \\\"test\\\"\",timer=\"parent/child\"} 1\n"));
+    TEST_TRUE(Contains(text, "timer=\"parent/child\",quantile=\"0.99\"}"));
+    TEST_EQ_UU(text.find("timer=\"parent\",quantile="), std::string::npos);
+#if MUTEX_DEBUGGING
+    TEST_TRUE(Contains(text, "# TYPE mutex_locks counter\n"));
+#endif
+    TEST_EQ_UU(text.size() - text.rfind("# EOF\n"), 6);
+
+    // Same family, different kinds, in different sets: the counter wins.
+    // And a Value can't pretend to be a built-in family.
+    {
+        std::shared_ptr<MetricSet> other = MetricSet::Create("OpenMetrics other");
+        MetricSet::CreateGauge(other, "requests")->Set(10);
+        MetricSet::CreateGauge(other, "timer_seconds_count")->Set(11);
+        MetricSet::CreateCounter(set, "timer_seconds")->Add(12);
+
+        text = exporter.Render();
+
+        TEST_EQ_UU(CountOccurrences(text, "# TYPE requests "), 1);
+        TEST_TRUE(Contains(text, "# TYPE requests counter\n"));
+        TEST_TRUE(Contains(text, "requests_total{set=\"OpenMetrics \\\"test\\\"\"} 3\n"));
+        TEST_EQ_UU(text.find("set=\"OpenMetrics other\""), std::string::npos);
+        TEST_EQ_UU(CountOccurrences(text, "# TYPE timer_seconds "), 1);
+        TEST_EQ_UU(text.find("timer_seconds_total"), std::string::npos);
+        TEST_EQ_UU(text.find("} 11\n"), std::string::npos);
+    }
+
+    // Rendering again reuses the buffer.
+    const std::string *buffer = &exporter.Render();
+    TEST_EQ_PP(&exporter.Render(), buffer);
+
+    std::string path = TEST_FILES_FOLDER "/test_metrics.openmetrics.txt";
+    TEST_TRUE(exporter.Save(path, nullptr));
+
+    std::string saved;
+    TEST_TRUE(LoadTextFile(&saved, path, nullptr));
+    TEST_TRUE(Contains(saved, "# EOF\n"));
+
+#if SYSTEM_POSIX
+    std::unique_ptr<OpenMetricsHTTPServer> server = OpenMetricsHTTPServer::Create(0, nullptr);
+    TEST_NON_NULL(server);
+    TEST_NE_UU(server->GetPort(), 0);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_GE_II(fd, 0);
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->GetPort());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_EQ_II(connect(fd, (const sockaddr *)&addr, sizeof addr), 0);
+
+    static const char REQUEST[] = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    TEST_EQ_II(send(fd, REQUEST, sizeof REQUEST - 1, 0), (ssize_t)(sizeof REQUEST - 1));
+
+    std::string response;
+    char buf[1000];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof buf, 0)) > 0) {
+        response.append(buf, (size_t)n);
+    }
+
+    close(fd);
+
+    TEST_EQ_UU(response.find("HTTP/1.1 200 OK\r\n"), 0);
+    TEST_TRUE(Contains(response, "requests_total{"));
+    TEST_EQ_UU(response.size() - response.rfind("# EOF\n"), 6);
+
+    server.reset();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestMetricsSampler() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestMetricsSampler");
+
+    Counter *counter = MetricSet::CreateCounter(set, "counter");
+    Gauge *gauge = MetricSet::CreateGauge(set, "gauge");
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+
+    MetricsSampler sampler(0, 3);
+
+    MetricsSamplerWindow window;
+    TEST_FALSE(sampler.GetWindow(counter, 1e6, &window));
+
+    // baseline.
+    counter->Add(100);
+    sampler.Sample();
+    TEST_TRUE(sampler.GetWindow(counter, 1e6, &window));
+    TEST_EQ_UU(window.num_samples, 0);
+
+    for (uint64_t i = 1; i <= 4; ++i) {
+        SleepMS(1);
+        counter->Add(i);
+        def->AddTicks(10 * i);
+        def->AddTicks(10 * i);
+        sampler.Sample();
+    }
+
+    // Only the last 3 are kept.
+    TEST_TRUE(sampler.GetWindow(counter, 1e6, &window));
+    TEST_EQ_UU(window.num_samples, 3);
+    TEST_EQ_II(window.total_delta, 2 + 3 + 4);
+    TEST_EQ_II(window.min_value, 103);
+    TEST_EQ_II(window.max_value, 110);
+    TEST_TRUE(window.seconds > 0.);
+    TEST_TRUE(window.delta_per_second > 0.);
+
+    // Tiny window: just the newest sample.
+    TEST_TRUE(sampler.GetWindow(counter, 1e-9, &window));
+    TEST_EQ_UU(window.num_samples, 1);
+    TEST_EQ_II(window.total_delta, 4);
+
+    TEST_TRUE(sampler.GetWindow(def, 1e6, &window));
+    TEST_EQ_UU(window.num_samples, 3);
+    TEST_EQ_II(window.total_delta, 2 * 10 * (2 + 3 + 4));
+    TEST_EQ_UU(window.total_num_samples_delta, 6);
+
+    // A reset counts as an increase from 0.
+    set->ResetCounters();
+    counter->Add(5);
+    sampler.Sample();
+    TEST_TRUE(sampler.GetWindow(counter, 1e-9, &window));
+    TEST_EQ_II(window.total_delta, 5);
+
+    // A gauge can go down, and negative, without that being a reset.
+    gauge->Set(10);
+    sampler.Sample();
+    gauge->Set(4);
+    sampler.Sample();
+    gauge->Set(-6);
+    sampler.Sample();
+    gauge->Set(-2);
+    sampler.Sample();
+    TEST_TRUE(sampler.GetWindow(gauge, 1e6, &window));
+    TEST_EQ_UU(window.num_samples, 3);
+    TEST_EQ_II(window.total_delta, -12);
+    TEST_EQ_II(window.min_value, -6);
+    TEST_EQ_II(window.max_value, 4);
+    TEST_TRUE(window.mean_value > -1.34 && window.mean_value < -1.33);
+
+    TEST_TRUE(sampler.GetWindow(gauge, 1e-9, &window));
+    TEST_EQ_II(window.total_delta, 4);
+
+    // Gone once its set is.
+    set.reset();
+    sampler.Sample();
+    TEST_FALSE(sampler.GetWindow(def, 1e6, &window));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestMetricsSamplerThread() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestMetricsSamplerThread");
+
+    Counter *counter = MetricSet::CreateCounter(set, "counter");
+
+    MetricsSampler sampler(5, 100);
+
+    MetricsSamplerWindow window;
+    for (int i = 0; i < 1000; ++i) {
+        counter->Increment();
+        SleepMS(1);
+
+        if (sampler.GetWindow(counter, 1e6, &window) && window.num_samples >= 2) {
+            break;
+        }
+    }
+
+    TEST_GE_UU(window.num_samples, 2);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTimerTracing() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestTimerTracing");
+
+    TimerDef *outer = MetricSet::CreateTimerDef(set, "outer scope");
+    TimerDef *inner = MetricSet::CreateTimerDef(set, "inner scope", outer);
+
+    ClearTraceEvents();
+
+    {
+        Timer timer(outer);
+    }
+
+    Timer::SetTracingEnabled(true);
+    TEST_TRUE(Timer::IsTracingEnabled());
+
+    std::thread thread([outer, inner]() {
+        Timer outer_timer(outer);
+        {
+            Timer inner_timer(inner);
+        }
+    });
+    thread.join();
+
+    {
+        Timer timer(outer);
+
+        // The end event still gets added.
+        Timer::SetTracingEnabled(false);
+
+        {
+            Timer untraced_timer(inner);
+        }
+    }
+
+    std::string json;
+    GetChromeTraceJSON(&json);
+    printf("%s\n", json.c_str());
+
+    TEST_EQ_UU(CountOccurrences(json, "\"name\":\"outer scope\""), 4);
+    TEST_EQ_UU(CountOccurrences(json, "\"name\":\"inner scope\""), 2);
+    TEST_EQ_UU(CountOccurrences(json, "\"cat\":\"timer\""), 6);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"B\""), 3);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"E\""), 3);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestGauges() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestGauges");
+
+    Gauge *gauge = MetricSet::CreateGauge(set, "queue_depth");
+    TEST_TRUE(gauge->IsSigned());
+    gauge->Set(5);
+    gauge->Add(3);
+    gauge->Sub(10);
+    TEST_EQ_II(gauge->GetSignedValue(), -2);
+
+    MaxGauge *max_gauge = MetricSet::CreateMaxGauge(set, "max_batch");
+    TEST_FALSE(max_gauge->IsSigned());
+    TEST_EQ_UU(max_gauge->GetValue(), 0);
+    max_gauge->Update(7);
+    max_gauge->Update(3);
+    max_gauge->Update(9);
+    max_gauge->Update(8);
+    TEST_EQ_UU(max_gauge->GetValue(), 9);
+    TEST_EQ_UU(max_gauge->GetValueAndReset(), 9);
+    TEST_EQ_UU(max_gauge->GetValue(), 0);
+    max_gauge->Update(4);
+
+    MinGauge *min_gauge = MetricSet::CreateMinGauge(set, "min_free");
+    TEST_EQ_UU(min_gauge->GetValue(), 0);
+    min_gauge->Update(7);
+    min_gauge->Update(3);
+    min_gauge->Update(9);
+    TEST_EQ_UU(min_gauge->GetValue(), 3);
+    TEST_EQ_UU(min_gauge->GetValueAndReset(), 3);
+    TEST_EQ_UU(min_gauge->GetValueAndReset(), 0);
+    min_gauge->Update(6);
+
+    {
+        OpenMetricsExporter exporter;
+        std::string text = exporter.Render();
+
+        TEST_TRUE(Contains(text, "# TYPE queue_depth gauge\n"));
+        TEST_TRUE(Contains(text, "queue_depth{set=\"TestGauges\"} -2\n"));
+        TEST_TRUE(Contains(text, "max_batch{set=\"TestGauges\"} 4\n"));
+        TEST_TRUE(Contains(text, "min_free{set=\"TestGauges\"} 6\n"));
+    }
+
+    // Concurrent updates all land.
+    {
+        std::vector<std::thread> threads;
+        for (uint64_t i = 0; i < 4; ++i) {
+            threads.emplace_back([i, max_gauge, min_gauge]() {
+                for (uint64_t j = 0; j < 1000; ++j) {
+                    max_gauge->Update(i * 1000 + j);
+                    min_gauge->Update(i * 1000 + j + 1);
+                }
+            });
+        }
+
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        TEST_EQ_UU(max_gauge->GetValue(), 3999);
+        TEST_EQ_UU(min_gauge->GetValue(), 1);
+    }
+
+    // The gauge keeps its level, so later changes are still relative to
+    // the right value.
+    set->ResetCounters();
+    TEST_EQ_II(gauge->GetSignedValue(), -2);
+    gauge->Add(3);
+    TEST_EQ_II(gauge->GetSignedValue(), 1);
+    TEST_EQ_UU(max_gauge->GetValue(), 0);
+    TEST_EQ_UU(min_gauge->GetValue(), 0);
+
+    TEST_NON_NULL(MetricSet::CreateGauge(nullptr, "dummy"));
+    TEST_NON_NULL(MetricSet::CreateMaxGauge(nullptr, "dummy"));
+    TEST_NON_NULL(MetricSet::CreateMinGauge(nullptr, "dummy"));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+METRIC_COUNTER_DEFINE(test_static_counter, "TestStaticMetrics");
+METRIC_TIMER_DEFINE(test_static_timer, "TestStaticMetrics");
+METRIC_TIMER_CHILD_DEFINE(test_static_child_timer, test_static_timer);
+
+static void AddToStaticMetrics() {
+    METRIC_TIMER(test_static_timer);
+    METRIC_COUNTER_ADD(test_static_counter, 2);
+
+    {
+        METRIC_TIMER(test_static_child_timer);
+        METRIC_COUNTER_INCREMENT(test_static_counter);
+    }
+}
+
+static void TestStaticMetrics() {
+    AddToStaticMetrics();
+    AddToStaticMetrics();
+
+    std::shared_ptr<MetricSet> set;
+    for (const std::shared_ptr<MetricSet> &s : MetricSet::GetAll()) {
+        if (s->GetName() == "TestStaticMetrics") {
+            set = s;
+        }
+    }
+
+#if METRICS_ENABLED
+    TEST_NON_NULL(set);
+    TEST_EQ_PP(set.get(), MetricSet::GetNamed("TestStaticMetrics").get());
+
+    std::vector<const Value *> values = set->GetValues();
+    TEST_EQ_UU(values.size(), 1);
+    TEST_EQ_PP(values[0], METRIC_COUNTER(test_static_counter).Get());
+    TEST_TRUE(values[0]->name == "test_static_counter");
+    TEST_EQ_UU(values[0]->GetValue(), 6);
+
+    std::vector<const TimerDef *> roots = set->GetRootTimerDefs();
+    TEST_EQ_UU(roots.size(), 1);
+    TEST_EQ_PP(roots[0], METRIC_TIMER_DEF(test_static_timer).Get());
+    TEST_EQ_UU(roots[0]->GetNumSamples(), 2);
+
+    std::vector<const TimerDef *> children = roots[0]->GetChildren();
+    TEST_EQ_UU(children.size(), 1);
+    TEST_TRUE(children[0]->name == "test_static_child_timer");
+    TEST_EQ_UU(children[0]->GetNumSamples(), 2);
+#else
+    TEST_NULL(set);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTimerNesting() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestTimerNesting");
+    std::shared_ptr<MetricSet> other_set = MetricSet::Create("TestTimerNesting other");
+
+    TimerDef *outer = MetricSet::CreateTimerDef(set, "outer");
+    TimerDef *inner = MetricSet::CreateTimerDef(set, "inner", outer);
+    TimerDef *nested_auto = MetricSet::CreateAutoTimerDef(set, "nested_auto");
+    TimerDef *root_auto = MetricSet::CreateAutoTimerDef(set, "root_auto");
+    TimerDef *other_auto = MetricSet::CreateAutoTimerDef(set, "other_auto");
+    TimerDef *other = MetricSet::CreateTimerDef(other_set, "other");
+
+    TEST_NULL(nested_auto->GetParent());
+
+    {
+        Timer root_auto_timer(root_auto);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        Timer outer_timer(outer);
+        SleepMS(1);
+
+        {
+            Timer null_timer(nullptr);
+
+            Timer inner_timer(inner);
+            SleepMS(1);
+        }
+
+        {
+            Timer nested_auto_timer(nested_auto);
+
+            Timer root_auto_timer(root_auto);
+        }
+    }
+
+    {
+        Timer other_timer(other);
+
+        Timer other_auto_timer(other_auto);
+    }
+
+    TEST_EQ_PP(nested_auto->GetParent(), outer);
+    TEST_NULL(root_auto->GetParent());
+    TEST_NULL(other_auto->GetParent());
+
+    std::vector<const TimerDef *> roots = set->GetRootTimerDefs();
+    TEST_EQ_UU(roots.size(), 3);
+    TEST_TRUE(std::find(roots.begin(), roots.end(), nested_auto) == roots.end());
+
+    std::vector<const TimerDef *> children = outer->GetChildren();
+    TEST_EQ_UU(children.size(), 2);
+    TEST_EQ_PP(children[1], nested_auto);
+
+    // The outer Timer's self time is what's left after the nested Timers.
+    TimerDefTotals outer_totals = outer->GetTotals();
+    TimerDefTotals inner_totals = inner->GetTotals();
+    TimerDefTotals nested_auto_totals = nested_auto->GetTotals();
+    TimerDefTotals root_auto_totals = root_auto->GetTotals();
+    TEST_EQ_UU(outer_totals.num_samples, 3);
+    TEST_TRUE(outer_totals.self_num_ticks > 0);
+    TEST_EQ_UU(outer_totals.self_num_ticks + inner_totals.total_num_ticks + nested_auto_totals.total_num_ticks, outer_totals.total_num_ticks);
+    TEST_EQ_UU(inner_totals.self_num_ticks, inner_totals.total_num_ticks);
+    TEST_EQ_UU(root_auto_totals.num_samples, 4);
+    TEST_LE_UU(nested_auto_totals.self_num_ticks, nested_auto_totals.total_num_ticks);
+
+    {
+        OpenMetricsExporter exporter;
+        std::string text = exporter.Render();
+
+        TEST_TRUE(Contains(text, "# TYPE timer_self_seconds counter\n"));
+        TEST_TRUE(Contains(text, "timer_self_seconds_total{set=\"TestTimerNesting\",timer=\"outer/nested_auto\"} "));
+    }
+
+    set->ResetTimerDefs();
+    TEST_EQ_UU(outer->GetSelfNumTicks(), 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static const MetricsShmValue *FindShmValue(const std::vector<MetricsShmValue> &values, const char *name) {
+    for (const MetricsShmValue &value : values) {
+        if (value.name == name) {
+            return &value;
+        }
+    }
+
+    printf("not found: %s\n", name);
+    return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestSharedMemory() {
+#if SYSTEM_POSIX
+    std::string name = "/test_metrics." + std::to_string(getpid());
+
+    std::shared_ptr<MetricsSharedMemory> shm = MetricsSharedMemory::Create(name, 4, nullptr);
+    TEST_NON_NULL(shm);
+
+    // Only one of these can exist at once.
+    TEST_NULL(MetricsSharedMemory::Create(name, 4, nullptr));
+
+    std::shared_ptr<MetricSet> set = MetricSet::Create("shm", shm);
+
+    Counter *counter = MetricSet::CreateCounter(set, "counter");
+    Gauge *gauge = MetricSet::CreateGauge(set, "gauge");
+    TimerDef *parent = MetricSet::CreateTimerDef(set, "parent");
+    TimerDef *child = MetricSet::CreateTimerDef(set, "child", parent);
+
+    // The segment's full, so this one's stored locally.
+    Counter *extra = MetricSet::CreateCounter(set, "extra");
+
+    counter->Add(5);
+    gauge->Set(-3);
+    parent->AddTicks(100, 60);
+    child->AddTicks(40);
+    extra->Add(7);
+
+    TEST_EQ_UU(counter->GetValue(), 5);
+    TEST_EQ_II(gauge->GetSignedValue(), -3);
+    TEST_EQ_UU(parent->GetTotalNumTicks(), 100);
+    TEST_EQ_UU(extra->GetValue(), 7);
+
+    std::unique_ptr<MetricsSharedMemoryReader> reader = MetricsSharedMemoryReader::Open(name, nullptr);
+    TEST_NON_NULL(reader);
+    TEST_EQ_UU(reader->GetPID(), (uint64_t)getpid());
+
+    std::vector<MetricsShmValue> values;
+    TEST_TRUE(reader->Read(&values));
+    TEST_EQ_UU(values.size(), 4);
+
+    const MetricsShmValue *value = FindShmValue(values, "shm/counter");
+    TEST_NON_NULL(value);
+    TEST_EQ_UU(value->type, MetricsShmType_Counter);
+    TEST_EQ_UU(value->value, 5);
+
+    value = FindShmValue(values, "shm/gauge");
+    TEST_NON_NULL(value);
+    TEST_EQ_UU(value->type, MetricsShmType_Gauge);
+    TEST_EQ_II((int64_t)value->value, -3);
+
+    value = FindShmValue(values, "shm/parent");
+    TEST_NON_NULL(value);
+    TEST_EQ_UU(value->type, MetricsShmType_TimerDef);
+    TEST_EQ_UU(value->totals.total_num_ticks, 100);
+    TEST_EQ_UU(value->totals.num_samples, 1);
+    TEST_EQ_UU(value->totals.self_num_ticks, 60);
+
+    value = FindShmValue(values, "shm/parent/child");
+    TEST_NON_NULL(value);
+    TEST_EQ_UU(value->totals.total_num_ticks, 40);
+
+    // The reader sees changes live.
+    counter->Increment();
+    set->ResetTimerDefs();
+    TEST_TRUE(reader->Read(&values));
+    TEST_EQ_UU(FindShmValue(values, "shm/counter")->value, 6);
+    TEST_EQ_UU(FindShmValue(values, "shm/parent")->totals.num_samples, 0);
+
+    // A destroyed set's entries aren't live any more.
+    set = nullptr;
+    TEST_TRUE(reader->Read(&values));
+    TEST_EQ_UU(values.size(), 0);
+
+    shm = nullptr;
+
+    // The segment's gone, though the reader's mapping stays valid.
+    TEST_NULL(MetricsSharedMemoryReader::Open(name, nullptr));
+    TEST_TRUE(reader->Read(&values));
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if SYSTEM_LINUX
+static size_t GetNumOpenFDs() {
+    size_t num_fds = 0;
+    if (DIR *dir = opendir("/proc/self/fd")) {
+        while (readdir(dir)) {
+            ++num_fds;
+        }
+
+        closedir(dir);
+    }
+
+    return num_fds;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Hardware counters are often unavailable (VMs, containers,
+// perf_event_paranoid), so only the software ones are actually checked.
+static void TestPerfCounters() {
+    TEST_EQ_II(PerfCounters::GetMode(), PerfCounterMode_Off);
+    TEST_FALSE(PerfCounters::IsEnabled());
+    TEST_NULL(PerfCounters::GetCounterName(PerfCounterMode_Off, 0));
+    TEST_EQ_SS(PerfCounters::GetCounterName(PerfCounterMode_Hardware, 0), "cycles");
+    TEST_EQ_SS(PerfCounters::GetCounterName(PerfCounterMode_Software, 0), "task_clock_ns");
+
+    PerfCounterValues values;
+    TEST_FALSE(PerfCounters::ReadThreadCounters(&values));
+
+#if SYSTEM_LINUX
+    size_t num_fds_off = GetNumOpenFDs();
+#endif
+
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestPerfCounters");
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+
+    if (PerfCounters::SetMode(PerfCounterMode_Hardware, nullptr)) {
+        TEST_TRUE(PerfCounters::IsEnabled());
+        TEST_EQ_II(PerfCounters::GetMode(), PerfCounterMode_Hardware);
+    } else {
+        TEST_FALSE(PerfCounters::IsEnabled());
+        TEST_EQ_II(PerfCounters::GetMode(), PerfCounterMode_Off);
+    }
+
+    if (PerfCounters::SetMode(PerfCounterMode_Software, nullptr)) {
+        TEST_TRUE(PerfCounters::IsEnabled());
+        TEST_TRUE(PerfCounters::ReadThreadCounters(&values));
+
+        {
+            Timer timer(def);
+
+            uint64_t begin_ticks = GetCurrentTickCount();
+            while (GetSecondsFromTicks(GetCurrentTickCount() - begin_ticks) < .01) {
+            }
+        }
+
+        TimerDefTotals totals = def->GetTotals();
+        TEST_EQ_UU(totals.num_samples, 1);
+        TEST_TRUE(totals.perf_counters[0] > 0);
+    } else {
+        printf("(software perf counters not available - skipping)\n");
+    }
+
+    TEST_TRUE(PerfCounters::SetMode(PerfCounterMode_Off, nullptr));
+    TEST_FALSE(PerfCounters::IsEnabled());
+    TEST_FALSE(PerfCounters::ReadThreadCounters(&values));
+
+#if SYSTEM_LINUX
+    // Turning the counters off closes this thread's fds.
+    TEST_EQ_UU(GetNumOpenFDs(), num_fds_off);
+#endif
+
+    // Timers with the counters off don't touch the perf totals.
+    def->Reset();
+
+    {
+        Timer timer(def);
+    }
+
+    TimerDefTotals totals = def->GetTotals();
+    TEST_EQ_UU(totals.num_samples, 1);
+    TEST_EQ_UU(totals.perf_counters[0], 0);
+
+    // Deltas are scaled up if the group was multiplexed.
+    PerfCounterValues begin, end;
+    begin.values[0] = 100;
+    begin.time_enabled = 1000;
+    begin.time_running = 1000;
+    end.values[0] = 200;
+    end.time_enabled = 3000;
+    end.time_running = 2000;
+
+    uint64_t deltas[PERF_COUNTERS_NUM_COUNTERS];
+    TEST_TRUE(PerfCounters::GetDeltas(begin, end, deltas));
+    TEST_EQ_UU(deltas[0], 200);
+    TEST_EQ_UU(deltas[1], 0);
+
+    end.time_running = 3000;
+    TEST_TRUE(PerfCounters::GetDeltas(begin, end, deltas));
+    TEST_EQ_UU(deltas[0], 100);
+
+    // Never counting in between, or a mode change, means no deltas.
+    end.time_running = 1000;
+    TEST_FALSE(PerfCounters::GetDeltas(begin, end, deltas));
+
+    end.time_running = 3000;
+    end.generation = begin.generation + 1;
+    TEST_FALSE(PerfCounters::GetDeltas(begin, end, deltas));
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void BusyWait(double seconds) {
+    uint64_t begin_ticks = GetCurrentTickCount();
+    while (GetSecondsFromTicks(GetCurrentTickCount() - begin_ticks) < seconds) {
+    }
+}
+
+static void TestSamplingProfiler() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestSamplingProfiler");
+    TimerDef *outer = MetricSet::CreateTimerDef(set, "outer");
+    TimerDef *inner = MetricSet::CreateTimerDef(set, "inner", outer);
+
+    SamplingProfiler::RegisterThread();
+    SamplingProfiler::RegisterThread();
+
+    SamplingProfilerOptions options;
+    options.frequency_hz = 1000;
+    options.backtraces = true;
+    if (!SamplingProfiler::Start(options, nullptr)) {
+        printf("(sampling profiler not available - skipping)\n");
+        return;
+    }
+
+    TEST_TRUE(SamplingProfiler::IsRunning());
+    TEST_FALSE(SamplingProfiler::Start(options, nullptr));
+
+    // A thread registered after starting gets sampled too.
+    std::thread thread([inner]() {
+        SamplingProfiler::RegisterThread();
+
+        Timer timer(inner);
+        BusyWait(.05);
+    });
+
+    {
+        Timer outer_timer(outer);
+        BusyWait(.05);
+
+        Timer inner_timer(inner);
+        BusyWait(.05);
+    }
+
+    thread.join();
+
+    SamplingProfiler::Stop();
+    TEST_FALSE(SamplingProfiler::IsRunning());
+
+    SamplingProfile profile = SamplingProfiler::GetProfile();
+    TEST_TRUE(profile.num_samples > 0);
+
+    uint64_t num_inner_samples = 0;
+    bool any_frames = false;
+    for (const auto &it : profile.stacks) {
+        TEST_FALSE(it.first.timer_defs.empty());
+
+        if (it.first.timer_defs.back() == "TestSamplingProfiler/inner") {
+            num_inner_samples += it.second;
+        }
+
+        if (!it.first.frames.empty()) {
+            any_frames = true;
+        }
+    }
+
+    TEST_TRUE(num_inner_samples > 0);
+    TEST_TRUE(any_frames);
+
+    std::string collapsed = GetSamplingProfileCollapsedStacks(profile);
+    TEST_TRUE(collapsed.find("TestSamplingProfiler/outer;TestSamplingProfiler/inner") != std::string::npos);
+
+    std::string report = GetSamplingProfileReport(profile);
+    TEST_TRUE(report.find("TestSamplingProfiler/outer") != std::string::npos);
+
+    // Nothing more once stopped.
+    BusyWait(.02);
+    SamplingProfiler::Collect();
+    TEST_EQ_UU(SamplingProfiler::GetProfile().num_samples, profile.num_samples);
+
+    SamplingProfiler::ResetProfile();
+    TEST_EQ_UU(SamplingProfiler::GetProfile().num_samples, 0);
+    TEST_TRUE(SamplingProfiler::GetProfile().stacks.empty());
+
+    // A set can be destroyed while its TimerDefs are in the buffers.
+    TEST_TRUE(SamplingProfiler::Start(options, nullptr));
+
+    {
+        std::shared_ptr<MetricSet> temp_set = MetricSet::Create("TestSamplingProfilerTemp");
+        TimerDef *temp = MetricSet::CreateTimerDef(temp_set, "temp");
+
+        Timer timer(temp);
+        BusyWait(.05);
+    }
+
+    SamplingProfiler::Stop();
+
+    uint64_t num_temp_samples = 0;
+    for (const auto &it : SamplingProfiler::GetProfile().stacks) {
+        if (it.first.timer_defs.back() == "TestSamplingProfilerTemp/temp") {
+            num_temp_samples += it.second;
+        }
+    }
+
+    TEST_TRUE(num_temp_samples > 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestSnapshot() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestSnapshot");
+
+    Counter *counter = MetricSet::CreateCounter(set, "counter");
+    StripedCounter *striped_counter = MetricSet::CreateStripedCounter(set, "striped_counter");
+    Gauge *gauge = MetricSet::CreateGauge(set, "gauge");
+    MetricSet::CreateDerivedValue(set, "derived", [counter]() {
+        return counter->GetValue() * 2;
+    });
+    TimerDef *def = MetricSet::CreateTimerDef(set, "def");
+    def->EnableHistogram();
+
+    counter->Add(3);
+    striped_counter->Add(4);
+    gauge->Set(-5);
+    def->AddTicks(10, 6);
+
+    MetricSetSnapshot snapshot;
+    set->Snapshot(false, &snapshot);
+
+    TEST_EQ_UU(snapshot.values.size(), 4);
+    std::vector<const Value *> values = set->GetValues();
+    for (size_t i = 0; i < values.size(); ++i) {
+        TEST_EQ_PP(snapshot.values[i].metric, values[i]);
+    }
+
+    TEST_EQ_UU(snapshot.values[0].value, 3);
+    TEST_EQ_UU(snapshot.values[1].value, 4);
+    TEST_EQ_II((int64_t)snapshot.values[2].value, -5);
+    TEST_EQ_UU(snapshot.values[3].value, 6);
+
+    TEST_EQ_UU(snapshot.timer_defs.size(), 1);
+    TEST_EQ_PP(snapshot.timer_defs[0].def, def);
+    TEST_EQ_UU(snapshot.timer_defs[0].totals.total_num_ticks, 10);
+    TEST_EQ_UU(snapshot.timer_defs[0].totals.num_samples, 1);
+    TEST_EQ_UU(snapshot.timer_defs[0].totals.self_num_ticks, 6);
+    TEST_EQ_UU(snapshot.timer_defs[0].histogram.num_samples, 1);
+    TEST_EQ_UU(snapshot.timer_defs[0].histogram.max, 10);
+
+    // Same again, as nothing was reset.
+    set->Snapshot(true, &snapshot);
+    TEST_EQ_UU(snapshot.values[0].value, 3);
+    TEST_EQ_UU(snapshot.values[1].value, 4);
+    TEST_EQ_II((int64_t)snapshot.values[2].value, -5);
+    TEST_EQ_UU(snapshot.timer_defs[0].totals.num_samples, 1);
+    TEST_EQ_UU(snapshot.timer_defs[0].histogram.num_samples, 1);
+
+    HistogramSnapshot histogram_snapshot;
+    def->GetHistogram()->GetSnapshot(&histogram_snapshot);
+    TEST_EQ_UU(histogram_snapshot.num_samples, 0);
+
+    TEST_EQ_UU(counter->GetValue(), 0);
+    TEST_EQ_UU(striped_counter->GetValue(), 0);
+    TEST_EQ_UU(def->GetNumSamples(), 0);
+
+    // The gauge is left alone.
+    TEST_EQ_II(gauge->GetSignedValue(), -5);
+    set->Snapshot(true, &snapshot);
+    TEST_EQ_II((int64_t)snapshot.values[2].value, -5);
+
+    // Resetting snapshots racing with updates lose nothing.
+    static constexpr uint64_t NUM_ITERATIONS = 100000;
+    static constexpr size_t NUM_THREADS = 4;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+        threads.emplace_back([counter, striped_counter, def]() {
+            for (uint64_t j = 0; j < NUM_ITERATIONS; ++j) {
+                counter->Increment();
+                striped_counter->Increment();
+                def->AddTicks(1);
+            }
+        });
+    }
+
+    uint64_t counter_total = 0, striped_counter_total = 0, num_samples_total = 0, histogram_num_samples_total = 0;
+    std::atomic<bool> done{false};
+    std::thread snapshot_thread([&]() {
+        MetricSetSnapshot thread_snapshot;
+        while (!done.load(std::memory_order_acquire)) {
+            set->Snapshot(true, &thread_snapshot);
+            counter_total += thread_snapshot.values[0].value;
+            striped_counter_total += thread_snapshot.values[1].value;
+            num_samples_total += thread_snapshot.timer_defs[0].totals.num_samples;
+            histogram_num_samples_total += thread_snapshot.timer_defs[0].histogram.num_samples;
+        }
+    });
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    done.store(true, std::memory_order_release);
+    snapshot_thread.join();
+
+    set->Snapshot(true, &snapshot);
+    counter_total += snapshot.values[0].value;
+    striped_counter_total += snapshot.values[1].value;
+    num_samples_total += snapshot.timer_defs[0].totals.num_samples;
+    histogram_num_samples_total += snapshot.timer_defs[0].histogram.num_samples;
+
+    TEST_EQ_UU(counter_total, NUM_THREADS * NUM_ITERATIONS);
+    TEST_EQ_UU(striped_counter_total, NUM_THREADS * NUM_ITERATIONS);
+    TEST_EQ_UU(num_samples_total, NUM_THREADS * NUM_ITERATIONS);
+    TEST_EQ_UU(histogram_num_samples_total, NUM_THREADS * NUM_ITERATIONS);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestMetricsIndex() {
+    std::shared_ptr<MetricSet> set = MetricSet::Create("TestMetricsIndex");
+
+    // Enough to need several index chunks and slabs.
+    static constexpr size_t NUM_METRICS = MetricsIndex<Value>::CHUNK_SIZE * 3 + 1;
+
+    std::vector<Counter *> counters;
+    std::vector<TimerDef *> defs;
+    for (size_t i = 0; i < NUM_METRICS; ++i) {
+        counters.push_back(MetricSet::CreateCounter(set, "counter" + std::to_string(i)));
+        counters.back()->Add(i);
+
+        StripedCounter *striped_counter = MetricSet::CreateStripedCounter(set, "striped_counter" + std::to_string(i));
+        TEST_EQ_UU((uintptr_t)striped_counter % 64, 0);
+
+        defs.push_back(MetricSet::CreateTimerDef(set, "def" + std::to_string(i)));
+        defs.back()->AddTicks(i);
+    }
+
+    size_t index = 0;
+    set->ForEachValue([&](const Value *value) {
+        if (index % 2 == 0) {
+            TEST_EQ_PP(value, counters[index / 2]);
+            TEST_EQ_UU(value->GetValue(), index / 2);
+        }
+
+        ++index;
+    });
+    TEST_EQ_UU(index, NUM_METRICS * 2);
+    TEST_EQ_UU(set->GetValues().size(), NUM_METRICS * 2);
+
+    index = 0;
+    set->ForEachTimerDef([&](const TimerDef *def) {
+        TEST_EQ_PP(def, defs[index]);
+        TEST_EQ_UU(def->GetTotalNumTicks(), index);
+        ++index;
+    });
+    TEST_EQ_UU(index, NUM_METRICS);
+
+    // Iterating while another thread adds metrics sees a prefix of them.
+    std::atomic<bool> done{false};
+    std::thread thread([&set, &done]() {
+        for (size_t i = 0; i < NUM_METRICS; ++i) {
+            MetricSet::CreateGauge(set, "gauge" + std::to_string(i));
+        }
+
+        done.store(true, std::memory_order_release);
+    });
+
+    size_t last_num_values = 0;
+    for (;;) {
+        bool was_done = done.load(std::memory_order_acquire);
+
+        size_t num_values = 0;
+        set->ForEachValue([&num_values](const Value *value) {
+            TEST_NON_NULL(value);
+            TEST_FALSE(value->name.empty());
+            ++num_values;
+        });
+
+        TEST_GE_UU(num_values, last_num_values);
+        last_num_values = num_values;
+
+        if (was_done) {
+            break;
+        }
+    }
+
+    thread.join();
+
+    TEST_EQ_UU(last_num_values, NUM_METRICS * 3);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main() {
+    TestCounter();
+    TestStripedCounter();
+    TestHistogramBuckets();
+    TestHistogram();
+    TestTimerDefHistogram();
+    TestTimerDefTotals();
+    TestOpenMetrics();
+    TestMetricsSampler();
+    TestMetricsSamplerThread();
+    TestTimerTracing();
+    TestGauges();
+    TestStaticMetrics();
+    TestTimerNesting();
+    TestSharedMemory();
+    TestPerfCounters();
+    TestSamplingProfiler();
+    TestSnapshot();
+    TestMetricsIndex();
+}
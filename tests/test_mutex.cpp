@@ -0,0 +1,637 @@
+#include <shared/system.h>
+#include <shared/mutex.h>
+#include <shared/testing.h>
+#include <shared/log.h>
+#include <shared/trace.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if MUTEX_DEBUGGING
+static MutexDetails GetDetails(const MutexMetadata *metadata) {
+    MutexDetails details;
+    metadata->GetDetails(&details);
+    return details;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+#if MUTEX_DEBUGGING
+static bool IsInMetadataList(const MutexMetadata *metadata) {
+    for (const std::shared_ptr<MutexMetadata> &m : Mutex::GetAllMetadata()) {
+        if (m.get() == metadata) {
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Wait until the given number of threads are blocked trying to lock the
+// mutex exclusively.
+#if MUTEX_DEBUGGING
+template <class MutexType>
+static void WaitForWaiters(const MutexType *mutex, uint32_t num_waiters) {
+    while (GetDetails(mutex->GetMetadata()).stats.num_waiters < num_waiters) {
+        SleepMS(1);
+    }
+}
+#else
+static void WaitForWaiters(const TicketLock *lock, uint32_t num_waiters) {
+    while (lock->GetNumWaiters() < num_waiters) {
+        SleepMS(1);
+    }
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The metadata is split into cache line-aligned regions, so it had better
+// actually be allocated that way.
+static void TestMetadataAlignment() {
+#if MUTEX_DEBUGGING
+    std::vector<std::unique_ptr<Mutex>> mutexes;
+    for (int i = 0; i < 10; ++i) {
+        mutexes.push_back(std::make_unique<Mutex>());
+        TEST_EQ_UU((uintptr_t)mutexes.back()->GetMetadata() % 64, 0);
+    }
+
+    SharedMutex shared_mutex;
+    TEST_EQ_UU((uintptr_t)shared_mutex.GetMetadata() % 64, 0);
+
+    ConditionVariable cv;
+    TEST_EQ_UU((uintptr_t)cv.GetMetadata() % 64, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestSharedMutexStats() {
+#if MUTEX_DEBUGGING
+    SharedMutex mutex;
+    MUTEX_SET_NAME(mutex, "test");
+
+    TEST_TRUE(IsInMetadataList(mutex.GetMetadata()));
+
+    {
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.type, MutexType_SharedMutex);
+        TEST_EQ_SS(details.name, "test");
+        TEST_FALSE(details.stats.ever_locked);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        SharedLockGuard<SharedMutex> lock(mutex);
+    }
+
+    {
+        LockGuard<SharedMutex> lock(mutex);
+        TEST_FALSE(mutex.try_lock_shared());
+    }
+
+    TEST_TRUE(mutex.try_lock_shared());
+    TEST_TRUE(mutex.try_lock_shared());
+    TEST_FALSE(mutex.try_lock());
+    mutex.unlock_shared();
+    mutex.unlock_shared();
+
+    {
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_TRUE(details.stats.ever_locked);
+        TEST_EQ_UU(details.stats.num_locks, 1);
+        TEST_EQ_UU(details.stats.num_try_locks, 1);
+        TEST_EQ_UU(details.stats.num_successful_try_locks, 0);
+        TEST_EQ_UU(details.stats.num_shared_locks, 3);
+        TEST_EQ_UU(details.stats.num_try_lock_shareds, 3);
+        TEST_EQ_UU(details.stats.num_successful_try_lock_shareds, 2);
+    }
+
+    mutex.GetMutableMetadata()->RequestReset();
+
+    {
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_shared_locks, 0);
+        TEST_EQ_UU(details.stats.num_try_lock_shareds, 0);
+    }
+
+    // No exclusive lock, so it's the shared lock that does the reset.
+    {
+        SharedLockGuard<SharedMutex> lock(mutex);
+    }
+
+    {
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_shared_locks, 1);
+        TEST_EQ_UU(details.stats.num_try_lock_shareds, 0);
+    }
+
+    const MutexMetadata *metadata = mutex.GetMetadata();
+    {
+        Mutex other;
+        TEST_TRUE(IsInMetadataList(metadata));
+        TEST_TRUE(IsInMetadataList(other.GetMetadata()));
+        TEST_EQ_UU(GetDetails(other.GetMetadata()).type, MutexType_Mutex);
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// With writer preference, a writer must get in even though there are always
+// readers holding the lock.
+static void TestSharedMutexPreferWriters() {
+    SharedMutex mutex;
+    mutex.SetPreferWriters(true);
+    TEST_TRUE(mutex.GetPreferWriters());
+
+    std::atomic<bool> writer_done{false};
+    std::atomic<uint64_t> num_reads{0};
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&mutex, &writer_done, &num_reads]() {
+            while (!writer_done.load(std::memory_order_acquire)) {
+                SharedLockGuard<SharedMutex> lock(mutex);
+                num_reads.fetch_add(1, std::memory_order_relaxed);
+                SleepMS(1);
+            }
+        });
+    }
+
+    while (num_reads.load(std::memory_order_relaxed) < 10) {
+        SleepMS(1);
+    }
+
+    {
+        LockGuard<SharedMutex> lock(mutex);
+        writer_done.store(true, std::memory_order_release);
+    }
+
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+
+#if MUTEX_DEBUGGING
+    MutexDetails details = GetDetails(mutex.GetMetadata());
+    TEST_EQ_UU(details.stats.num_locks, 1);
+    TEST_GE_UU(details.stats.num_shared_locks, 10);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Hold the lock on this thread while another thread tries to take it.
+template <class MutexType>
+static void Contend(MutexType *mutex) {
+    mutex->lock();
+
+    std::thread thread([mutex]() {
+        LockGuard<MutexType> lock(*mutex);
+    });
+
+    WaitForWaiters(mutex, 1);
+    mutex->unlock();
+
+    thread.join();
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestContentionProfiler() {
+#if MUTEX_DEBUGGING
+    Mutex mutex;
+    MUTEX_SET_NAME(mutex, "contended");
+
+    Mutex::SetContentionProfilerSampleRate(1);
+    TEST_EQ_UU(Mutex::GetContentionProfilerSampleRate(), 1);
+
+    for (int i = 0; i < 3; ++i) {
+        Contend(&mutex);
+    }
+
+    Mutex::SetContentionProfilerSampleRate(0);
+
+    std::string output;
+    LogPrinterString printer(&output);
+    Log log("", &printer);
+    Mutex::LogContentionProfile(&log);
+    log.Flush();
+    printf("%s", output.c_str());
+
+    TEST_TRUE(output.find("1. contended: 3 samples") != std::string::npos);
+
+    Mutex::ResetContentionProfile();
+
+    output.clear();
+    Mutex::LogContentionProfile(&log);
+    log.Flush();
+    TEST_TRUE(output.find("1. contended") == std::string::npos);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestLockTimingSampleRate() {
+#if MUTEX_DEBUGGING
+    TEST_EQ_UU(Mutex::GetLockTimingSampleRate(), 1);
+
+    {
+        Mutex mutex;
+
+        for (int i = 0; i < 100; ++i) {
+            LockGuard<Mutex> lock(mutex);
+        }
+
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_locks, 100);
+        TEST_FALSE(details.stats.sampled);
+        TEST_NE_UU(details.stats.min_lock_wait_ticks, UINT64_MAX);
+    }
+
+    Mutex::SetLockTimingSampleRate(4);
+
+    {
+        Mutex mutex;
+
+        for (int i = 0; i < 100; ++i) {
+            LockGuard<Mutex> lock(mutex);
+        }
+
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_locks, 100);
+        TEST_EQ_UU(details.stats.num_contended_locks, 0);
+        TEST_TRUE(details.stats.sampled);
+    }
+
+    Mutex::SetLockTimingSampleRate(0);
+
+    {
+        Mutex mutex;
+
+        for (int i = 0; i < 100; ++i) {
+            LockGuard<Mutex> lock(mutex);
+        }
+
+        MutexDetails details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_locks, 100);
+        TEST_EQ_UU(details.stats.total_lock_wait_ticks, 0);
+        TEST_EQ_UU(details.stats.min_lock_wait_ticks, UINT64_MAX);
+
+        // contended locks are still timed.
+        Contend(&mutex);
+
+        details = GetDetails(mutex.GetMetadata());
+        TEST_EQ_UU(details.stats.num_contended_locks, 1);
+        TEST_GT_UU(details.stats.total_lock_wait_ticks, 0);
+        TEST_EQ_UU(details.stats.min_lock_wait_ticks, details.stats.max_lock_wait_ticks);
+    }
+
+    Mutex::SetLockTimingSampleRate(1);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestMetadataSnapshot() {
+#if MUTEX_DEBUGGING
+    uint64_t change_counter = Mutex::GetMetadataChangeCounter();
+    TEST_NE_UU(change_counter, 0);
+
+    std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> old_snapshot = Mutex::GetAllMetadataSnapshot();
+    TEST_EQ_PP(Mutex::GetAllMetadataSnapshot().get(), old_snapshot.get());
+    size_t old_size = old_snapshot->size();
+
+    // Enough to exceed the pending change limit a few times over.
+    std::vector<std::unique_ptr<Mutex>> mutexes;
+    for (size_t i = 0; i < 1000; ++i) {
+        mutexes.push_back(std::make_unique<Mutex>());
+    }
+
+    TEST_EQ_UU(Mutex::GetMetadataChangeCounter(), change_counter + 1000);
+
+    // The old snapshot is unaffected.
+    TEST_EQ_UU(old_snapshot->size(), old_size);
+
+    std::shared_ptr<const std::vector<std::shared_ptr<MutexMetadata>>> snapshot = Mutex::GetAllMetadataSnapshot();
+    TEST_EQ_UU(snapshot->size(), old_size + 1000);
+    for (const std::unique_ptr<Mutex> &mutex : mutexes) {
+        TEST_TRUE(IsInMetadataList(mutex->GetMetadata()));
+    }
+
+    const MutexMetadata *metadata = mutexes[500]->GetMetadata();
+    mutexes.erase(mutexes.begin() + 500);
+    TEST_FALSE(IsInMetadataList(metadata));
+
+    // The snapshot holds a ref, so this is still valid.
+    bool found = false;
+    for (const std::shared_ptr<MutexMetadata> &m : *snapshot) {
+        if (m.get() == metadata) {
+            MutexDetails details;
+            m->GetDetails(&details);
+            found = true;
+        }
+    }
+    TEST_TRUE(found);
+
+    mutexes.clear();
+    TEST_EQ_UU(Mutex::GetAllMetadata().size(), old_size);
+    TEST_EQ_UU(Mutex::GetMetadataChangeCounter(), change_counter + 2000);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestConditionVariable() {
+    Mutex mutex;
+    ConditionVariable cv;
+    MUTEX_SET_NAME(cv, "cv");
+
+    {
+        UniqueLock<Mutex> lock(mutex);
+        TEST_FALSE(cv.wait_for(lock, std::chrono::milliseconds(1)));
+        TEST_TRUE(lock.owns_lock());
+        TEST_FALSE(cv.wait_for(lock, std::chrono::milliseconds(1), []() {
+            return false;
+        }));
+    }
+
+    int value = 0;
+    std::thread thread([&mutex, &cv, &value]() {
+        for (int i = 1; i <= 3; ++i) {
+            SleepMS(5);
+            {
+                LockGuard<Mutex> lock(mutex);
+                value = i;
+            }
+            cv.notify_one();
+        }
+    });
+
+    {
+        UniqueLock<Mutex> lock(mutex);
+        cv.wait(lock, [&value]() {
+            return value >= 1;
+        });
+        TEST_GE_II(value, 1);
+        TEST_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&value]() {
+            return value == 3;
+        }));
+    }
+
+    thread.join();
+
+    // Ensure the lock can still be taken normally.
+    {
+        LockGuard<Mutex> lock(mutex);
+        TEST_EQ_II(value, 3);
+    }
+
+    cv.notify_all();
+
+#if MUTEX_DEBUGGING
+    MutexDetails details = GetDetails(cv.GetMetadata());
+    TEST_EQ_UU(details.type, MutexType_ConditionVariable);
+    TEST_EQ_SS(details.name, "cv");
+    TEST_EQ_UU(details.stats.num_wait_timeouts, 2);
+    TEST_EQ_UU(details.stats.num_waits, details.stats.num_wakeups + details.stats.num_wait_timeouts);
+    TEST_EQ_UU(details.stats.num_notify_ones, 3);
+    TEST_EQ_UU(details.stats.num_notify_alls, 1);
+    TEST_GT_UU(details.stats.total_wait_ticks, 0);
+    TEST_GE_UU(details.stats.total_wait_ticks, details.stats.max_wait_ticks);
+    TEST_GE_UU(details.stats.total_wakeup_ticks, details.stats.max_wakeup_ticks);
+    TEST_TRUE(IsInMetadataList(cv.GetMetadata()));
+
+    cv.GetMutableMetadata()->RequestReset();
+    details = GetDetails(cv.GetMetadata());
+    TEST_EQ_UU(details.stats.num_waits, 0);
+    TEST_EQ_UU(details.stats.num_notify_ones, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTraceEvents() {
+#if MUTEX_DEBUGGING
+    Mutex mutex;
+    MUTEX_SET_NAME(mutex, "traced");
+
+    ClearTraceEvents();
+
+    // Not interesting yet.
+    Contend(&mutex);
+
+    std::string json;
+    GetChromeTraceJSON(&json);
+    TEST_TRUE(json.find("traced") == std::string::npos);
+
+    mutex.GetMutableMetadata()->SetInterestingEvents(MutexInterestingEvent_Lock | MutexInterestingEvent_ContendedLock | MutexInterestingEvent_Unlock);
+    Contend(&mutex);
+
+    TEST_TRUE(mutex.try_lock());
+    mutex.unlock();
+
+    GetChromeTraceJSON(&json);
+    printf("%s", json.c_str());
+
+    TEST_TRUE(json.find("\"ph\":\"B\",\"cat\":\"mutex\",\"name\":\"traced\"") != std::string::npos);
+    TEST_TRUE(json.find("\"ph\":\"E\",\"cat\":\"mutex\",\"name\":\"traced\"") != std::string::npos);
+    TEST_TRUE(json.find("\"ph\":\"X\",\"cat\":\"mutex_wait\",\"name\":\"traced\"") != std::string::npos);
+
+    // Renaming is picked up.
+    MUTEX_SET_NAME(mutex, "renamed");
+    {
+        LockGuard<Mutex> lock(mutex);
+    }
+
+    GetChromeTraceJSON(&json);
+    TEST_TRUE(json.find("renamed") != std::string::npos);
+
+    ClearTraceEvents();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Threads get a TicketMutex in the order they asked for it, even if the
+// unlocking thread immediately tries to lock it again.
+static void TestTicketMutex() {
+    TicketMutex mutex;
+    MUTEX_SET_NAME(mutex, "ticket");
+
+    Mutex order_mutex;
+    std::vector<int> order;
+
+    mutex.lock();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 3; ++i) {
+        threads.emplace_back([i, &mutex, &order_mutex, &order]() {
+            LockGuard<TicketMutex> lock(mutex);
+
+            LockGuard<Mutex> order_lock(order_mutex);
+            order.push_back(i);
+        });
+
+        // Make sure it's in the queue before the next one.
+        WaitForWaiters(&mutex, (uint32_t)i + 1);
+    }
+
+    mutex.unlock();
+    TEST_FALSE(mutex.try_lock());
+    mutex.lock();
+
+    {
+        LockGuard<Mutex> order_lock(order_mutex);
+        TEST_EQ_UU(order.size(), 3);
+        for (size_t i = 0; i < order.size(); ++i) {
+            TEST_EQ_II(order[i], (int)i);
+        }
+    }
+
+    mutex.unlock();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    TEST_TRUE(mutex.try_lock());
+    mutex.unlock();
+
+#if MUTEX_DEBUGGING
+    MutexDetails details = GetDetails(mutex.GetMetadata());
+    TEST_EQ_UU(details.type, MutexType_TicketMutex);
+    TEST_EQ_SS(details.name, "ticket");
+    TEST_EQ_UU(details.stats.num_locks, 5);
+    TEST_EQ_UU(details.stats.num_contended_locks, 4);
+    TEST_EQ_UU(details.stats.num_barges, 0);
+    TEST_EQ_UU(details.stats.max_consecutive_barges, 0);
+    TEST_TRUE(IsInMetadataList(mutex.GetMetadata()));
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// Unlocking and immediately relocking, while another thread is waiting, is
+// a barge. The waiter has to wake up before it can take the lock, so the
+// relock nearly always gets in first - but try a few times, just in case.
+template <class MutexType>
+static void TestBarges() {
+#if MUTEX_DEBUGGING
+    MutexType mutex;
+
+    for (int i = 0; i < 10; ++i) {
+        mutex.lock();
+
+        std::thread thread([&mutex]() {
+            LockGuard<MutexType> lock(mutex);
+        });
+
+        WaitForWaiters(&mutex, 1);
+
+        mutex.unlock();
+        mutex.lock();
+        mutex.unlock();
+
+        thread.join();
+
+        if (GetDetails(mutex.GetMetadata()).stats.num_barges != 0) {
+            break;
+        }
+    }
+
+    MutexDetails details = GetDetails(mutex.GetMetadata());
+    TEST_GE_UU(details.stats.num_barges, 1);
+    TEST_GE_UU(details.stats.max_consecutive_barges, 1);
+    TEST_EQ_UU(details.stats.num_waiters, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestTimedLock() {
+    Mutex mutex;
+
+    TEST_TRUE(mutex.try_lock_for(std::chrono::milliseconds(10)));
+    mutex.unlock();
+
+    std::atomic<bool> locked{false};
+    std::atomic<bool> release{false};
+    std::thread thread([&mutex, &locked, &release]() {
+        LockGuard<Mutex> lock(mutex);
+        locked.store(true, std::memory_order_release);
+
+        while (!release.load(std::memory_order_acquire)) {
+            SleepMS(1);
+        }
+    });
+
+    while (!locked.load(std::memory_order_acquire)) {
+        SleepMS(1);
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    TEST_FALSE(mutex.try_lock_for(std::chrono::milliseconds(20)));
+    TEST_GE_II(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count(), 20);
+
+    {
+        UniqueLock<Mutex> lock(mutex, DEFER_LOCK);
+        TEST_FALSE(lock.owns_lock());
+        TEST_FALSE(lock.try_lock());
+        TEST_FALSE(lock.try_lock_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(1)));
+
+        release.store(true, std::memory_order_release);
+
+        TEST_TRUE(lock.try_lock_for(std::chrono::seconds(10)));
+        TEST_TRUE(lock.owns_lock());
+    }
+
+    thread.join();
+
+#if MUTEX_DEBUGGING
+    MutexDetails details = GetDetails(mutex.GetMetadata());
+    TEST_EQ_UU(details.stats.num_lock_timeouts, 2);
+    TEST_EQ_UU(details.stats.num_locks, 3);
+    TEST_EQ_UU(details.stats.num_try_locks, 1);
+    TEST_EQ_UU(details.stats.num_successful_try_locks, 0);
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main() {
+    TestMetadataAlignment();
+    TestSharedMutexStats();
+    TestSharedMutexPreferWriters();
+    TestContentionProfiler();
+    TestLockTimingSampleRate();
+    TestMetadataSnapshot();
+    TestConditionVariable();
+    TestTraceEvents();
+    TestTicketMutex();
+    TestBarges<Mutex>();
+    TestBarges<SharedMutex>();
+    TestTimedLock();
+}
@@ -0,0 +1,360 @@
+// Relacy models of the lock-free and racy bits of the library. The models
+// run the real code, from shared/lockfree.h, on cut-down structs. The bits
+// around it - the locking in GetAllMetadataSnapshot and so on - are copies,
+// so if you change those, change the model too.
+//
+// Only built when SHARED_RELACY_PATH points at a Relacy checkout (the folder
+// containing the relacy folder). See tests/CMakeLists.txt.
+
+#define USE_RELACY 1
+#include <relacy/relacy_std.hpp>
+#include <shared/relacy.h>
+#include <shared/lockfree.h>
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// MutexMetadataImplBase::RequestReset vs the lock path
+// (RecordExclusiveLock/HandleResetRequest). The stats belong to the lock
+// holder, so RequestReset only sets the flag, and exactly one lock must pick
+// it up.
+struct ResetRequestTest : rl::test_suite<ResetRequestTest, 3> {
+    static const unsigned NUM_LOCKERS = 2;
+    static const unsigned NUM_LOCKS_PER_THREAD = 2;
+
+    std::mutex mutex;
+    std::atomic<bool> reset;
+    RVAR(uint64_t) num_locks;
+
+    void before() {
+        reset.store(false, RMO_RELAXED);
+        RVAL(num_locks) = 0;
+    }
+
+    void HandleResetRequest() {
+        if (TakeLockFreeRequest(&reset)) {
+            RVAL(num_locks) = 0;
+        }
+    }
+
+    void thread(unsigned index) {
+        if (index < NUM_LOCKERS) {
+            for (unsigned i = 0; i < NUM_LOCKS_PER_THREAD; ++i) {
+                mutex.lock($);
+                RVAL(num_locks) = RVAL(num_locks) + 1;
+                this->HandleResetRequest();
+                mutex.unlock($);
+            }
+        } else {
+            PostLockFreeRequest(&reset);
+        }
+    }
+
+    void after() {
+        // If nothing picked the request up, nothing was reset. Otherwise,
+        // the lock that picked it up isn't counted.
+        if (reset.load(RMO_RELAXED)) {
+            RL_ASSERT(RVAL(num_locks) == NUM_LOCKERS * NUM_LOCKS_PER_THREAD);
+        } else {
+            RL_ASSERT(RVAL(num_locks) < NUM_LOCKERS * NUM_LOCKS_PER_THREAD);
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The TimerDef stripe seqlock: AddTicks (the writer) vs GetStripesTotals
+// (the reader) and GetTotalsAndReset, plus Reset if RESET. Each sample adds
+// NUM_TICKS ticks, half of them self time, and 1 to the perf counter, so
+// any torn read shows up as totals that don't match up.
+template <bool RESET>
+struct TimerDefStripeTest : rl::test_suite<TimerDefStripeTest<RESET>, 3> {
+    static const unsigned NUM_ADDS = 2;
+    static const uint64_t NUM_TICKS = 10;
+
+    struct Stripe {
+        std::atomic<uint32_t> seq;
+        std::atomic<uint64_t> total_num_ticks;
+        std::atomic<uint64_t> num_samples;
+        std::atomic<uint64_t> self_num_ticks;
+        std::atomic<uint64_t> perf_counters[1];
+    };
+
+    struct Totals {
+        uint64_t total_num_ticks = 0;
+        uint64_t num_samples = 0;
+        uint64_t self_num_ticks = 0;
+        uint64_t perf_counters[1] = {};
+    };
+
+    Stripe stripe;
+    RVAR(uint64_t) num_taken_samples;
+
+    void before() {
+        stripe.seq.store(0, RMO_RELAXED);
+        stripe.total_num_ticks.store(0, RMO_RELAXED);
+        stripe.num_samples.store(0, RMO_RELAXED);
+        stripe.self_num_ticks.store(0, RMO_RELAXED);
+        stripe.perf_counters[0].store(0, RMO_RELAXED);
+        RVAL(num_taken_samples) = 0;
+    }
+
+    static void CheckTotals(const Totals &totals) {
+        RL_ASSERT(totals.num_samples <= NUM_ADDS);
+        RL_ASSERT(totals.total_num_ticks == totals.num_samples * NUM_TICKS);
+        RL_ASSERT(totals.self_num_ticks == totals.num_samples * NUM_TICKS / 2);
+        RL_ASSERT(totals.perf_counters[0] == totals.num_samples);
+    }
+
+    void thread(unsigned index) {
+        if (index == 0) {
+            static const uint64_t PERF_COUNTER_DELTAS[1] = {1};
+
+            for (unsigned i = 0; i < NUM_ADDS; ++i) {
+                AddToTimerDefStripe(&stripe, NUM_TICKS, NUM_TICKS / 2, PERF_COUNTER_DELTAS);
+            }
+        } else if (index == 1) {
+            for (int i = 0; i < 2; ++i) {
+                Totals totals;
+                RL_ASSERT(AddTimerDefStripeTotals(&stripe, 0, &totals));
+                CheckTotals(totals);
+            }
+        } else {
+            Totals totals;
+            TakeTimerDefStripe(&stripe, &totals);
+            CheckTotals(totals);
+            RVAL(num_taken_samples) = totals.num_samples;
+
+            if (RESET) {
+                ResetTimerDefStripe(&stripe);
+            }
+        }
+    }
+
+    void after() {
+        Totals totals;
+        RL_ASSERT(AddTimerDefStripeTotals(&stripe, 1, &totals));
+        CheckTotals(totals);
+
+        // GetTotalsAndReset doesn't lose anything. Reset does, of course.
+        if (RESET) {
+            RL_ASSERT(RVAL(num_taken_samples) + totals.num_samples <= NUM_ADDS);
+        } else {
+            RL_ASSERT(RVAL(num_taken_samples) + totals.num_samples == NUM_ADDS);
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The mutex metadata registry: PushRegistryChange,
+// ApplyLockedRegistryChanges and Mutex::GetAllMetadataSnapshot. Each entry
+// is a bit in a mask, rather than a shared_ptr in a vector. Once a push has
+// returned, any snapshot requested after that must include it.
+struct RegistryTest : rl::test_suite<RegistryTest, 3> {
+    static const unsigned NUM_PUSHERS = 2;
+
+    // Low enough that the pushers apply changes too.
+    static const uint64_t MAX_NUM_PENDING_CHANGES = 2;
+
+    struct Change {
+        RVAR(Change *) next;
+        RVAR(uint32_t) bit;
+    };
+
+    Change changes[NUM_PUSHERS];
+    std::atomic<bool> pushed[NUM_PUSHERS];
+
+    std::atomic<Change *> pending_changes_head;
+    std::atomic<uint64_t> num_pending_changes;
+
+    std::mutex apply_mutex;
+    RVAR(uint32_t) all_mask;
+
+    std::mutex snapshot_mutex;
+    RVAR(bool) snapshot_valid;
+    RVAR(uint32_t) snapshot_mask;
+
+    void before() {
+        for (unsigned i = 0; i < NUM_PUSHERS; ++i) {
+            RVAL(changes[i].next) = nullptr;
+            RVAL(changes[i].bit) = 0;
+            pushed[i].store(false, RMO_RELAXED);
+        }
+
+        pending_changes_head.store(nullptr, RMO_RELAXED);
+        num_pending_changes.store(0, RMO_RELAXED);
+        RVAL(all_mask) = 0;
+        RVAL(snapshot_valid) = true;
+        RVAL(snapshot_mask) = 0;
+    }
+
+    // Call with apply_mutex held.
+    void ApplyLockedChanges() {
+        Change *change;
+        TakeRegistryChangesLockFree(this, &change, [this]() {
+            snapshot_mutex.lock($);
+            RVAL(snapshot_valid) = false;
+            snapshot_mutex.unlock($);
+        });
+
+        while (change) {
+            RVAL(all_mask) = RVAL(all_mask) | RVAL(change->bit);
+            change = RVAL(change->next);
+        }
+    }
+
+    void Push(Change *change) {
+        if (PushRegistryChangeLockFree(this, change) >= MAX_NUM_PENDING_CHANGES) {
+            if (apply_mutex.try_lock($)) {
+                this->ApplyLockedChanges();
+                apply_mutex.unlock($);
+            }
+        }
+    }
+
+    uint32_t GetSnapshot() {
+        if (!pending_changes_head.load(RMO_ACQUIRE)) {
+            snapshot_mutex.lock($);
+            if (RVAL(snapshot_valid)) {
+                uint32_t mask = RVAL(snapshot_mask);
+                snapshot_mutex.unlock($);
+                return mask;
+            }
+            snapshot_mutex.unlock($);
+        }
+
+        apply_mutex.lock($);
+
+        this->ApplyLockedChanges();
+
+        snapshot_mutex.lock($);
+        if (!RVAL(snapshot_valid)) {
+            RVAL(snapshot_mask) = RVAL(all_mask);
+            RVAL(snapshot_valid) = true;
+        }
+        uint32_t mask = RVAL(snapshot_mask);
+        snapshot_mutex.unlock($);
+
+        apply_mutex.unlock($);
+
+        return mask;
+    }
+
+    void thread(unsigned index) {
+        if (index < NUM_PUSHERS) {
+            RVAL(changes[index].bit) = 1u << index;
+            this->Push(&changes[index]);
+            pushed[index].store(true, RMO_RELEASE);
+        } else {
+            for (int i = 0; i < 2; ++i) {
+                bool pushed0 = pushed[0].load(RMO_ACQUIRE);
+                bool pushed1 = pushed[1].load(RMO_ACQUIRE);
+
+                uint32_t mask = this->GetSnapshot();
+
+                if (pushed0) {
+                    RL_ASSERT(mask & 1);
+                }
+
+                if (pushed1) {
+                    RL_ASSERT(mask & 2);
+                }
+            }
+        }
+    }
+
+    void after() {
+        RL_ASSERT(this->GetSnapshot() == 3);
+        RL_ASSERT(num_pending_changes.load(RMO_RELAXED) == 0);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+// The per-thread trace buffer: AddTraceEvent vs GetTraceEvents, with a tiny
+// buffer so the writer laps the reader. Each slot field holds the event's
+// index + 1, so a torn or overwritten event shows up as a mismatch. The
+// reader must discard anything that might have been overwritten.
+struct TraceBufferTest : rl::test_suite<TraceBufferTest, 2> {
+    static const uint64_t NUM_EVENTS = 2;
+    static const uint64_t NUM_WRITES = 4;
+
+    struct Slot {
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint32_t> name_id;
+    };
+
+    struct Buffer {
+        std::atomic<bool> in_use;
+        std::atomic<uint64_t> write_index;
+        std::atomic<uint64_t> clear_index;
+        Slot slots[NUM_EVENTS];
+    };
+
+    Buffer buffer;
+
+    void before() {
+        for (uint64_t i = 0; i < NUM_EVENTS; ++i) {
+            buffer.slots[i].ticks.store(0, RMO_RELAXED);
+            buffer.slots[i].name_id.store(0, RMO_RELAXED);
+        }
+
+        // The buffer's owner is alive throughout.
+        buffer.in_use.store(true, RMO_RELAXED);
+        buffer.write_index.store(0, RMO_RELAXED);
+        buffer.clear_index.store(0, RMO_RELAXED);
+    }
+
+    void thread(unsigned index) {
+        if (index == 0) {
+            for (uint64_t i = 0; i < NUM_WRITES; ++i) {
+                WriteRingBufferSlot(&buffer, [i](Slot *slot) {
+                    slot->ticks.store(i + 1, RMO_RELAXED);
+                    slot->name_id.store((uint32_t)(i + 1), RMO_RELAXED);
+                });
+            }
+        } else {
+            uint64_t ticks[NUM_EVENTS];
+            uint32_t name_ids[NUM_EVENTS];
+            uint64_t num_read = 0;
+            uint64_t num_overwritten = ReadRingBufferSlots(&buffer, [&](const Slot *slot) {
+                RL_ASSERT(num_read < NUM_EVENTS);
+                ticks[num_read] = slot->ticks.load(RMO_RELAXED);
+                name_ids[num_read] = slot->name_id.load(RMO_RELAXED);
+                ++num_read;
+            });
+
+            RL_ASSERT(num_overwritten <= num_read);
+
+            // Whatever's left must be consecutive events.
+            for (uint64_t i = num_overwritten; i < num_read; ++i) {
+                RL_ASSERT(ticks[i] != 0);
+                RL_ASSERT(name_ids[i] == ticks[i]);
+
+                if (i > num_overwritten) {
+                    RL_ASSERT(ticks[i] == ticks[i - 1] + 1);
+                }
+            }
+        }
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main() {
+    bool good = true;
+
+    good = rl::simulate<ResetRequestTest>() && good;
+    good = rl::simulate<TimerDefStripeTest<false>>() && good;
+    good = rl::simulate<TimerDefStripeTest<true>>() && good;
+    good = rl::simulate<RegistryTest>() && good;
+    good = rl::simulate<TraceBufferTest>() && good;
+
+    return good ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include <shared/system.h>
+#include <shared/trace.h>
+#include <shared/testing.h>
+#include <thread>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static size_t CountOccurrences(const std::string &str, const std::string &needle) {
+    size_t n = 0;
+    for (size_t pos = str.find(needle); pos != std::string::npos; pos = str.find(needle, pos + 1)) {
+        ++n;
+    }
+
+    return n;
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestNames() {
+    uint32_t a = GetTraceNameID("a");
+    uint32_t b = GetTraceNameID("b");
+    TEST_NE_UU(a, 0);
+    TEST_NE_UU(b, 0);
+    TEST_NE_UU(a, b);
+    TEST_EQ_UU(GetTraceNameID("a"), a);
+    TEST_EQ_SS(GetTraceName(a), "a");
+    TEST_EQ_SS(GetTraceName(0), "");
+    TEST_EQ_SS(GetTraceName(UINT32_MAX), "");
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestEvents() {
+    ClearTraceEvents();
+
+    uint32_t category_id = GetTraceNameID("test");
+    uint32_t name_id = GetTraceNameID("quote\"d");
+
+    uint64_t ticks = GetCurrentTickCount();
+    AddTraceEvent(TraceEventType_Begin, category_id, name_id, ticks);
+    AddTraceEvent(TraceEventType_End, category_id, name_id, ticks + 1);
+
+    std::thread thread([category_id, name_id]() {
+        AddTraceEvent(TraceEventType_Complete, category_id, name_id, GetCurrentTickCount(), 100);
+        AddTraceEvent(TraceEventType_Instant, category_id, name_id, GetCurrentTickCount());
+    });
+    thread.join();
+
+    std::string json;
+    GetChromeTraceJSON(&json);
+    printf("%s", json.c_str());
+
+    TEST_EQ_UU(json.find("{\"traceEvents\":["), 0);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":"), 4);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"B\""), 1);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"E\""), 1);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"X\""), 1);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":\"i\""), 1);
+    TEST_EQ_UU(CountOccurrences(json, "\"dur\":"), 1);
+    TEST_EQ_UU(CountOccurrences(json, "\"name\":\"quote\\\"d\""), 4);
+    TEST_EQ_UU(CountOccurrences(json, "\"cat\":\"test\""), 4);
+
+    ClearTraceEvents();
+    GetChromeTraceJSON(&json);
+    TEST_EQ_UU(CountOccurrences(json, "\"ph\":"), 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+static void TestOverflow() {
+    ClearTraceEvents();
+
+    uint32_t category_id = GetTraceNameID("test");
+    uint32_t name_id = GetTraceNameID("overflow");
+
+    // Fresh thread, so this won't be sharing a buffer with any of the
+    // earlier ones.
+    std::thread thread([category_id, name_id]() {
+        for (size_t i = 0; i < TRACE_BUFFER_NUM_EVENTS * 2 + 10; ++i) {
+            AddTraceEvent(TraceEventType_Instant, category_id, name_id, GetCurrentTickCount());
+        }
+    });
+    thread.join();
+
+    std::string json;
+    GetChromeTraceJSON(&json);
+    TEST_EQ_UU(CountOccurrences(json, "\"name\":\"overflow\""), TRACE_BUFFER_NUM_EVENTS);
+}
+
+//////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////
+
+int main() {
+    TestNames();
+    TestEvents();
+    TestOverflow();
+}